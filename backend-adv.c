@@ -17,9 +17,9 @@ wl_backend_advertisement_request_info(struct wl_client *client,
 	struct wl_backend_advertisement *object;
 
 	object = (struct wl_backend_advertisement *) base;
-	wl_display_send_event (client->display, base, 0,
-			       object->backend->backend_name,
-			       object->backend->args);
+	wl_client_send_event (client, base, 0,
+			      object->backend->backend_name,
+			      object->backend->args);
 }
 
 static const struct wl_event backend_advertisement_events[] = {
@@ -79,8 +79,10 @@ int main(int argc, char *argv[])
 	image = gdk_pixbuf_new_from_file (argv[1], &error);
 
 	buffer = wl_buffer_for_pixbuf (display, image);
-	wl_surface_attach_buffer(surface, buffer);
+	wl_surface_attach_buffer(surface, buffer, WL_SURFACE_FORMAT_XRGB8888);
 	wl_surface_map(surface, 0, 0, 1280, 800);
+	wl_surface_lower(surface);
+	wl_display_commit(display, 0);
 
 	g_main_loop_run(loop);
 
@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "wayland.h"
+#include "capture.h"
+
+/* Records are appended through stdio, so capturing costs a copy into
+ * the stream buffer and a write for every few kilobytes. */
+
+struct wl_capture {
+	FILE *file;
+	uint64_t start;
+	uint32_t next_client;
+};
+
+struct wl_capture *
+wl_capture_create(const char *path)
+{
+	struct wl_capture *capture;
+
+	capture = malloc(sizeof *capture);
+	if (capture == NULL)
+		return NULL;
+
+	capture->file = fopen(path, "w");
+	if (capture->file == NULL) {
+		free(capture);
+		return NULL;
+	}
+
+	fwrite(WL_CAPTURE_MAGIC, 1, strlen(WL_CAPTURE_MAGIC), capture->file);
+	capture->start = wl_time_now();
+	capture->next_client = 0;
+
+	return capture;
+}
+
+void
+wl_capture_destroy(struct wl_capture *capture)
+{
+	fclose(capture->file);
+	free(capture);
+}
+
+/* Number a new client and record its connection. */
+
+uint32_t
+wl_capture_add_client(struct wl_capture *capture)
+{
+	uint32_t client = capture->next_client++;
+
+	wl_capture_record(capture, client, WL_CAPTURE_CONNECT, NULL, 0);
+
+	return client;
+}
+
+#define WL_CAPTURE_MAX_SIZE 0xffffff
+
+void
+wl_capture_record(struct wl_capture *capture, uint32_t client,
+		  uint32_t type, const struct iovec *iov, int count)
+{
+	struct wl_capture_record record;
+	struct iovec piece;
+	size_t size, offset;
+	int i;
+
+	for (i = 0, size = 0; i < count; i++)
+		size += iov[i].iov_len;
+
+	/* Data too large for one record is split up; the stream of a
+	 * client is just the concatenation of its records. */
+	if (size > WL_CAPTURE_MAX_SIZE) {
+		for (i = 0; i < count; i++) {
+			for (offset = 0; offset < iov[i].iov_len;
+			     offset += piece.iov_len) {
+				piece.iov_base =
+					(char *) iov[i].iov_base + offset;
+				piece.iov_len = iov[i].iov_len - offset;
+				if (piece.iov_len > WL_CAPTURE_MAX_SIZE)
+					piece.iov_len = WL_CAPTURE_MAX_SIZE;
+				wl_capture_record(capture, client, type,
+						  &piece, 1);
+			}
+		}
+		return;
+	}
+
+	record.time = wl_time_now() - capture->start;
+	record.client = client;
+	record.type_size = type << 24 | size;
+	fwrite(&record, sizeof record, 1, capture->file);
+	for (i = 0; i < count; i++)
+		fwrite(iov[i].iov_base, 1, iov[i].iov_len, capture->file);
+}
@@ -0,0 +1,40 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+/* Capture files record the byte streams of all client connections
+ * of a server session.  After an 8 byte magic the file is a sequence
+ * of records, each a header followed by size bytes of data.  Times
+ * are nanoseconds since the capture started; clients are numbered
+ * in the order they connected. */
+
+#define WL_CAPTURE_MAGIC "WLCAP001"
+
+enum {
+	WL_CAPTURE_CONNECT,
+	WL_CAPTURE_DISCONNECT,
+	WL_CAPTURE_REQUEST,	/* client to server */
+	WL_CAPTURE_EVENT	/* server to client */
+};
+
+struct wl_capture_record {
+	uint64_t time;
+	uint32_t client;
+	/* Type in the top 8 bits, size in the rest. */
+	uint32_t type_size;
+};
+
+#define WL_CAPTURE_TYPE(r) ((r)->type_size >> 24)
+#define WL_CAPTURE_SIZE(r) ((r)->type_size & 0xffffff)
+
+struct wl_capture;
+struct iovec;
+
+struct wl_capture *wl_capture_create(const char *path);
+void wl_capture_destroy(struct wl_capture *capture);
+uint32_t wl_capture_add_client(struct wl_capture *capture);
+void wl_capture_record(struct wl_capture *capture, uint32_t client,
+		       uint32_t type, const struct iovec *iov, int count);
+
+#endif
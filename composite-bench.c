@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "wayland.h"
+
+/* Times a software repaint the way the fb and headless compositors
+ * do it: fill a 1920x1080 frame with the background, blend a dozen
+ * overlapping windows over it and copy the result out.  The windows
+ * are opaque inside a translucent 16 pixel drop shadow, like a
+ * decorated toplevel.  Each set of kernels the CPU runs is timed in
+ * turn. */
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define WINDOWS 12
+#define SHADOW 16
+#define FRAMES 200
+
+static void
+init_window(struct wl_image *image, int width, int height, uint32_t color)
+{
+	uint32_t a, *p;
+	int x, y, d;
+
+	image->width = width;
+	image->height = height;
+	image->stride = width * 4;
+	image->data = malloc(image->stride * height);
+	if (image->data == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (y = 0; y < height; y++) {
+		p = image->data + y * width;
+		for (x = 0; x < width; x++) {
+			d = x;
+			if (width - 1 - x < d)
+				d = width - 1 - x;
+			if (y < d)
+				d = y;
+			if (height - 1 - y < d)
+				d = height - 1 - y;
+			if (d >= SHADOW) {
+				p[x] = color;
+			} else {
+				a = (d + 1) * 0x60 / SHADOW;
+				p[x] = a << 24;
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *kernels[] = { "scalar", "sse2", "avx2" };
+	struct wl_image frame, fb, windows[WINDOWS];
+	int x[WINDOWS], y[WINDOWS];
+	uint64_t start, elapsed;
+	int i, j, k;
+
+	frame.width = fb.width = WIDTH;
+	frame.height = fb.height = HEIGHT;
+	frame.stride = fb.stride = WIDTH * 4;
+	frame.data = malloc(frame.stride * HEIGHT);
+	fb.data = malloc(fb.stride * HEIGHT);
+	if (frame.data == NULL || fb.data == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < WINDOWS; i++) {
+		init_window(&windows[i], 640 + i * 32, 480 + i * 16,
+			    0xff000000 | (i * 0x151515));
+		x[i] = (i % 4) * 400 + (i / 4) * 60;
+		y[i] = (i / 4) * 280 + (i % 4) * 30;
+	}
+
+	for (k = 0; k < ARRAY_LENGTH(kernels); k++) {
+		if (wl_composite_set_kernel(kernels[k]) < 0)
+			continue;
+
+		start = wl_time_now();
+		for (j = 0; j < FRAMES; j++) {
+			wl_composite_fill(&frame, NULL, 0, 0, WIDTH, HEIGHT,
+					  0xff002040);
+			for (i = 0; i < WINDOWS; i++)
+				wl_composite_image(&frame, NULL, x[i], y[i],
+						   &windows[i],
+						   WL_COMPOSITE_OVER);
+			wl_composite_image(&fb, NULL, 0, 0, &frame,
+					   WL_COMPOSITE_SRC);
+		}
+		elapsed = wl_time_now() - start;
+
+		printf("%-8s %dx%d, %d windows: %6.2f ms/frame, %6.1f fps\n",
+		       kernels[k], WIDTH, HEIGHT, WINDOWS,
+		       elapsed / 1e6 / FRAMES, FRAMES * 1e9 / elapsed);
+	}
+
+	for (i = 0; i < WINDOWS; i++)
+		free(windows[i].data);
+	free(frame.data);
+	free(fb.data);
+
+	return 0;
+}
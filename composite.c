@@ -0,0 +1,394 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "wayland.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Software composition for compositors without GL: solid fills,
+ * opaque copies and premultiplied ARGB over, clipped to the
+ * destination and an optional clip rectangle.  The span kernels come
+ * in scalar, SSE2 and AVX2 versions; the best one the CPU supports is
+ * picked the first time anything is drawn, unless WAYLAND_COMPOSITE
+ * names one.  SRC spans are plain memcpy, which libc already
+ * vectorizes. */
+
+struct wl_composite_impl {
+	const char *name;
+	void (*over)(uint32_t *dst, const uint32_t *src, int count);
+	void (*fill)(uint32_t *dst, uint32_t color, int count);
+};
+
+/* dst * (255 - alpha) / 255 + src, with the usual rounding trick for
+ * the division. */
+
+static inline uint32_t
+blend_over(uint32_t dst, uint32_t src)
+{
+	uint32_t a = 255 - (src >> 24), rb, g;
+
+	if (a == 0)
+		return src;
+	if (a == 255)
+		return dst + src;
+
+	rb = (dst & 0xff00ff) * a + 0x800080;
+	rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+	g = (dst & 0xff00ff00) >> 8;
+	g = g * a + 0x800080;
+	g = (g + ((g >> 8) & 0xff00ff)) & 0xff00ff00;
+
+	return src + rb + g;
+}
+
+static void
+over_scalar(uint32_t *dst, const uint32_t *src, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = blend_over(dst[i], src[i]);
+}
+
+static void
+fill_scalar(uint32_t *dst, uint32_t color, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = color;
+}
+
+static const struct wl_composite_impl scalar_impl = {
+	"scalar", over_scalar, fill_scalar
+};
+
+#ifdef HAVE_X86_SIMD
+
+/* Four pixels at a time: spread each channel to 16 bits, multiply
+ * by the inverted source alpha broadcast across its pixel, divide by
+ * 255 and add the source.  Fully opaque and fully transparent groups
+ * skip the arithmetic, which is most of a typical window. */
+
+static inline __m128i __attribute__ ((target("sse2")))
+over_sse2_4(__m128i d, __m128i s)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16(0xff);
+	const __m128i half = _mm_set1_epi16(0x80);
+	__m128i lo, hi, alo, ahi;
+
+	lo = _mm_unpacklo_epi8(d, zero);
+	hi = _mm_unpackhi_epi8(d, zero);
+	alo = _mm_unpacklo_epi8(s, zero);
+	ahi = _mm_unpackhi_epi8(s, zero);
+	alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(alo, 0xff), 0xff);
+	ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(ahi, 0xff), 0xff);
+	alo = _mm_xor_si128(alo, ones);
+	ahi = _mm_xor_si128(ahi, ones);
+
+	lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), half);
+	hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), half);
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+	return _mm_adds_epu8(_mm_packus_epi16(lo, hi), s);
+}
+
+static void __attribute__ ((target("sse2")))
+over_sse2(uint32_t *dst, const uint32_t *src, int count)
+{
+	const __m128i amask = _mm_set1_epi32(0xff000000);
+	__m128i s, d, a;
+	int i, m;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		s = _mm_loadu_si128((const __m128i *) (src + i));
+		a = _mm_and_si128(s, amask);
+		m = _mm_movemask_epi8(_mm_cmpeq_epi32(a, amask));
+		if (m == 0xffff) {
+			_mm_storeu_si128((__m128i *) (dst + i), s);
+			continue;
+		}
+		m = _mm_movemask_epi8(_mm_cmpeq_epi32(s,
+						      _mm_setzero_si128()));
+		if (m == 0xffff)
+			continue;
+
+		d = _mm_loadu_si128((const __m128i *) (dst + i));
+		_mm_storeu_si128((__m128i *) (dst + i), over_sse2_4(d, s));
+	}
+
+	over_scalar(dst + i, src + i, count - i);
+}
+
+static void __attribute__ ((target("sse2")))
+fill_sse2(uint32_t *dst, uint32_t color, int count)
+{
+	__m128i c = _mm_set1_epi32(color);
+	int i;
+
+	for (i = 0; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i *) (dst + i), c);
+
+	fill_scalar(dst + i, color, count - i);
+}
+
+static const struct wl_composite_impl sse2_impl = {
+	"sse2", over_sse2, fill_sse2
+};
+
+/* The same eight pixels at a time.  Unpack and pack work within each
+ * 128-bit lane, so the pixels come back out in order. */
+
+static inline __m256i __attribute__ ((target("avx2")))
+over_avx2_8(__m256i d, __m256i s)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(0xff);
+	const __m256i half = _mm256_set1_epi16(0x80);
+	__m256i lo, hi, alo, ahi;
+
+	lo = _mm256_unpacklo_epi8(d, zero);
+	hi = _mm256_unpackhi_epi8(d, zero);
+	alo = _mm256_unpacklo_epi8(s, zero);
+	ahi = _mm256_unpackhi_epi8(s, zero);
+	alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(alo, 0xff), 0xff);
+	ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(ahi, 0xff), 0xff);
+	alo = _mm256_xor_si256(alo, ones);
+	ahi = _mm256_xor_si256(ahi, ones);
+
+	lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, alo), half);
+	hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, ahi), half);
+	lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)),
+			       8);
+	hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)),
+			       8);
+
+	return _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), s);
+}
+
+static void __attribute__ ((target("avx2")))
+over_avx2(uint32_t *dst, const uint32_t *src, int count)
+{
+	const __m256i amask = _mm256_set1_epi32(0xff000000);
+	__m256i s, d, a;
+	int i, m;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		s = _mm256_loadu_si256((const __m256i *) (src + i));
+		a = _mm256_and_si256(s, amask);
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, amask));
+		if (m == -1) {
+			_mm256_storeu_si256((__m256i *) (dst + i), s);
+			continue;
+		}
+		if (_mm256_testz_si256(s, s))
+			continue;
+
+		d = _mm256_loadu_si256((const __m256i *) (dst + i));
+		_mm256_storeu_si256((__m256i *) (dst + i),
+				    over_avx2_8(d, s));
+	}
+
+	over_sse2(dst + i, src + i, count - i);
+}
+
+static void __attribute__ ((target("avx2")))
+fill_avx2(uint32_t *dst, uint32_t color, int count)
+{
+	__m256i c = _mm256_set1_epi32(color);
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+		_mm256_storeu_si256((__m256i *) (dst + i), c);
+
+	fill_sse2(dst + i, color, count - i);
+}
+
+static const struct wl_composite_impl avx2_impl = {
+	"avx2", over_avx2, fill_avx2
+};
+
+#endif
+
+static const struct wl_composite_impl *impls[] = {
+#ifdef HAVE_X86_SIMD
+	&avx2_impl,
+	&sse2_impl,
+#endif
+	&scalar_impl
+};
+
+static const struct wl_composite_impl *impl;
+
+static int
+wl_composite_supported(const struct wl_composite_impl *impl)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (impl == &avx2_impl)
+		return __builtin_cpu_supports("avx2");
+	if (impl == &sse2_impl)
+		return __builtin_cpu_supports("sse2");
+#endif
+
+	return 1;
+}
+
+/* Use the named kernels; fails if there are none by that name or the
+ * CPU can't run them. */
+
+WL_EXPORT int
+wl_composite_set_kernel(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_LENGTH(impls); i++) {
+		if (strcmp(name, impls[i]->name) != 0)
+			continue;
+		if (!wl_composite_supported(impls[i]))
+			return -1;
+		impl = impls[i];
+		return 0;
+	}
+
+	return -1;
+}
+
+static const struct wl_composite_impl *
+wl_composite_get_impl(void)
+{
+	const char *name;
+	int i;
+
+	/* Racing threads all pick the same kernels, so no lock is
+	 * needed. */
+	if (impl != NULL)
+		return impl;
+
+	name = getenv("WAYLAND_COMPOSITE");
+	if (name != NULL && wl_composite_set_kernel(name) == 0)
+		return impl;
+	if (name != NULL)
+		fprintf(stderr, "can't use composite kernels %s\n", name);
+
+	for (i = 0; i < ARRAY_LENGTH(impls); i++)
+		if (wl_composite_supported(impls[i]))
+			break;
+	impl = impls[i];
+
+	return impl;
+}
+
+WL_EXPORT const char *
+wl_composite_get_kernel(void)
+{
+	return wl_composite_get_impl()->name;
+}
+
+/* Intersect the rectangle with the image and the clip; returns 0 if
+ * nothing is left. */
+
+static int
+wl_composite_clip(const struct wl_image *dst, const struct wl_map *clip,
+		  int32_t *x0, int32_t *y0, int32_t *x1, int32_t *y1)
+{
+	if (*x0 < 0)
+		*x0 = 0;
+	if (*y0 < 0)
+		*y0 = 0;
+	if (*x1 > dst->width)
+		*x1 = dst->width;
+	if (*y1 > dst->height)
+		*y1 = dst->height;
+
+	if (clip != NULL) {
+		if (*x0 < clip->x)
+			*x0 = clip->x;
+		if (*y0 < clip->y)
+			*y0 = clip->y;
+		if (*x1 > clip->x + clip->width)
+			*x1 = clip->x + clip->width;
+		if (*y1 > clip->y + clip->height)
+			*y1 = clip->y + clip->height;
+	}
+
+	return *x0 < *x1 && *y0 < *y1;
+}
+
+WL_EXPORT void
+wl_composite_fill(struct wl_image *dst, const struct wl_map *clip,
+		  int32_t x, int32_t y, int32_t width, int32_t height,
+		  uint32_t color)
+{
+	const struct wl_composite_impl *impl = wl_composite_get_impl();
+	int32_t x0 = x, y0 = y, x1 = x + width, y1 = y + height;
+	char *row;
+
+	if (!wl_composite_clip(dst, clip, &x0, &y0, &x1, &y1))
+		return;
+
+	row = (char *) dst->data + y0 * dst->stride + x0 * 4;
+	for (; y0 < y1; y0++, row += dst->stride)
+		impl->fill((uint32_t *) row, color, x1 - x0);
+}
+
+/* Draw src unscaled with its top left corner at x, y. */
+
+WL_EXPORT void
+wl_composite_image(struct wl_image *dst, const struct wl_map *clip,
+		   int32_t x, int32_t y, const struct wl_image *src,
+		   uint32_t op)
+{
+	const struct wl_composite_impl *impl = wl_composite_get_impl();
+	int32_t x0 = x, y0 = y, x1 = x + src->width, y1 = y + src->height;
+	const char *s;
+	char *d;
+
+	if (!wl_composite_clip(dst, clip, &x0, &y0, &x1, &y1))
+		return;
+
+	d = (char *) dst->data + y0 * dst->stride + x0 * 4;
+	s = (const char *) src->data + (y0 - y) * src->stride + (x0 - x) * 4;
+	for (; y0 < y1; y0++, d += dst->stride, s += src->stride) {
+		if (op == WL_COMPOSITE_SRC)
+			memcpy(d, s, (x1 - x0) * 4);
+		else
+			impl->over((uint32_t *) d, (const uint32_t *) s,
+				   x1 - x0);
+	}
+}
+
+/* Expand an RGB565 buffer the size of dst into opaque XRGB, so the
+ * span kernels above only ever see 32 bit pixels.  The low bits of
+ * each channel are filled from the high ones, so white stays white. */
+
+WL_EXPORT void
+wl_composite_convert_rgb565(struct wl_image *dst,
+			    const void *src, int32_t stride)
+{
+	const uint16_t *s;
+	uint32_t *d, p, r, g, b;
+	int32_t x, y;
+
+	for (y = 0; y < dst->height; y++) {
+		s = (const uint16_t *) ((const char *) src + y * stride);
+		d = (uint32_t *) ((char *) dst->data + y * dst->stride);
+		for (x = 0; x < dst->width; x++) {
+			p = s[x];
+			r = (p >> 11) & 0x1f;
+			g = (p >> 5) & 0x3f;
+			b = p & 0x1f;
+			d[x] = 0xff000000 |
+				((r << 3 | r >> 2) << 16) |
+				((g << 2 | g >> 4) << 8) |
+				(b << 3 | b >> 2);
+		}
+	}
+}
@@ -13,48 +13,140 @@
 #include "wayland-backend.h"
 #include "evdev.h"
 
+/* Refresh rate in mHz, and how many milliseconds before each frame
+ * deadline the repaint starts. */
+#define REFRESH_RATE 60000
+#define REPAINT_LEAD 4
+
+#define BACKGROUND 0xff002040
+
 struct lame_compositor {
 	struct wl_compositor base;
-	void *fb;
-	int32_t width, height, stride;
+	struct wl_image fb;
+	/* Blending reads the destination, which is slow from the
+	 * write-combined framebuffer, so frames are composited here
+	 * and each tile is copied out once it's done. */
+	struct wl_image shadow;
+	struct wl_renderer *renderer;
+	struct wl_damage *damage;
+	struct wl_renderer_layer *layers;
+	int layer_alloc;
 	struct wl_display *wl_display;
+	struct wl_frame_clock *frame_clock;
+};
+
+struct surface_data {
+	struct wl_renderer_surface base;
+	struct wl_buffer *buffer;
+	void *data;
 };
 
+static void
+repaint(void *data)
+{
+	struct lame_compositor *lc = data;
+	struct wl_surface_iterator *iterator;
+	struct wl_surface *surface;
+	struct surface_data *sd;
+	int count = 0;
+
+	iterator = wl_surface_iterator_create(lc->wl_display, 0);
+	while (wl_surface_iterator_next(iterator, &surface)) {
+		sd = wl_surface_get_data(surface);
+		if (sd == NULL)
+			continue;
+		wl_renderer_surface_flush_damage(&sd->base, lc->damage);
+		if (sd->buffer == NULL)
+			continue;
+		sd->data = wl_buffer_get_data(sd->buffer);
+		if (sd->data == NULL) {
+			if (errno == ENOMEM)
+				fprintf(stderr, "swap buffers malloc failed\n");
+			else
+				fprintf(stderr, "gem pread failed: %m\n");
+			continue;
+		}
+		count = wl_renderer_surface_add_layer(&sd->base, sd->data,
+						      sd->buffer->stride,
+						      &lc->layers,
+						      &lc->layer_alloc, count);
+	}
+	wl_surface_iterator_destroy(iterator);
+
+	wl_renderer_render(lc->renderer, lc->layers, count, BACKGROUND);
+
+	iterator = wl_surface_iterator_create(lc->wl_display, 0);
+	while (wl_surface_iterator_next(iterator, &surface)) {
+		sd = wl_surface_get_data(surface);
+		if (sd == NULL || sd->data == NULL)
+			continue;
+		wl_buffer_free_data(sd->buffer, sd->data);
+		sd->data = NULL;
+	}
+	wl_surface_iterator_destroy(iterator);
+
+	wl_display_post_frame(lc->wl_display);
+}
+
 static void
 notify_surface_create(struct wl_compositor *compositor,
 		      struct wl_surface *surface)
 {
+	struct surface_data *sd;
+
+	sd = malloc(sizeof *sd);
+	if (sd == NULL)
+		return;
+
+	memset(sd, 0, sizeof *sd);
+	wl_renderer_surface_init(&sd->base);
+	wl_surface_set_data(surface, sd);
 }
 				   
 static void
 notify_surface_destroy(struct wl_compositor *compositor,
 		       struct wl_surface *surface)
 {
-	struct wl_buffer *b;
+	struct lame_compositor *lc = (struct lame_compositor *) compositor;
+	struct surface_data *sd;
 
-	b = wl_surface_get_data(surface);
-	if (b == NULL)
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
 		return;
 	
-	wl_buffer_destroy (b);
+	if (sd->buffer)
+		wl_buffer_destroy (sd->buffer);
+	wl_renderer_surface_damage_map(&sd->base, lc->damage);
+	wl_renderer_surface_fini(&sd->base);
+	free(sd);
+	wl_surface_set_data(surface, NULL);
+
+	wl_frame_clock_schedule(lc->frame_clock);
 }
 
 static void
 notify_surface_attach(struct wl_compositor *compositor,
 		      struct wl_surface *surface, uint32_t name, 
-		      uint32_t width, uint32_t height, uint32_t stride)
+		      uint32_t width, uint32_t height, uint32_t stride,
+		      uint32_t format)
 {
 	struct lame_compositor *lc = (struct lame_compositor *) compositor;
 	struct wl_backend *backend;
-	struct wl_buffer *b;
+	struct surface_data *sd;
 
 	backend = wl_display_get_backend (lc->wl_display);
-	b = wl_surface_get_data(surface);
-	if (b != NULL)
-		wl_buffer_destroy (b);
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
 
-	b = wl_backend_open_buffer (backend, width, height, stride, name);
-	wl_surface_set_data (surface, b);
+	if (sd->buffer != NULL)
+		wl_buffer_destroy (sd->buffer);
+
+	sd->buffer = wl_backend_open_buffer (backend, width, height,
+					     stride, name);
+
+	wl_renderer_surface_attach(&sd->base, lc->damage,
+				   width, height, format);
 }
 
 static void
@@ -62,32 +154,66 @@ notify_surface_map(struct wl_compositor *compositor,
 		   struct wl_surface *surface, struct wl_map *map)
 {
 	struct lame_compositor *lc = (struct lame_compositor *) compositor;
-	struct wl_buffer *b;
-	char *data, *dst;
-	int i;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
 
-	/* This part is where we actually copy the buffer to screen.
-	 * Needs to be part of the repaint loop, not in the notify_map
-	 * handler. */
+	wl_renderer_surface_map(&sd->base, lc->damage, map);
+}
+
+static void
+notify_surface_damage(struct wl_compositor *compositor,
+		      struct wl_surface *surface,
+		      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct lame_compositor *lc = (struct lame_compositor *) compositor;
+	struct surface_data *sd;
 
-	b = wl_surface_get_data(surface);
-	if (b == NULL)
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
 		return;
 
-	data = wl_buffer_get_data(b);
-	if (data == NULL) {
-		if (errno == ENOMEM)
-			fprintf(stderr, "swap buffers malloc failed\n");
-		else
-			fprintf(stderr, "gem pread failed: %m\n");
+	wl_renderer_surface_damage(&sd->base, lc->damage,
+				   x, y, width, height);
+}
+
+static void
+notify_commit(struct wl_compositor *compositor)
+{
+	struct lame_compositor *lc = (struct lame_compositor *) compositor;
+
+	wl_frame_clock_schedule(lc->frame_clock);
+}
+
+static void
+notify_surface_opaque(struct wl_compositor *compositor,
+		      struct wl_surface *surface,
+		      const struct wl_region *opaque)
+{
+	struct lame_compositor *lc = (struct lame_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
 		return;
-	}
 
-	dst = lc->fb + lc->stride * map->y + map->x * 4;
-	for (i = 0; i < b->height; i++)
-		memcpy(dst + lc->stride * i, data + b->stride * i, b->width * 4);
+	wl_renderer_surface_set_opaque(&sd->base, lc->damage, opaque);
+}
+
+static void
+notify_surface_stack(struct wl_compositor *compositor,
+		     struct wl_surface *surface)
+{
+	struct lame_compositor *lc = (struct lame_compositor *) compositor;
+	struct surface_data *sd;
 
-	wl_buffer_free_data(b, data);
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_damage_map(&sd->base, lc->damage);
 }
 
 static void
@@ -100,6 +226,10 @@ notify_display_destroy(struct wl_compositor *compositor,
         iterator = wl_surface_iterator_create(display, 0);
         while (wl_surface_iterator_next(iterator, &surface))
 		notify_surface_destroy (compositor, surface);
+
+	wl_frame_clock_destroy(lc->frame_clock);
+	wl_renderer_destroy(lc->renderer);
+	free(lc->layers);
 }
 				   
 struct wl_compositor_interface interface = {
@@ -108,8 +238,11 @@ struct wl_compositor_interface interface = {
 	notify_surface_attach,
 	notify_surface_map,
 	NULL, /* notify_surface_copy */
-	NULL, /* notify_surface_damage */
-	notify_display_destroy
+	notify_surface_damage,
+	notify_display_destroy,
+	notify_commit,
+	notify_surface_opaque,
+	notify_surface_stack
 };
 
 static const char fb_device[] = "/dev/fb";
@@ -127,6 +260,7 @@ wl_compositor_init(int argc, char **argv)
 	if (lc == NULL)
 		return NULL;
 
+	memset(lc, 0, sizeof *lc);
 
 	lc->base.interface = &interface;
 
@@ -153,17 +287,49 @@ wl_compositor_init(int argc, char **argv)
 		return NULL;
 	}
 
-	lc->stride = fix.line_length;
-	lc->width = var.xres;
-	lc->height = var.yres;
-	lc->fb = mmap(NULL, lc->stride * lc->height,
-		      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (var.bits_per_pixel != 32) {
+		fprintf(stderr, "fb is %d bpp, need 32\n", var.bits_per_pixel);
+		return NULL;
+	}
+
+	lc->fb.stride = fix.line_length;
+	lc->fb.width = var.xres;
+	lc->fb.height = var.yres;
+	lc->fb.data = mmap(NULL, lc->fb.stride * lc->fb.height,
+			   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	close(fd);
-	if (lc->fb == MAP_FAILED) {
+	if (lc->fb.data == MAP_FAILED) {
 		fprintf(stderr, "fb map failed\n");
 		return NULL;
 	}
 
+	lc->shadow.width = lc->fb.width;
+	lc->shadow.height = lc->fb.height;
+	lc->shadow.stride = lc->fb.width * 4;
+	lc->shadow.data = malloc(lc->shadow.stride * lc->shadow.height);
+	if (lc->shadow.data == NULL) {
+		fprintf(stderr, "failed to allocate shadow buffer\n");
+		return NULL;
+	}
+
+	lc->renderer = wl_renderer_create(&lc->shadow, &lc->fb,
+					  sysconf(_SC_NPROCESSORS_ONLN));
+	if (lc->renderer == NULL) {
+		fprintf(stderr, "failed to create renderer\n");
+		return NULL;
+	}
+	lc->damage = wl_renderer_get_damage(lc->renderer);
+
+	lc->frame_clock =
+		wl_frame_clock_create(wl_display_get_event_loop(lc->wl_display),
+				      REFRESH_RATE, REPAINT_LEAD, repaint, lc);
+	if (lc->frame_clock == NULL) {
+		fprintf(stderr, "failed to create frame clock\n");
+		return NULL;
+	}
+
 	create_input_devices (lc->wl_display);
+	wl_frame_clock_schedule(lc->frame_clock);
+
 	return lc->wl_display;
 }
@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <ffi.h>
+
+#include "wayland.h"
+#include "connection.h"
+#include "hash.h"
+
+/* Pushes requests through a socketpair and dispatches them the way
+ * wl_client_connection_data does.  Small surface map requests are
+ * dispatched once parsing the type string per message and once
+ * through a precompiled signature; large string requests measure
+ * throughput for messages up to the 64 KB wire limit. */
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+update(struct wl_connection *connection, uint32_t mask, void *data)
+{
+	return 0;
+}
+
+static uint32_t checksum;
+
+static void
+map(void *client, struct wl_object *object,
+    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	checksum += x + y + width + height;
+}
+
+static void
+set_title(void *client, struct wl_object *object, char *title)
+{
+	checksum += title[0];
+	free(title);
+}
+
+struct bench {
+	struct wl_connection *client, *server;
+	struct wl_hash objects;
+	struct wl_object surface;
+	const struct wl_signature *signature;
+	const char *string;
+	int batch;
+};
+
+static void
+send_request(struct bench *bench, int i)
+{
+	if (bench->string)
+		wl_connection_marshal(bench->client, NULL, bench->surface.id,
+				      5, "s", bench->string);
+	else
+		wl_connection_marshal(bench->client, NULL, bench->surface.id,
+				      2, "iiii", i, i, 100, 100);
+}
+
+static void
+dispatch_request(struct bench *bench)
+{
+	void (*func)(void);
+	const char *types;
+
+	if (bench->string)
+		func = FFI_FN(set_title), types = "pp|s";
+	else
+		func = FFI_FN(map), types = "pp|iiii";
+
+	if (bench->signature)
+		wl_connection_demarshal_signature(bench->server,
+						  &bench->objects, func,
+						  bench->signature,
+						  NULL, &bench->surface);
+	else
+		wl_connection_demarshal_ffi(bench->server, &bench->objects,
+					    func, types,
+					    NULL, &bench->surface);
+}
+
+static double
+run(struct bench *bench, int count)
+{
+	const uint32_t *p;
+	double start;
+	int sent, received, len, size;
+
+	start = now();
+	sent = 0;
+	received = 0;
+	while (received < count) {
+		while (sent < count && sent - received < bench->batch)
+			send_request(bench, sent++);
+		wl_connection_data(bench->client, WL_CONNECTION_WRITABLE);
+
+		len = wl_connection_data(bench->server,
+					 WL_CONNECTION_READABLE);
+		while (len >= 2 * sizeof p[0]) {
+			p = wl_connection_view(bench->server, 2 * sizeof p[0]);
+			size = p[1] >> 16;
+			if (len < size)
+				break;
+			if (wl_hash_lookup(&bench->objects, p[0]) == NULL)
+				abort();
+			dispatch_request(bench);
+			len -= size;
+			received++;
+		}
+	}
+
+	return count / (now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench bench;
+	struct wl_signature *signature;
+	static const int sizes[] = { 1024, 4096, 16384, 65520 };
+	char *string;
+	double rate;
+	int fd[2], i, count = 1000000;
+
+	if (argc > 1)
+		count = strtol(argv[1], NULL, 0);
+
+	if (socketpair(AF_LOCAL, SOCK_STREAM, 0, fd) < 0) {
+		fprintf(stderr, "socketpair failed: %m\n");
+		return EXIT_FAILURE;
+	}
+	fcntl(fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(fd[1], F_SETFL, O_NONBLOCK);
+
+	memset(&bench, 0, sizeof bench);
+	bench.client = wl_connection_create(fd[0], update, NULL);
+	bench.server = wl_connection_create(fd[1], update, NULL);
+	bench.surface.id = 256;
+	bench.batch = 64;
+	wl_hash_insert(&bench.objects, &bench.surface);
+
+	printf("type string:  %10.0f requests/s\n", run(&bench, count));
+	signature = wl_signature_create("pp|iiii");
+	bench.signature = signature;
+	printf("signature:    %10.0f requests/s\n", run(&bench, count));
+	wl_signature_destroy(signature);
+
+	signature = wl_signature_create("pp|s");
+	bench.signature = signature;
+	bench.batch = 8;
+	for (i = 0; i < ARRAY_LENGTH(sizes); i++) {
+		string = malloc(sizes[i] + 1);
+		memset(string, 'x', sizes[i]);
+		string[sizes[i]] = '\0';
+		bench.string = string;
+		rate = run(&bench, count / 100);
+		printf("%5d byte string: %8.0f requests/s %8.1f MB/s\n",
+		       sizes[i], rate, rate * sizes[i] / (1 << 20));
+		free(string);
+	}
+	wl_signature_destroy(signature);
+
+	wl_connection_destroy(bench.client);
+	wl_connection_destroy(bench.server);
+
+	return 0;
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <ffi.h>
 #include <stdarg.h>
 
@@ -12,18 +13,193 @@
 
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
 
+/* Buffers start out unallocated, grow in powers of two as data
+ * arrives and are released again when they drain, so an idle
+ * connection costs next to nothing.  head and tail are free running
+ * byte counters; head - tail is the amount of data in the buffer. */
+
+#define WL_BUFFER_MIN_SIZE	512
+#define WL_BUFFER_IN_LIMIT	(WL_CONNECTION_MAX_MESSAGE_SIZE + 4)
+#define WL_BUFFER_OUT_LIMIT	(1 << 20)
+
 struct wl_buffer {
-	char data[4096];
-	int head, tail;
+	char *data;
+	uint32_t size, limit;
+	uint32_t head, tail;
+};
+
+#define MASK(b, i) ((i) & ((b)->size - 1))
+
+/* Where recent coalescible messages sit in the out buffer, by object
+ * id and header word.  A slot is empty when header is 0. */
+
+#define WL_CONNECTION_COALESCE_SLOTS 4
+
+struct wl_coalesce_slot {
+	uint32_t id, header, start;
 };
 
 struct wl_connection {
 	struct wl_buffer in, out;
+	/* Linear copy of an incoming message that wraps the in ring. */
+	uint32_t *linear;
+	uint32_t linear_size;
 	int fd;
+	int stalled, error;
+	/* Corked connections leave writing to wl_connection_flush();
+	 * blocked is set while the socket can't take more data. */
+	int corked, blocked;
+	uint32_t mask;
 	void *data;
 	wl_connection_update_func_t update;
+	wl_connection_capture_func_t capture;
+	void *capture_data;
+	struct wl_coalesce_slot coalesce[WL_CONNECTION_COALESCE_SLOTS];
+	int coalesce_next;
 };
 
+/* Updated atomically since connections may be read on I/O threads. */
+static struct wl_connection_stats stats;
+
+static void
+wl_buffer_copy_in(struct wl_buffer *b, uint32_t index,
+		  const void *data, size_t count)
+{
+	uint32_t start, size;
+
+	start = MASK(b, index);
+	if (start + count <= b->size) {
+		memcpy(b->data + start, data, count);
+	} else {
+		size = b->size - start;
+		memcpy(b->data + start, data, size);
+		memcpy(b->data, (const char *) data + size, count - size);
+	}
+}
+
+static void
+wl_buffer_copy_out(struct wl_buffer *b, uint32_t index,
+		   void *data, size_t count)
+{
+	uint32_t start, size;
+
+	start = MASK(b, index);
+	if (start + count <= b->size) {
+		memcpy(data, b->data + start, count);
+	} else {
+		size = b->size - start;
+		memcpy(data, b->data + start, size);
+		memcpy((char *) data + size, b->data, count - size);
+	}
+}
+
+static int
+wl_buffer_resize(struct wl_buffer *b, uint32_t size)
+{
+	struct wl_buffer old = *b;
+	uint32_t start, count, first;
+
+	b->data = malloc(size);
+	if (b->data == NULL) {
+		*b = old;
+		return -1;
+	}
+	b->size = size;
+
+	/* Keep the contents at the same free running offsets. */
+	count = old.head - old.tail;
+	if (count > 0) {
+		start = MASK(&old, old.tail);
+		first = old.size - start;
+		if (first > count)
+			first = count;
+		wl_buffer_copy_in(b, old.tail, old.data + start, first);
+		wl_buffer_copy_in(b, old.tail + first, old.data, count - first);
+	}
+
+	free(old.data);
+
+	return 0;
+}
+
+static int
+wl_buffer_grow(struct wl_buffer *b, uint32_t count)
+{
+	uint32_t used, size;
+
+	used = b->head - b->tail;
+	if (used + count <= b->size)
+		return 0;
+
+	size = b->size ? b->size : WL_BUFFER_MIN_SIZE;
+	while (size < used + count)
+		size *= 2;
+
+	return wl_buffer_resize(b, size);
+}
+
+/* Make room for COUNT more bytes, growing the buffer if necessary.
+ * Fails if that would take the buffer past its limit. */
+
+static int
+wl_buffer_reserve(struct wl_buffer *b, uint32_t count)
+{
+	if (b->head - b->tail + count > b->limit)
+		return -1;
+
+	return wl_buffer_grow(b, count);
+}
+
+static void
+wl_buffer_shrink(struct wl_buffer *b)
+{
+	if (b->head == b->tail && b->size > 0) {
+		free(b->data);
+		b->data = NULL;
+		b->size = 0;
+	}
+}
+
+static int
+wl_buffer_get_iov(struct wl_buffer *b, struct iovec *iov)
+{
+	uint32_t head, tail;
+
+	head = MASK(b, b->head);
+	tail = MASK(b, b->tail);
+	if (tail < head) {
+		iov[0].iov_base = b->data + tail;
+		iov[0].iov_len = head - tail;
+		return 1;
+	} else {
+		iov[0].iov_base = b->data + tail;
+		iov[0].iov_len = b->size - tail;
+		iov[1].iov_base = b->data;
+		iov[1].iov_len = head;
+		return 2;
+	}
+}
+
+static int
+wl_buffer_put_iov(struct wl_buffer *b, struct iovec *iov)
+{
+	uint32_t head, tail;
+
+	head = MASK(b, b->head);
+	tail = MASK(b, b->tail);
+	if (head < tail) {
+		iov[0].iov_base = b->data + head;
+		iov[0].iov_len = tail - head;
+		return 1;
+	} else {
+		iov[0].iov_base = b->data + head;
+		iov[0].iov_len = b->size - head;
+		iov[1].iov_base = b->data;
+		iov[1].iov_len = tail;
+		return 2;
+	}
+}
+
 struct wl_connection *
 wl_connection_create(int fd,
 		     wl_connection_update_func_t update,
@@ -36,6 +212,9 @@ wl_connection_create(int fd,
 	connection->fd = fd;
 	connection->update = update;
 	connection->data = data;
+	connection->in.limit = WL_BUFFER_IN_LIMIT;
+	connection->out.limit = WL_BUFFER_OUT_LIMIT;
+	connection->mask = WL_CONNECTION_READABLE;
 
 	connection->update(connection,
 			   WL_CONNECTION_READABLE,
@@ -44,66 +223,179 @@ wl_connection_create(int fd,
 	return connection;
 }
 
+/* Recompute what the connection waits for and tell the owner, but
+ * only if it changed.  Input is ignored while stalled on a full out
+ * buffer, or while more has been received than the in buffer is
+ * meant to hold.  Pending output asks for a flush pass on a corked
+ * connection, and for writability otherwise or once the socket has
+ * filled up. */
+
+static void
+wl_connection_update(struct wl_connection *connection)
+{
+	uint32_t mask;
+
+	if (connection->stalled ||
+	    connection->in.head - connection->in.tail > connection->in.limit)
+		mask = 0;
+	else
+		mask = WL_CONNECTION_READABLE;
+	if (connection->out.head != connection->out.tail) {
+		if (connection->corked && !connection->blocked)
+			mask |= WL_CONNECTION_FLUSH;
+		else
+			mask |= WL_CONNECTION_WRITABLE;
+	}
+
+	if (mask == connection->mask)
+		return;
+
+	connection->mask = mask;
+	connection->update(connection, mask, connection->data);
+}
+
+void
+wl_connection_cork(struct wl_connection *connection)
+{
+	connection->corked = 1;
+	wl_connection_update(connection);
+}
+
+void
+wl_connection_get_stats(struct wl_connection_stats *s)
+{
+	s->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+	s->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+}
+
 void
 wl_connection_destroy(struct wl_connection *connection)
 {
+	free(connection->in.data);
+	free(connection->out.data);
+	free(connection->linear);
 	free(connection);
 }
 
+/* Have every byte read from or written to the socket passed to
+ * func as well, for recording sessions. */
+
+void
+wl_connection_set_capture(struct wl_connection *connection,
+			  wl_connection_capture_func_t func, void *data)
+{
+	connection->capture = func;
+	connection->capture_data = data;
+}
+
+/* Pass the count bytes of b starting at index to the capture
+ * function, in one or two pieces depending on where the ring
+ * wraps. */
+
+static void
+wl_connection_capture(struct wl_connection *connection, uint32_t direction,
+		      struct wl_buffer *b, uint32_t index, uint32_t count)
+{
+	struct iovec iov[2];
+	uint32_t start;
+
+	start = MASK(b, index);
+	iov[0].iov_base = b->data + start;
+	if (start + count <= b->size) {
+		iov[0].iov_len = count;
+		connection->capture(connection->capture_data,
+				    direction, iov, 1);
+	} else {
+		iov[0].iov_len = b->size - start;
+		iov[1].iov_base = b->data;
+		iov[1].iov_len = count - iov[0].iov_len;
+		connection->capture(connection->capture_data,
+				    direction, iov, 2);
+	}
+}
+
+/* Limit how much unsent data the out buffer may hold.  Once half of
+ * it is used, the connection stops asking for input until the peer
+ * has caught up; a write beyond the limit fails and shuts down the
+ * connection. */
+
+void
+wl_connection_set_limit(struct wl_connection *connection, uint32_t limit)
+{
+	connection->out.limit = limit;
+}
+
 void
 wl_connection_copy(struct wl_connection *connection, void *data, size_t size)
+{
+	wl_buffer_copy_out(&connection->in, connection->in.tail, data, size);
+}
+
+/* Return a contiguous view of the next SIZE bytes of the in buffer.
+ * Points straight into the ring unless the bytes wrap around its end,
+ * in which case they are linearized into connection->linear.  The
+ * view stays valid until the next wl_connection_data() call. */
+
+const void *
+wl_connection_view(struct wl_connection *connection, size_t size)
 {
 	struct wl_buffer *b;
-	int tail, rest;
+	uint32_t tail, linear_size;
+	uint32_t *linear;
 
 	b = &connection->in;
-	tail = b->tail;
-	if (tail + size <= ARRAY_LENGTH(b->data)) {
-		memcpy(data, b->data + tail, size);
-	} else { 
-		rest = ARRAY_LENGTH(b->data) - tail;
-		memcpy(data, b->data + tail, rest);
-		memcpy(data + rest, b->data, size - rest);
+	tail = MASK(b, b->tail);
+	if (tail + size <= b->size)
+		return b->data + tail;
+
+	if (connection->linear_size < size) {
+		linear_size = connection->linear_size ?
+			connection->linear_size : 256;
+		while (linear_size < size)
+			linear_size *= 2;
+		linear = realloc(connection->linear, linear_size);
+		if (linear == NULL)
+			return NULL;
+		connection->linear = linear;
+		connection->linear_size = linear_size;
 	}
+
+	wl_buffer_copy_out(b, b->tail, connection->linear, size);
+
+	return connection->linear;
 }
 
 void
 wl_connection_consume(struct wl_connection *connection, size_t size)
 {
-	struct wl_buffer *b;
-	int tail, rest;
-
-	b = &connection->in;
-	tail = b->tail;
-	if (tail + size <= ARRAY_LENGTH(b->data)) {
-		b->tail += size;
-	} else { 
-		rest = ARRAY_LENGTH(b->data) - tail;
-		b->tail = size - rest;
+	connection->in.tail += size;
+	if (connection->in.head == connection->in.tail) {
+		wl_buffer_shrink(&connection->in);
+		free(connection->linear);
+		connection->linear = NULL;
+		connection->linear_size = 0;
 	}
+
+	if (!(connection->mask & WL_CONNECTION_READABLE))
+		wl_connection_update(connection);
 }
 
 void
 wl_connection_sync(struct wl_connection *connection)
 {
-	uint32_t p[2];
+	const uint32_t *p;
 	struct wl_buffer *b;
-	int size, avail, head;
+	uint32_t size, avail;
 
 	b = &connection->in;
-	size = sizeof p;
+	size = 2 * sizeof p[0];
 	do {
-		head = connection->in.head;
-		if (head < b->tail)
-			avail = ARRAY_LENGTH(b->data) - (b->tail - head);
-		else
-			avail = head - b->tail;
-
+		avail = b->head - b->tail;
 		if (avail < size)
 			wl_connection_data(connection, WL_CONNECTION_READABLE);
-		else if (size == sizeof p) {
+		else if (size == 2 * sizeof p[0]) {
 			/* If the header is available, get the full size.  */
-			wl_connection_copy(connection, p, sizeof p);
+			p = wl_connection_view(connection, 2 * sizeof p[0]);
 			size = p[1] >> 16;
 		}
 	} while (avail < size);
@@ -113,25 +405,34 @@ int wl_connection_data(struct wl_connection *connection, uint32_t mask)
 {
 	struct wl_buffer *b;
 	struct iovec iov[2];
-	int len, head, tail, count, size, available;
-
-	if (mask & WL_CONNECTION_READABLE) {
-		b = &connection->in;
-		head = connection->in.head;
-		if (head < b->tail) {
-			iov[0].iov_base = b->data + head;
-			iov[0].iov_len = b->tail - head;
-			count = 1;
-		} else {
-			size = ARRAY_LENGTH(b->data) - head;
-			iov[0].iov_base = b->data + head;
-			iov[0].iov_len = size;
-			iov[1].iov_base = b->data;
-			iov[1].iov_len = b->tail;
-			count = 2;
-		}
+	const uint32_t *p;
+	int len, count;
+	uint32_t available, size;
+
+	if (connection->error)
+		return -1;
+
+	b = &connection->in;
+	available = b->head - b->tail;
+
+	/* If we have the header of a message that isn't complete yet,
+	 * make room for all of it up front, so that large messages
+	 * stream in over several reads without repeated resizing. */
+	if ((mask & WL_CONNECTION_READABLE) && available >= 2 * sizeof p[0]) {
+		p = wl_connection_view(connection, 2 * sizeof p[0]);
+		size = p[1] >> 16;
+		if (size > available)
+			wl_buffer_reserve(b, size - available);
+	}
+
+	if ((mask & WL_CONNECTION_READABLE) &&
+	    wl_buffer_reserve(b, 1) == 0) {
+		count = wl_buffer_put_iov(b, iov);
+		__atomic_add_fetch(&stats.reads, 1, __ATOMIC_RELAXED);
 		len = readv(connection->fd, iov, count);
-		if (len < 0) {
+		if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+			len = 0;
+		} else if (len < 0) {
 			fprintf(stderr,
 				"read error from connection %p: %m (%d)\n",
 				connection, errno);
@@ -139,86 +440,219 @@ int wl_connection_data(struct wl_connection *connection, uint32_t mask)
 		} else if (len == 0) {
 			/* FIXME: Handle this better? */
 			return -1;
-		} else if (head + len <= ARRAY_LENGTH(b->data)) {
-			b->head += len;
-		} else {
-			b->head = head + len - ARRAY_LENGTH(b->data);
 		}
 
-		/* We know we have data in the buffer at this point,
-		 * so if head equals tail, it means the buffer is
-		 * full. */
+		if (connection->capture && len > 0)
+			wl_connection_capture(connection,
+					      WL_CONNECTION_CAPTURE_IN,
+					      b, b->head, len);
+		b->head += len;
+		available += len;
 
-		available = b->head - b->tail;
-		if (available == 0)
-			available = sizeof b->data;
-		else if (available < 0)
-			available += ARRAY_LENGTH(b->data);
-	} else {
-		available = 0;
-	}	
-
-	if (mask & WL_CONNECTION_WRITABLE) {
-		b = &connection->out;
-		tail = b->tail;
-		if (tail < b->head) {
-			iov[0].iov_base = b->data + tail;
-			iov[0].iov_len = b->head - tail;
-			count = 1;
-		} else {
-			size = ARRAY_LENGTH(b->data) - tail;
-			iov[0].iov_base = b->data + tail;
-			iov[0].iov_len = size;
-			iov[1].iov_base = b->data;
-			iov[1].iov_len = b->head;
-			count = 2;
-		}
-		len = writev(connection->fd, iov, count);
-		if (len < 0) {
-			fprintf(stderr, "write error for connection %p: %m\n", connection);
-			return -1;
-		} else if (tail + len <= ARRAY_LENGTH(b->data)) {
-			b->tail += len;
-		} else {
-			b->tail = tail + len - ARRAY_LENGTH(b->data);
-		}
+		/* If the read filled the buffer, there's probably
+		 * more waiting; grow it for the next read. */
+		if (available == b->size && b->size < b->limit)
+			wl_buffer_reserve(b, b->size);
+	}
+
+	if ((mask & WL_CONNECTION_WRITABLE) &&
+	    wl_connection_flush(connection) < 0)
+		return -1;
+
+	return available;
+}
+
+/* Append data received for the connection by other means than
+ * wl_connection_data(), such as an io_uring receive.  It is taken
+ * even past the in buffer limit, but then the connection stops
+ * asking for input until it has been consumed. */
+
+int
+wl_connection_receive(struct wl_connection *connection,
+		      const void *data, size_t count)
+{
+	struct wl_buffer *b;
 
-		/* We just took data out of the buffer, so at this
-		 * point if head equals tail, the buffer is empty. */
+	if (connection->error)
+		return -1;
 
-		if (b->tail == b->head)
-			connection->update(connection,
-					   WL_CONNECTION_READABLE,
-					   connection->data);
+	b = &connection->in;
+	if (wl_buffer_grow(b, count) < 0) {
+		fprintf(stderr, "out of memory for connection %p\n",
+			connection);
+		return -1;
 	}
 
-	return available;
+	wl_buffer_copy_in(b, b->head, data, count);
+	if (connection->capture)
+		wl_connection_capture(connection, WL_CONNECTION_CAPTURE_IN,
+				      b, b->head, count);
+	b->head += count;
+
+	if (b->head - b->tail > b->limit)
+		wl_connection_update(connection);
+
+	return b->head - b->tail;
 }
 
-void
-wl_connection_write(struct wl_connection *connection, const void *data, size_t count)
+/* Write out as much of the out buffer as the socket takes in one
+ * go.  If it doesn't take all of it, the socket buffer is full and
+ * the connection polls for writability until it has drained. */
+
+int
+wl_connection_flush(struct wl_connection *connection)
+{
+	struct iovec iov[2];
+	int len, count;
+
+	count = wl_connection_get_output(connection, iov);
+	if (count <= 0)
+		return count;
+
+	__atomic_add_fetch(&stats.writes, 1, __ATOMIC_RELAXED);
+	len = writev(connection->fd, iov, count);
+	if (len < 0)
+		len = -errno;
+
+	return wl_connection_written(connection, len);
+}
+
+/* The two halves of wl_connection_flush(), for writing the out
+ * buffers of several connections in one batch.  The iovecs stay
+ * valid until wl_connection_written() is called with the result of
+ * the write, a byte count or a negative errno. */
+
+int
+wl_connection_get_output(struct wl_connection *connection,
+			 struct iovec *iov)
 {
 	struct wl_buffer *b;
-	size_t size;
-	int head;
+
+	if (connection->error)
+		return -1;
 
 	b = &connection->out;
-	head = b->head;
-	if (head + count <= ARRAY_LENGTH(b->data)) {
-		memcpy(b->data + head, data, count);
-		b->head += count;
+	if (b->head == b->tail)
+		return 0;
+
+	return wl_buffer_get_iov(b, iov);
+}
+
+int
+wl_connection_written(struct wl_connection *connection, int len)
+{
+	struct wl_buffer *b;
+
+	if (len == -EAGAIN || len == -EINTR) {
+		len = 0;
+	} else if (len < 0) {
+		fprintf(stderr, "write error for connection %p: %s\n",
+			connection, strerror(-len));
+		connection->error = 1;
+		return -1;
+	}
+
+	b = &connection->out;
+	if (connection->capture && len > 0)
+		wl_connection_capture(connection, WL_CONNECTION_CAPTURE_OUT,
+				      b, b->tail, len);
+	b->tail += len;
+
+	/* We just took data out of the buffer, so if it's empty now,
+	 * release it.  If input was stalled on a full out buffer,
+	 * resume once it has drained to a quarter. */
+
+	if (b->tail == b->head) {
+		wl_buffer_shrink(b);
+		memset(connection->coalesce, 0, sizeof connection->coalesce);
+		connection->stalled = 0;
+		connection->blocked = 0;
 	} else {
-		size = ARRAY_LENGTH(b->data) - head;
-		memcpy(b->data + head, data, size);
-		memcpy(b->data, data + size, count - size);
-		b->head = count - size;
+		connection->blocked = 1;
+		if (connection->stalled && b->head - b->tail <= b->limit / 4)
+			connection->stalled = 0;
 	}
 
-	if (b->tail == head)
-		connection->update(connection,
-				   WL_CONNECTION_READABLE |
-				   WL_CONNECTION_WRITABLE,
-				   connection->data);
+	wl_connection_update(connection);
+
+	return 0;
+}
+
+int
+wl_connection_write(struct wl_connection *connection, const void *data, size_t count)
+{
+	struct wl_buffer *b;
+	const uint32_t *p = data;
+	int i;
+
+	if (connection->error)
+		return -1;
+
+	/* Anything written after a message from the same object has
+	 * to stay behind it. */
+	for (i = 0; count >= sizeof *p && i < WL_CONNECTION_COALESCE_SLOTS; i++)
+		if (connection->coalesce[i].id == p[0])
+			connection->coalesce[i].header = 0;
+
+	b = &connection->out;
+	if (wl_buffer_reserve(b, count) < 0) {
+		fprintf(stderr, "out buffer overflow for connection %p\n",
+			connection);
+		connection->error = 1;
+		shutdown(connection->fd, SHUT_RDWR);
+		return -1;
+	}
+
+	wl_buffer_copy_in(b, b->head, data, count);
+	b->head += count;
+
+	if (b->head - b->tail > b->limit / 2)
+		connection->stalled = 1;
+
+	wl_connection_update(connection);
+
+	return 0;
+}
+
+/* Write one message that supersedes any earlier one of the same
+ * object and opcode.  If such a message is still queued, nothing has
+ * been sent of it yet and nothing from the same object was written
+ * after it, it is overwritten in place rather than followed by the
+ * new one.  A client that reads slowly then finds only the latest
+ * state when it catches up, and the out buffer doesn't grow. */
+
+int
+wl_connection_write_coalesced(struct wl_connection *connection,
+			      const void *data, size_t count)
+{
+	struct wl_buffer *b = &connection->out;
+	struct wl_coalesce_slot *slot;
+	const uint32_t *p = data;
+	int i;
+
+	if (connection->error)
+		return -1;
+
+	for (i = 0; i < WL_CONNECTION_COALESCE_SLOTS; i++) {
+		slot = &connection->coalesce[i];
+		if (slot->header == p[1] && slot->id == p[0] &&
+		    slot->start - b->tail < b->head - b->tail) {
+			wl_buffer_copy_in(b, slot->start, data, count);
+			return 0;
+		}
+	}
+
+	if (wl_connection_write(connection, data, count) < 0)
+		return -1;
+
+	slot = &connection->coalesce[connection->coalesce_next];
+	connection->coalesce_next =
+		(connection->coalesce_next + 1) % WL_CONNECTION_COALESCE_SLOTS;
+	slot->id = p[0];
+	slot->header = p[1];
+	slot->start = b->head - count;
+
+	return 0;
 }
 
 static int
@@ -240,6 +674,98 @@ union wl_element {
 	uint32_t new_id;
 };
 
+#define WL_SIGNATURE_MAX_ARGS 20
+
+/* A method or event type string compiled into a flat descriptor, so
+ * that marshalling and dispatch don't have to parse the string or
+ * prepare the ffi call interface for every message. */
+
+struct wl_signature {
+	int prefix;		/* arguments supplied by the caller, before '|' */
+	int count;		/* prefix plus wire arguments */
+	int size;		/* wire size, not counting string contents */
+	int variable;		/* string and array arguments on the wire */
+	char types[WL_SIGNATURE_MAX_ARGS];
+	ffi_type *ffi_types[WL_SIGNATURE_MAX_ARGS];
+	ffi_cif cif;
+};
+
+static int
+wl_signature_init(struct wl_signature *signature, const char *types)
+{
+	const char *c;
+	int i;
+
+	signature->prefix = 0;
+	signature->size = 2 * sizeof(uint32_t);
+	signature->variable = 0;
+	for (i = 0, c = types; *c; c++) {
+		if (*c == '|') {
+			signature->prefix = i;
+			signature->size = 2 * sizeof(uint32_t);
+			signature->variable = 0;
+			continue;
+		}
+
+		if (i >= ARRAY_LENGTH(signature->types)) {
+			printf("too many args (%d)\n", i);
+			return -1;
+		}
+
+		switch (*c) {
+		case 'i':
+		case 'O':
+			signature->ffi_types[i] = &ffi_type_uint32;
+			break;
+		case 's':
+		case 'a':
+			signature->ffi_types[i] = &ffi_type_pointer;
+			signature->variable++;
+			break;
+		case 'o':
+		case 'p':
+			signature->ffi_types[i] = &ffi_type_pointer;
+			break;
+		default:
+			printf("unknown type %c\n", *c);
+			return -1;
+		}
+
+		signature->types[i++] = *c;
+		signature->size += sizeof(uint32_t);
+	}
+	signature->count = i;
+
+	if (ffi_prep_cif(&signature->cif, FFI_DEFAULT_ABI, signature->count,
+			 &ffi_type_uint32, signature->ffi_types) != FFI_OK)
+		return -1;
+
+	return 0;
+}
+
+struct wl_signature *
+wl_signature_create(const char *types)
+{
+	struct wl_signature *signature;
+
+	signature = malloc(sizeof *signature);
+	if (signature == NULL)
+		return NULL;
+
+	if (wl_signature_init(signature, types) < 0) {
+		free(signature);
+		return NULL;
+	}
+
+	return signature;
+}
+
+void
+wl_signature_destroy(struct wl_signature *signature)
+{
+	free(signature);
+}
+
 void
 wl_connection_marshal(struct wl_connection *connection, struct wl_hash *objects,
 		      uint32_t obj_id, uint32_t opcode, const char *types, ...)
@@ -254,100 +780,158 @@ wl_connection_vmarshal(struct wl_connection *connection,
 		       struct wl_hash *objects, uint32_t obj_id,
 		       uint32_t opcode, const char *types, va_list va)
 {
-	uint32_t *p;
-	int i, id;
-	const char *c;
-	union wl_element values[20];
+	struct wl_signature signature;
+
+	if (wl_signature_init(&signature, types) < 0)
+		return;
+
+	wl_connection_vmarshal_signature(connection, objects, obj_id, opcode,
+					 &signature, va);
+}
+
+static int
+wl_signature_check_id(struct wl_hash *objects, char type, uint32_t id)
+{
 	struct wl_object *object;
-	uint32_t data[64];
-	int size;
 
-	for (i = 0, c = types, size = 2 * sizeof(uint32_t); *c; i++) {
-		switch (*c) {
-		case 'i':
-			values[i].uint32 = va_arg (va, int);
-			size += sizeof (uint32_t);
-			c++;
-			break;
-		case 's': {
-			const char *s = va_arg (va, const char *);
-			int length = strlen (s);
-			values[i].string = s;
-			size += sizeof (uint32_t);
-			size += (length + 3) & ~3;
-			c++;
-			break;
-		}
-		case 'o':
-			id = va_arg (va, int);
-			object = wl_hash_lookup(objects, id);
-			if (object == NULL)
-				printf("unknown object (%d)\n", id);
-			c++;
-			values[i].uint32 = id;
-			break;
-#if 0
-		case '{':
-			id = va_arg (va, int);
-			object = wl_hash_lookup(objects, id);
-			if (object == NULL)
-				printf("unknown object (%d)\n", id);
-			c++;
-			if (!strchrcmp (&c, '}', object->interface->name))
-				printf("wrong object type\n");
-			values[i].uint32 = id;
-			break;
-#endif
-		case 'O':
-			values[i].uint32 = id = va_arg (va, int);
-			if (objects != NULL) {
-				object = wl_hash_lookup(objects, id);
-				if (object != NULL)
-					printf("object already exists (%d)\n", id);
-			}
-			size += sizeof (uint32_t);
-			c++;
-			break;
-		default:
-			printf("unknown type %c\n", *c++);
-			break;
+	if (objects == NULL)
+		return 0;
+
+	object = wl_hash_lookup(objects, id);
+	if (type == 'o' && object == NULL) {
+		printf("unknown object (%d)\n", id);
+		return -1;
+	} else if (type == 'O' && object != NULL) {
+		printf("object already exists (%d)\n", id);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Serialize a message into DATA, which has room for SIZE bytes, and
+ * return the message size.  If the message is bigger than SIZE,
+ * nothing is written and the caller can retry with a buffer of the
+ * returned size.  Returns -1 if the message exceeds the 16 bit size
+ * field of the wire format.  The result can be written to any number
+ * of connections. */
+
+int
+wl_signature_vmarshal(const struct wl_signature *signature,
+		      struct wl_hash *objects, uint32_t obj_id,
+		      uint32_t opcode, uint32_t *data, size_t size,
+		      va_list va)
+{
+	uint32_t *p;
+	int i, total;
+	union wl_element values[WL_SIGNATURE_MAX_ARGS];
+	uint32_t lengths[WL_SIGNATURE_MAX_ARGS];
+	struct wl_array *array;
+
+	/* Without strings or arrays the size is known up front, so
+	 * write the arguments straight from the argument list. */
+	if (signature->variable == 0) {
+		if (size < signature->size)
+			return signature->size;
+
+		for (i = 0, p = &data[2]; i < signature->count; i++) {
+			*p = va_arg (va, uint32_t);
+			if (signature->types[i] != 'i')
+				wl_signature_check_id(objects,
+						      signature->types[i], *p);
+			p++;
 		}
+
+		total = signature->size;
+		data[0] = obj_id;
+		data[1] = (total << 16) | (opcode & 65535);
+
+		return total;
 	}
 
-	if (sizeof data < size) {
-		printf("request too big, should malloc tmp buffer here\n");
-		return;
+	total = signature->size;
+	for (i = 0; i < signature->count; i++) {
+		if (signature->types[i] == 's') {
+			values[i].string = va_arg (va, const char *);
+			lengths[i] = strlen (values[i].string);
+			total += (lengths[i] + 3) & ~3;
+		} else if (signature->types[i] == 'a') {
+			array = va_arg (va, struct wl_array *);
+			values[i].string = array->data;
+			lengths[i] = array->size;
+			if (lengths[i] > WL_CONNECTION_MAX_MESSAGE_SIZE)
+				return -1;
+			total += (lengths[i] + 3) & ~3;
+		} else {
+			values[i].uint32 = va_arg (va, uint32_t);
+			if (signature->types[i] != 'i')
+				wl_signature_check_id(objects,
+						      signature->types[i],
+						      values[i].uint32);
+		}
 	}
+
+	if (total > WL_CONNECTION_MAX_MESSAGE_SIZE)
+		return -1;
+	if (size < total)
+		return total;
+
 	data[0] = obj_id;
-	data[1] = (size << 16) | (opcode & 65535);
-	for (i = 0, c = types, p = &data[2]; *c; i++) {
-		switch (*c) {
-		case 'i':
-		case 'o':
-		case 'O':
+	data[1] = (total << 16) | (opcode & 65535);
+	for (i = 0, p = &data[2]; i < signature->count; i++) {
+		if (signature->types[i] == 's' ||
+		    signature->types[i] == 'a') {
+			*p++ = lengths[i];
+			if (lengths[i] & 3)
+				p[lengths[i] >> 2] = 0;
+			memcpy ((char *)p, values[i].string, lengths[i]);
+			p += (lengths[i] + 3) >> 2;
+		} else {
 			*p++ = values[i].uint32;
-			c++;
-			break;
-		case 's': {
-			const char *s = values[i].string;
-			int length = strlen (s);
-			*p++ = length;
-			memcpy ((char *)p, s, length);
-			p += (length + 3) >> 2;
-			c++;
-			break;
 		}
-		case '{':
-			*p++ = values[i].uint32;
-			c = strchr (c, '}');
-			c++;
-			break;
-		default:
-			printf("unknown type %c\n", *c++);
-			break;
+	}
+
+	return total;
+}
+
+void
+wl_connection_vmarshal_signature(struct wl_connection *connection,
+				 struct wl_hash *objects, uint32_t obj_id,
+				 uint32_t opcode,
+				 const struct wl_signature *signature,
+				 va_list va)
+{
+	uint32_t stack[64], *data;
+	va_list va2;
+	int size;
+
+	va_copy (va2, va);
+	size = wl_signature_vmarshal(signature, objects, obj_id, opcode,
+				     stack, sizeof stack, va);
+	if (size < 0) {
+		printf("request too big (opcode %d)\n", opcode);
+		va_end (va2);
+		return;
+	}
+
+	/* Messages that don't fit on the stack are marshalled a second
+	 * time into a heap buffer of the right size. */
+	if (size > sizeof stack) {
+		data = malloc(size);
+		if (data == NULL) {
+			printf("out of memory for request\n");
+			va_end (va2);
+			return;
 		}
+		wl_signature_vmarshal(signature, objects, obj_id, opcode,
+				      data, size, va2);
+		wl_connection_write (connection, data, size);
+		free(data);
+	} else {
+		wl_connection_write (connection, stack, size);
 	}
-	wl_connection_write (connection, data, size);
+
+	va_end (va2);
 }
 
 int
@@ -360,8 +944,10 @@ wl_connection_demarshal_mem(struct wl_connection *connection,
 	size_t field_ofs, field_size, field_align;
 	const char *c;
 	union wl_element value;
+	struct wl_array array;
+	const void *field;
 	struct wl_object *object;
-	uint32_t data[64], *p;
+	const uint32_t *data, *p;
 	va_list va;
 
 #define alignof(type) offsetof (struct { char c; type i; }, i)
@@ -441,24 +1027,24 @@ wl_connection_demarshal_mem(struct wl_connection *connection,
 		c++;
 
 	if (connection) {
-		wl_connection_copy(connection, data, 2 * sizeof (data[0]));
+		data = wl_connection_view(connection, 2 * sizeof (data[0]));
 		id = data[0];
 		size = data[1] >> 16;
 
-		if (sizeof data < size) {
-			printf("request too big, should malloc tmp buffer here\n");
-			return -1;
+		data = wl_connection_view(connection, size);
+		if (data == NULL) {
+			printf("out of memory for request\n");
+			goto fail;
 		}
-		wl_connection_copy(connection, data, size);
-		wl_connection_consume(connection, size);
 	} else
-		id = -1, size = 0;
+		data = NULL, id = -1, size = 0;
 		
 	for (p = &data[2]; *c; ) {
 		if ((p - data) * sizeof (data[0]) >= size) {
 			printf("incomplete packet\n");
-			return -1;
+			goto fail;
 		}
+		field = &value;
 		switch (*c) {
 		case 'i':
 			value.uint32 = *p;
@@ -477,6 +1063,22 @@ wl_connection_demarshal_mem(struct wl_connection *connection,
 			field_align = alignof (char *);
 			break;
 		}
+		case 'a':
+			/* The message is consumed before the handler
+			 * runs, so the contents are copied. */
+			array.size = *p++;
+			if (array.size > size - (p - data) * sizeof (data[0])) {
+				printf("incomplete packet\n");
+				goto fail;
+			}
+			array.alloc = array.size;
+			array.data = malloc (array.size);
+			memcpy (array.data, p, array.size);
+			p += (array.size + 3) >> 2, c++;
+			field = &array;
+			field_size = sizeof array;
+			field_align = alignof (struct wl_array);
+			break;
 		case 'o':
 			if (object == NULL)
 				printf("unknown object (%d)\n", *p);
@@ -516,175 +1118,227 @@ wl_connection_demarshal_mem(struct wl_connection *connection,
 		field_ofs = (field_ofs + field_align - 1) & -field_align;
 		if (field_ofs + field_size > dsize) {
 			printf("not enough memory");
-			return -1;
+			goto fail;
 		}
-		memcpy ((char *)dest + field_ofs, &value, field_size);
+		memcpy ((char *)dest + field_ofs, field, field_size);
 		field_ofs += field_size;
 	}
+
+	if (connection)
+		wl_connection_consume(connection, size);
+
 	return id;
+
+ fail:
+	if (connection)
+		wl_connection_consume(connection, size);
+
+	return -1;
 }
 
-int
-wl_connection_demarshal_ffi(struct wl_connection *connection,
-			    struct wl_hash *objects,
-			    void (*func)(void), const char *arguments, ...)
+/* Decode the message at DATA and call FUNC with the prefix
+ * arguments followed by the message arguments.  DATA is the whole
+ * message, header included, and has to stay in place until FUNC
+ * returns since array arguments point into it. */
+
+static int
+wl_signature_vdemarshal(const struct wl_signature *signature,
+			struct wl_hash *objects, void (*func)(void),
+			const uint32_t *data, va_list va)
 {
-	ffi_type *types[20];
-	ffi_cif cif;
-	uint32_t result, id;
-	uint32_t *p;
+	uint32_t result, id, length, extra;
+	const uint32_t *p;
 	int i, size;
-	const char *c;
-	union wl_element values[20];
-	void *args[20];
+	union wl_element values[WL_SIGNATURE_MAX_ARGS];
+	struct wl_array arrays[WL_SIGNATURE_MAX_ARGS];
+	void *args[WL_SIGNATURE_MAX_ARGS];
 	struct wl_object *object;
-	uint32_t data[64];
-	va_list va;
-
-	va_start (va, arguments);
-	for (i = 0, c = arguments; *c && *c != '|'; i++) {
-		if (i >= ARRAY_LENGTH(types)) {
-			printf("too many args (%d)\n", i);
-			return -1;
-		}
+	char *s;
 
-		switch (*c) {
+	for (i = 0; i < signature->prefix; i++) {
+		switch (signature->types[i]) {
 		case 'i':
-			types[i] = &ffi_type_uint32;
 			values[i].uint32 = va_arg (va, int);
-			c++;
 			break;
 		case 'p':
-			types[i] = &ffi_type_pointer;
 			values[i].object = va_arg (va, void *);
-			c++;
 			break;
 		case 's':
-			types[i] = &ffi_type_pointer;
-			values[i].string = va_arg (va, char *);
-			values[i].string = strdup (values[i].object);
-			c++;
+			values[i].string = strdup (va_arg (va, char *));
 			break;
-		case 'o':
-			types[i] = &ffi_type_pointer;
-			id = va_arg (va, int);
-			object = wl_hash_lookup(objects, id);
-			if (object == NULL)
-				printf("unknown object (%d)\n", id);
-			c++;
-			values[i].object = object;
+		case 'a':
+			values[i].object = va_arg (va, struct wl_array *);
 			break;
-#if 0
-		case '{':
-			types[i] = &ffi_type_pointer;
+		case 'o':
 			id = va_arg (va, int);
 			object = wl_hash_lookup(objects, id);
 			if (object == NULL)
 				printf("unknown object (%d)\n", id);
-			c++;
-			if (!strchrcmp (&c, '}', object->interface->name))
-				printf("wrong object type\n");
 			values[i].object = object;
 			break;
-#endif
 		case 'O':
-			types[i] = &ffi_type_uint32;
 			values[i].new_id = id = va_arg (va, int);
 			if (objects != NULL) {
 				object = wl_hash_lookup(objects, id);
 				if (object != NULL)
 					printf("object already exists (%d)\n", id);
 			}
-			c++;
-			break;
-		default:
-			printf("unknown type %c\n", *c++);
 			break;
 		}
 		args[i] = &values[i];
 	}
 
-	if (*c == '|')
-		c++;
-
-	if (connection) {
-		wl_connection_copy(connection, data, 2 * sizeof (data[0]));
+	if (data) {
 		id = data[0];
 		size = data[1] >> 16;
-
-		if (sizeof data < size) {
-			printf("request too big, should malloc tmp buffer here\n");
-			return -1;
-		}
-		wl_connection_copy(connection, data, size);
-		wl_connection_consume(connection, size);
 	} else
 		id = -1, size = 0;
-		
-	for (p = &data[2]; *c; i++) {
-		if ((p - data) * sizeof (data[0]) >= size) {
-			printf("incomplete packet\n");
-			return -1;
-		}
-		if (i >= ARRAY_LENGTH(types)) {
-			printf("too many args (%d)\n", i);
-			return -1;
-		}
 
-		switch (*c) {
+	/* The fixed part of the message is checked once up front, and
+	 * string and array contents are checked against what is left
+	 * over. */
+	if (size < signature->size) {
+		printf("incomplete packet\n");
+		return -1;
+	}
+
+	extra = size - signature->size;
+	for (p = &data[2]; i < signature->count; i++) {
+		switch (signature->types[i]) {
 		case 'i':
-			types[i] = &ffi_type_uint32;
-			values[i].uint32 = *p;
-			p++, c++;
+			values[i].uint32 = *p++;
 			break;
-		case 's': {
-			int length = *p++;
-			char *s = malloc (length + 1);
+		case 's':
+			length = *p++;
+			if (length > extra || ((length + 3) & ~3) > extra) {
+				printf("incomplete packet\n");
+				return -1;
+			}
+			extra -= (length + 3) & ~3;
+			s = malloc (length + 1);
 			memcpy (s, p, length);
 			s[length] = 0;
-			p += (length + 3) >> 2, c++;
-			types[i] = &ffi_type_pointer;
-			values[i].object = s;
+			p += (length + 3) >> 2;
+			values[i].string = s;
 			break;
-		}
-		case 'o':
-			types[i] = &ffi_type_pointer;
-			object = wl_hash_lookup(objects, *p);
-			if (object == NULL)
-				printf("unknown object (%d)\n", *p);
-			p++, c++;
-			values[i].object = object;
+		case 'a':
+			/* Arrays point straight into the message, which
+			 * stays in place until the handler returns. */
+			length = *p++;
+			if (length > extra || ((length + 3) & ~3) > extra) {
+				printf("incomplete packet\n");
+				return -1;
+			}
+			extra -= (length + 3) & ~3;
+			arrays[i].size = length;
+			arrays[i].alloc = 0;
+			arrays[i].data = (void *) p;
+			p += (length + 3) >> 2;
+			values[i].object = &arrays[i];
 			break;
-#if 0
-		case '{':
-			types[i] = &ffi_type_pointer;
+		case 'o':
 			object = wl_hash_lookup(objects, *p);
 			if (object == NULL)
 				printf("unknown object (%d)\n", *p);
-			p++, c++;
-			if (!strchrcmp (&c, '}', object->interface->name))
-				printf("wrong object type\n");
+			p++;
 			values[i].object = object;
 			break;
-#endif
 		case 'O':
-			types[i] = &ffi_type_uint32;
 			values[i].new_id = *p;
 			if (objects != NULL) {
 				object = wl_hash_lookup(objects, *p);
 				if (object != NULL)
 					printf("object already exists (%d)\n", *p);
 			}
-			p++, c++;
-			break;
-		default:
-			printf("unknown type %c\n", *c++);
+			p++;
 			break;
 		}
 		args[i] = &values[i];
 	}
 
-	ffi_prep_cif(&cif, FFI_DEFAULT_ABI, i, &ffi_type_uint32, types);
-	ffi_call(&cif, func, &result, args);
+	ffi_call((ffi_cif *) &signature->cif, func, &result, args);
+
+	return id;
+}
+
+static int
+wl_connection_vdemarshal_signature(struct wl_connection *connection,
+				   struct wl_hash *objects,
+				   void (*func)(void),
+				   const struct wl_signature *signature,
+				   va_list va)
+{
+	const uint32_t *data;
+	int id, size;
+
+	if (connection == NULL)
+		return wl_signature_vdemarshal(signature, objects, func,
+					       NULL, va);
+
+	data = wl_connection_view(connection, 2 * sizeof (data[0]));
+	size = data[1] >> 16;
+
+	data = wl_connection_view(connection, size);
+	if (data == NULL) {
+		printf("out of memory for request\n");
+		id = -1;
+	} else {
+		id = wl_signature_vdemarshal(signature, objects, func,
+					     data, va);
+	}
+
+	wl_connection_consume(connection, size);
+
+	return id;
+}
+
+int
+wl_connection_demarshal_ffi(struct wl_connection *connection,
+			    struct wl_hash *objects,
+			    void (*func)(void), const char *arguments, ...)
+{
+	struct wl_signature signature;
+	va_list va;
+	int id;
+
+	if (wl_signature_init(&signature, arguments) < 0)
+		return -1;
+
+	va_start (va, arguments);
+	id = wl_connection_vdemarshal_signature(connection, objects, func,
+						&signature, va);
+	va_end (va);
+
+	return id;
+}
+
+int
+wl_signature_demarshal(const struct wl_signature *signature,
+		       struct wl_hash *objects, void (*func)(void),
+		       const uint32_t *data, ...)
+{
+	va_list va;
+	int id;
+
+	va_start (va, data);
+	id = wl_signature_vdemarshal(signature, objects, func, data, va);
+	va_end (va);
+
+	return id;
+}
+
+int
+wl_connection_demarshal_signature(struct wl_connection *connection,
+				  struct wl_hash *objects, void (*func)(void),
+				  const struct wl_signature *signature, ...)
+{
+	va_list va;
+	int id;
+
+	va_start (va, signature);
+	id = wl_connection_vdemarshal_signature(connection, objects, func,
+						signature, va);
+	va_end (va);
+
 	return id;
 }
@@ -5,22 +5,67 @@
 
 struct wl_connection;
 struct wl_hash;
+struct iovec;
+struct wl_signature;
 
 #define WL_CONNECTION_READABLE 0x01
 #define WL_CONNECTION_WRITABLE 0x02
+/* A corked connection has output waiting for wl_connection_flush(). */
+#define WL_CONNECTION_FLUSH 0x04
+
+/* The message size is a 16 bit field and messages are padded to a
+ * multiple of four bytes. */
+#define WL_CONNECTION_MAX_MESSAGE_SIZE 65532
+
+/* Argument of type 'a': SIZE bytes at DATA, sent as a length followed
+ * by the bytes padded to a multiple of four.  Demarshalled arrays
+ * point into the connection buffer and are only valid while the
+ * handler runs. */
+struct wl_array {
+	uint32_t size;
+	uint32_t alloc;
+	void *data;
+};
+
+/* Reads and writes made on behalf of all connections, for checking
+ * how well writes are batched. */
+struct wl_connection_stats {
+	uint64_t reads, writes;
+};
 
 typedef int (*wl_connection_update_func_t)(struct wl_connection *connection,
 					   uint32_t mask, void *data);
 
+#define WL_CONNECTION_CAPTURE_IN 0
+#define WL_CONNECTION_CAPTURE_OUT 1
+
+typedef void (*wl_connection_capture_func_t)(void *data, uint32_t direction,
+					     const struct iovec *iov,
+					     int count);
+
 struct wl_connection *wl_connection_create(int fd,
 					   wl_connection_update_func_t update,
 					   void *data);
 void wl_connection_destroy(struct wl_connection *connection);
 void wl_connection_copy(struct wl_connection *connection, void *data, size_t size);
+const void *wl_connection_view(struct wl_connection *connection, size_t size);
 void wl_connection_consume(struct wl_connection *connection, size_t size);
 int wl_connection_data(struct wl_connection *connection, uint32_t mask);
 void wl_connection_sync(struct wl_connection *connection);
-void wl_connection_write(struct wl_connection *connection, const void *data, size_t count);
+int wl_connection_write(struct wl_connection *connection, const void *data, size_t count);
+int wl_connection_write_coalesced(struct wl_connection *connection,
+				  const void *data, size_t count);
+int wl_connection_flush(struct wl_connection *connection);
+int wl_connection_receive(struct wl_connection *connection,
+			  const void *data, size_t count);
+int wl_connection_get_output(struct wl_connection *connection,
+			     struct iovec *iov);
+int wl_connection_written(struct wl_connection *connection, int len);
+void wl_connection_cork(struct wl_connection *connection);
+void wl_connection_get_stats(struct wl_connection_stats *stats);
+void wl_connection_set_limit(struct wl_connection *connection, uint32_t limit);
+void wl_connection_set_capture(struct wl_connection *connection,
+			       wl_connection_capture_func_t func, void *data);
 int wl_connection_demarshal_ffi(struct wl_connection *connection,
 			        struct wl_hash *objects, void (*func)(void),
 			        const char *arguments, ...);
@@ -35,4 +80,24 @@ void wl_connection_vmarshal(struct wl_connection *connection,
 			    struct wl_hash *objects, uint32_t obj_id,
 			    uint32_t opcode, const char *types, va_list va);
 
+struct wl_signature *wl_signature_create(const char *types);
+void wl_signature_destroy(struct wl_signature *signature);
+int wl_signature_demarshal(const struct wl_signature *signature,
+			   struct wl_hash *objects, void (*func)(void),
+			   const uint32_t *data, ...);
+int wl_connection_demarshal_signature(struct wl_connection *connection,
+				      struct wl_hash *objects,
+				      void (*func)(void),
+				      const struct wl_signature *signature,
+				      ...);
+int wl_signature_vmarshal(const struct wl_signature *signature,
+			  struct wl_hash *objects, uint32_t obj_id,
+			  uint32_t opcode, uint32_t *data, size_t size,
+			  va_list va);
+void wl_connection_vmarshal_signature(struct wl_connection *connection,
+				      struct wl_hash *objects, uint32_t obj_id,
+				      uint32_t opcode,
+				      const struct wl_signature *signature,
+				      va_list va);
+
 #endif
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wayland.h"
+#include "wayland-internal.h"
+
+/* A global object that lets a client pull the server's profile: the
+ * dump request is answered, to the asking client only, with one line
+ * event per line of wl_display_dump_profile() output and a done
+ * event. */
+
+struct wl_debug_object {
+	struct wl_object base;
+};
+
+struct wl_debug_dump {
+	struct wl_client *client;
+	struct wl_object *object;
+};
+
+static void
+wl_debug_object_send_line(const char *line, void *data)
+{
+	struct wl_debug_dump *dump = data;
+
+	wl_connection_marshal(dump->client->connection, NULL,
+			      dump->object->id, 0, "s", line);
+}
+
+static void
+wl_debug_object_dump(struct wl_client *client, struct wl_object *base)
+{
+	struct wl_debug_dump dump = { client, base };
+
+	wl_display_dump_profile(client->display,
+				wl_debug_object_send_line, &dump);
+	wl_connection_marshal(client->connection, NULL, base->id, 1, "");
+}
+
+static const struct wl_event debug_object_events[] = {
+	WL_DEFEVENT ("line", "s")
+	WL_DEFEVENT ("done", "")
+};
+
+static const struct wl_method debug_object_methods[] = {
+	WL_DEFMETHOD ("dump", "", wl_debug_object_dump)
+};
+
+static const struct wl_interface debug_object_interface = {
+	"debug", 1,
+	ARRAY_LENGTH(debug_object_methods),
+	debug_object_methods,
+	ARRAY_LENGTH(debug_object_events),
+	debug_object_events,
+};
+
+struct wl_object *
+wl_debug_object_create(struct wl_display *display, uint32_t id)
+{
+	struct wl_debug_object *debug;
+
+	debug = malloc(sizeof *debug);
+	if (debug == NULL)
+		return NULL;
+
+	debug->base.id = id;
+	debug->base.interface = &debug_object_interface;
+
+	return &debug->base;
+}
@@ -19,6 +19,11 @@
 
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
 
+/* Refresh rate in mHz, and how many milliseconds before each frame
+ * deadline the repaint starts. */
+#define REFRESH_RATE 60000
+#define REPAINT_LEAD 4
+
 struct egl_compositor {
 	struct wl_compositor base;
 	EGLDisplay display;
@@ -26,21 +31,31 @@ struct egl_compositor {
 	EGLContext context;
 	EGLConfig config;
 	struct wl_display *wl_display;
+	struct wl_frame_clock *frame_clock;
 	int width, height;
+	/* eglSwapBuffers flips between two buffers, so the back
+	 * buffer holds the frame before last and has to catch up on
+	 * that frame's damage as well as this one's. */
+	struct wl_damage damage;
+	struct wl_region previous_damage;
+	struct wl_cull cull;
 };
 
 struct surface_data {
+	struct wl_renderer_surface base;
 	GLuint texture;
-	struct wl_map map;
 	EGLSurface surface;
 };
 
 static int do_screenshot;
 
 static void
-handle_sigusr1(int s)
+handle_sigusr1(int s, void *data)
 {
+	struct egl_compositor *ec = data;
+
 	do_screenshot = 1;
+	wl_frame_clock_schedule(ec->frame_clock);
 }
 
 static void
@@ -172,57 +187,171 @@ screenshot(struct egl_compositor *ec)
 }
 
 static void
-repaint(void *data)
+draw_surface(struct surface_data *sd, int blend)
 {
-	struct egl_compositor *ec = data;
-	struct wl_surface_iterator *iterator;
-	struct wl_surface *surface;
-	struct surface_data *sd;
 	GLint vertices[12];
 	GLint tex_coords[12] = { 0, 0,  0, 1,  1, 0,  1, 1 };
 	GLuint indices[4] = { 0, 1, 2, 3 };
 
+	vertices[0] = sd->base.map.x;
+	vertices[1] = sd->base.map.y;
+	vertices[2] = 0;
+
+	vertices[3] = sd->base.map.x;
+	vertices[4] = sd->base.map.y + sd->base.map.height;
+	vertices[5] = 0;
+
+	vertices[6] = sd->base.map.x + sd->base.map.width;
+	vertices[7] = sd->base.map.y;
+	vertices[8] = 0;
+
+	vertices[9] = sd->base.map.x + sd->base.map.width;
+	vertices[10] = sd->base.map.y + sd->base.map.height;
+	vertices[11] = 0;
+
+	glBindTexture(GL_TEXTURE_2D, sd->texture);
+	glEnable(GL_TEXTURE_2D);
+	if (blend && sd->base.format == WL_SURFACE_FORMAT_ARGB8888) {
+		glEnable(GL_BLEND);
+		/* Assume pre-multiplied alpha for now, this probably
+		 * needs to be a wayland visual type of thing. */
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	} else {
+		glDisable(GL_BLEND);
+	}
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glVertexPointer(3, GL_INT, 0, vertices);
+	glTexCoordPointer(2, GL_INT, 0, tex_coords);
+	glDrawElements(GL_TRIANGLE_STRIP, 4, GL_UNSIGNED_INT, indices);
+}
+
+/* Redraw the boxes of region with the scissor set to each in turn,
+ * drawing only the surfaces that overlap it.  This is what we fall
+ * back to when culling runs out of memory. */
+
+static void
+draw_damage(struct egl_compositor *ec, struct wl_region *region)
+{
+	struct wl_surface_iterator *iterator;
+	struct wl_surface *surface;
+	struct surface_data *sd;
+	struct wl_box *box;
+	int i;
+
+	glEnable(GL_SCISSOR_TEST);
+	for (i = 0; i < region->count; i++) {
+		box = &region->boxes[i];
+		glScissor(box->x1, ec->height - box->y2,
+			  box->x2 - box->x1, box->y2 - box->y1);
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		iterator = wl_surface_iterator_create(ec->wl_display, 0);
+		while (wl_surface_iterator_next(iterator, &surface)) {
+			sd = wl_surface_get_data(surface);
+			if (sd == NULL ||
+			    sd->base.map.x >= box->x2 ||
+			    sd->base.map.y >= box->y2 ||
+			    sd->base.map.x + sd->base.map.width <= box->x1 ||
+			    sd->base.map.y + sd->base.map.height <= box->y1)
+				continue;
+			draw_surface(sd, 1);
+		}
+		wl_surface_iterator_destroy(iterator);
+	}
+	glDisable(GL_SCISSOR_TEST);
+}
+
+/* Stack the surfaces bottom to top and work out what of each is
+ * visible within the damage. */
+
+static int
+cull_surfaces(struct egl_compositor *ec, struct wl_region *damage)
+{
+	struct wl_surface_iterator *iterator;
+	struct wl_surface *surface;
+	struct surface_data *sd;
+
+	wl_cull_clear(&ec->cull);
 	iterator = wl_surface_iterator_create(ec->wl_display, 0);
 	while (wl_surface_iterator_next(iterator, &surface)) {
 		sd = wl_surface_get_data(surface);
 		if (sd == NULL)
 			continue;
+		if (wl_cull_add(&ec->cull, &sd->base.map,
+				sd->base.map.x, sd->base.map.y,
+				&sd->base.opaque, sd) < 0) {
+			wl_surface_iterator_destroy(iterator);
+			return -1;
+		}
+	}
+	wl_surface_iterator_destroy(iterator);
 
-		vertices[0] = sd->map.x;
-		vertices[1] = sd->map.y;
-		vertices[2] = 0;
+	return wl_cull_run(&ec->cull, damage);
+}
 
-		vertices[3] = sd->map.x;
-		vertices[4] = sd->map.y + sd->map.height;
-		vertices[5] = 0;
+/* Draw a box with the scissor set to it, from the item's surface or
+ * as background if there's no item. */
 
-		vertices[6] = sd->map.x + sd->map.width;
-		vertices[7] = sd->map.y;
-		vertices[8] = 0;
+static void
+draw_box(struct wl_cull_item *item, int blend,
+	 const struct wl_box *box, void *data)
+{
+	struct egl_compositor *ec = data;
 
-		vertices[9] = sd->map.x + sd->map.width;
-		vertices[10] = sd->map.y + sd->map.height;
-		vertices[11] = 0;
+	glScissor(box->x1, ec->height - box->y2,
+		  box->x2 - box->x1, box->y2 - box->y1);
+	if (item == NULL)
+		glClear(GL_COLOR_BUFFER_BIT);
+	else
+		draw_surface(item->data, blend);
+}
 
-		glBindTexture(GL_TEXTURE_2D, sd->texture);
-		glEnable(GL_TEXTURE_2D);
-		glEnable(GL_BLEND);
-		/* Assume pre-multiplied alpha for now, this probably
-		 * needs to be a wayland visual type of thing. */
-		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+static void
+repaint(void *data)
+{
+	struct egl_compositor *ec = data;
+	struct wl_surface_iterator *iterator;
+	struct wl_surface *surface;
+	struct surface_data *sd;
+	struct wl_region region, swap;
 
-		glEnableClientState(GL_VERTEX_ARRAY);
-		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-		glVertexPointer(3, GL_INT, 0, vertices);
-		glTexCoordPointer(2, GL_INT, 0, tex_coords);
-		glDrawElements(GL_TRIANGLE_STRIP, 4, GL_UNSIGNED_INT, indices);
+	iterator = wl_surface_iterator_create(ec->wl_display, 0);
+	while (wl_surface_iterator_next(iterator, &surface)) {
+		sd = wl_surface_get_data(surface);
+		if (sd != NULL)
+			wl_renderer_surface_flush_damage(&sd->base,
+							 &ec->damage);
 	}
 	wl_surface_iterator_destroy(iterator);
 
+	wl_damage_clip(&ec->damage);
+	wl_region_init(&region);
+	if (wl_region_union(&region, &ec->damage.region,
+			    &ec->previous_damage) < 0)
+		wl_region_init_rect(&region, 0, 0, ec->width, ec->height);
+	if (cull_surfaces(ec, &region) < 0) {
+		fprintf(stderr, "out of memory culling surfaces\n");
+		draw_damage(ec, &region);
+	} else {
+		glEnable(GL_SCISSOR_TEST);
+		wl_cull_for_each_box(&ec->cull, draw_box, ec);
+		glDisable(GL_SCISSOR_TEST);
+	}
+	wl_region_fini(&region);
+
+	swap = ec->previous_damage;
+	ec->previous_damage = ec->damage.region;
+	ec->damage.region = swap;
+	wl_region_clear(&ec->damage.region);
+
 	glFlush();
 
 	eglSwapBuffers(ec->display, ec->surface);
 
+	wl_display_post_frame(ec->wl_display);
+
 	if (do_screenshot) {
 		glFinish();
 		/* FIXME: There's a bug somewhere so that glFinish()
@@ -238,10 +367,7 @@ repaint(void *data)
 static void
 schedule_repaint(struct egl_compositor *ec)
 {
-	struct wl_event_loop *loop;
-
-	loop = wl_display_get_event_loop(ec->wl_display);
-	wl_event_loop_add_idle(loop, repaint, ec);
+	wl_frame_clock_schedule(ec->frame_clock);
 }
 
 static void
@@ -254,7 +380,9 @@ notify_surface_create(struct wl_compositor *compositor,
 	if (sd == NULL)
 		return;
 
+	memset(sd, 0, sizeof *sd);
 	sd->surface = EGL_NO_SURFACE;
+	wl_renderer_surface_init(&sd->base);
 	wl_surface_set_data(surface, sd);
 
 	glGenTextures(1, &sd->texture);
@@ -276,6 +404,9 @@ notify_surface_destroy(struct wl_compositor *compositor,
 
 	glDeleteTextures(1, &sd->texture);
 
+	wl_renderer_surface_damage_map(&sd->base, &ec->damage);
+	wl_renderer_surface_fini(&sd->base);
+	wl_surface_set_data(surface, NULL);
 	free(sd);
 
 	schedule_repaint(ec);
@@ -284,7 +415,8 @@ notify_surface_destroy(struct wl_compositor *compositor,
 static void
 notify_surface_attach(struct wl_compositor *compositor,
 		      struct wl_surface *surface, uint32_t name, 
-		      uint32_t width, uint32_t height, uint32_t stride)
+		      uint32_t width, uint32_t height, uint32_t stride,
+		      uint32_t format)
 {
 	struct egl_compositor *ec = (struct egl_compositor *) compositor;
 	struct surface_data *sd;
@@ -309,7 +441,8 @@ notify_surface_attach(struct wl_compositor *compositor,
 	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	eglBindTexImage(ec->display, sd->surface, GL_TEXTURE_2D);
 
-	schedule_repaint(ec);
+	wl_renderer_surface_attach(&sd->base, &ec->damage,
+				   width, height, format);
 }
 
 static void
@@ -323,9 +456,7 @@ notify_surface_map(struct wl_compositor *compositor,
 	if (sd == NULL)
 		return;
 
-	sd->map = *map;
-
-	schedule_repaint(ec);
+	wl_renderer_surface_map(&sd->base, &ec->damage, map);
 }
 
 static void
@@ -351,27 +482,75 @@ notify_surface_copy(struct wl_compositor *compositor,
 
 	eglCopyNativeBuffers(ec->display, sd->surface, GL_FRONT_LEFT, dst_x, dst_y,
 			     src, GL_FRONT_LEFT, x, y, width, height);
-	schedule_repaint(ec);
+
+	wl_renderer_surface_damage(&sd->base, &ec->damage,
+				   dst_x, dst_y, width, height);
 }
 
 static void
 notify_surface_damage(struct wl_compositor *compositor,
 		      struct wl_surface *surface,
 		      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct egl_compositor *ec = (struct egl_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_damage(&sd->base, &ec->damage,
+				   x, y, width, height);
+}
+
+static void
+notify_commit(struct wl_compositor *compositor)
 {
 	struct egl_compositor *ec = (struct egl_compositor *) compositor;
 
-	/* FIXME: This need to take a damage region, of course. */
 	schedule_repaint(ec);
 }
 
+static void
+notify_surface_opaque(struct wl_compositor *compositor,
+		      struct wl_surface *surface,
+		      const struct wl_region *opaque)
+{
+	struct egl_compositor *ec = (struct egl_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_set_opaque(&sd->base, &ec->damage, opaque);
+}
+
+static void
+notify_surface_stack(struct wl_compositor *compositor,
+		     struct wl_surface *surface)
+{
+	struct egl_compositor *ec = (struct egl_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_damage_map(&sd->base, &ec->damage);
+}
+
 static const struct wl_compositor_interface interface = {
 	notify_surface_create,
 	notify_surface_destroy,
 	notify_surface_attach,
 	notify_surface_map,
 	notify_surface_copy,
-	notify_surface_damage
+	notify_surface_damage,
+	NULL, /* notify_display_destroy */
+	notify_commit,
+	notify_surface_opaque,
+	notify_surface_stack
 };
 
 WL_EXPORT struct wl_display *
@@ -389,9 +568,14 @@ wl_compositor_init(int argc, char **argv)
 
 	ec->width = 1280;
 	ec->height = 800;
+	wl_cull_init(&ec->cull);
+	wl_region_init(&ec->previous_damage);
+	if (wl_damage_init(&ec->damage, ec->width, ec->height) < 0) {
+		free(ec);
+		return NULL;
+	}
 
 	ec->base.interface = &interface;
-	ec->wl_display = display;
 
 	backend = wl_backend_create("gem", NULL);
 	display = wl_display_create(backend, &ec->base);
@@ -399,6 +583,15 @@ wl_compositor_init(int argc, char **argv)
 		wl_backend_destroy(backend);
 		return NULL;
 	}
+	ec->wl_display = display;
+
+	ec->frame_clock =
+		wl_frame_clock_create(wl_display_get_event_loop(display),
+				      REFRESH_RATE, REPAINT_LEAD, repaint, ec);
+	if (ec->frame_clock == NULL) {
+		fprintf(stderr, "failed to create frame clock\n");
+		return NULL;
+	}
 
 	create_input_devices (display);
 	ec->display = wl_backend_get_egl_display(backend);
@@ -444,7 +637,8 @@ wl_compositor_init(int argc, char **argv)
 	glClearColor(0.0, 0.05, 0.2, 0.0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	signal(SIGUSR1, handle_sigusr1);
+	wl_event_loop_add_signal(wl_display_get_event_loop(display),
+				 SIGUSR1, handle_sigusr1, ec);
 
 	schedule_repaint(ec);
 
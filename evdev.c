@@ -18,26 +18,39 @@ struct wl_input_device {
 	int32_t x, y;
 };
 
+/* Motion is x, y on screen, then relative to the focused surface;
+ * clients that only read the first two keep working.  Only the
+ * latest motion matters to a client that is behind. */
 static const struct wl_event input_device_events[] = {
-	WL_DEFEVENT ("motion", "ii")
+	WL_DEFEVENT_COALESCE ("motion", "iiii")
 	WL_DEFEVENT ("button", "ii")
+	WL_DEFEVENT ("enter", "oii")
+	WL_DEFEVENT ("leave", "o")
+};
+
+/* Ask for motion wherever the pointer is, for drawing a cursor. */
+static void
+wl_input_device_watch(struct wl_client *client, struct wl_object *device)
+{
+	wl_client_watch_pointer(client);
+}
+
+static const struct wl_method input_device_methods[] = {
+	WL_DEFMETHOD ("watch", "", wl_input_device_watch)
 };
 
 static const struct wl_interface input_device_interface = {
 	"input_device", 1,
-	0, NULL,
+	ARRAY_LENGTH(input_device_methods),
+	input_device_methods,
 	ARRAY_LENGTH(input_device_events),
 	input_device_events,
 };
 
-#define WL_POINTER_MOTION 0
-#define WL_POINTER_BUTTON 1
-
 static void
 wl_input_device_post_motion_event(struct wl_input_device *device, int x, int y)
 {
-	wl_display_send_event(device->display, &device->base,
-			      WL_POINTER_MOTION, x, y);
+	wl_display_post_pointer_motion(device->display, &device->base, x, y);
 }
 
 
@@ -45,8 +58,8 @@ static void
 wl_input_device_post_button_event(struct wl_input_device *device,
 				  int button, int state)
 {
-	wl_display_send_event(device->display, &device->base,
-			      WL_POINTER_BUTTON, button, state);
+	wl_display_post_pointer_button(device->display, &device->base,
+				       button, state);
 }
 
 
@@ -173,6 +186,7 @@ wl_input_device_create(struct wl_display *display,
 		free(device);
 		return NULL;
 	}
+	wl_event_source_set_priority(device->source, 1);
 
 	return &device->base;
 }
@@ -0,0 +1,334 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+
+#include "wayland.h"
+#include "connection.h"
+
+/* Compares the epoll and io_uring event loops serving many clients
+ * the way the compositor does: corked connections, requests
+ * dispatched from the loop and replies flushed once per iteration.
+ * A client thread sends a timestamped request on every connection
+ * and waits for all replies before the next round.  Reported are the
+ * server's system calls per request and the 99th percentile of the
+ * time from send to dispatch. */
+
+#define REQUESTS 200000
+
+struct bench;
+
+struct peer {
+	struct bench *bench;
+	struct wl_connection *connection;
+	struct wl_event_source *source;
+	struct wl_list flush_link;
+	uint32_t mask;
+	int fd;
+};
+
+struct bench {
+	struct wl_event_loop *loop;
+	struct peer *peers;
+	int *client_fds;
+	int count, rounds, received;
+	struct wl_list flush_list;
+	uint32_t *latency;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+peer_update(struct wl_connection *connection, uint32_t mask, void *data)
+{
+	struct peer *peer = data;
+	uint32_t emask = 0, changed;
+
+	changed = mask ^ peer->mask;
+	peer->mask = mask;
+
+	if (changed & WL_CONNECTION_FLUSH) {
+		if (mask & WL_CONNECTION_FLUSH)
+			wl_list_insert(peer->bench->flush_list.prev,
+				       &peer->flush_link);
+		else
+			wl_list_remove(&peer->flush_link);
+	}
+
+	if (!(changed & (WL_CONNECTION_READABLE | WL_CONNECTION_WRITABLE)) ||
+	    peer->source == NULL)
+		return 0;
+
+	if (mask & WL_CONNECTION_READABLE)
+		emask |= WL_EVENT_READABLE;
+	if (mask & WL_CONNECTION_WRITABLE)
+		emask |= WL_EVENT_WRITEABLE;
+
+	return wl_event_loop_update_source(peer->bench->loop,
+					   peer->source, emask);
+}
+
+static void
+peer_process(struct peer *peer, int len)
+{
+	struct bench *bench = peer->bench;
+	const uint32_t *p;
+	uint32_t reply[2];
+	uint64_t sent;
+
+	if (len < 0) {
+		fprintf(stderr, "connection error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (len >= 16) {
+		p = wl_connection_view(peer->connection, 16);
+		sent = p[2] | (uint64_t) p[3] << 32;
+		bench->latency[bench->received++] = now_ns() - sent;
+
+		reply[0] = p[0];
+		reply[1] = sizeof reply << 16;
+		wl_connection_consume(peer->connection, 16);
+		wl_connection_write(peer->connection, reply, sizeof reply);
+		len -= 16;
+	}
+}
+
+static void
+peer_data(int fd, uint32_t mask, void *data)
+{
+	struct peer *peer = data;
+	uint32_t cmask = 0;
+
+	if (mask & WL_EVENT_READABLE)
+		cmask |= WL_CONNECTION_READABLE;
+	if (mask & WL_EVENT_WRITEABLE)
+		cmask |= WL_CONNECTION_WRITABLE;
+
+	peer_process(peer, wl_connection_data(peer->connection, cmask));
+}
+
+static void
+peer_recv(int fd, uint32_t mask, const void *buffer, int size, void *data)
+{
+	struct peer *peer = data;
+
+	if (mask & WL_EVENT_READABLE)
+		peer_process(peer, size > 0 ?
+			     wl_connection_receive(peer->connection,
+						   buffer, size) : -1);
+	else
+		peer_process(peer, wl_connection_data(peer->connection,
+						      WL_CONNECTION_WRITABLE));
+}
+
+/* The same as wl_display_flush_clients(): one writev per connection
+ * with epoll, batches of sends with io_uring. */
+
+static void
+flush_peers(void *data)
+{
+	struct bench *bench = data;
+	struct wl_event_loop_write writes[64];
+	struct iovec iov[64][2];
+	struct peer *peers[64];
+	struct peer *peer;
+	struct wl_list *node, *next;
+	int i, count;
+
+	if (wl_event_loop_get_backend(bench->loop) == WL_EVENT_LOOP_EPOLL) {
+		for (node = bench->flush_list.next;
+		     node != &bench->flush_list; node = next) {
+			next = node->next;
+			peer = container_of(node, struct peer, flush_link);
+			wl_connection_flush(peer->connection);
+		}
+		return;
+	}
+
+	while (bench->flush_list.next != &bench->flush_list) {
+		node = bench->flush_list.next;
+		for (count = 0; node != &bench->flush_list && count < 64;
+		     node = node->next, count++) {
+			peer = container_of(node, struct peer, flush_link);
+			writes[count].fd = peer->fd;
+			writes[count].iov = iov[count];
+			writes[count].count =
+				wl_connection_get_output(peer->connection,
+							 iov[count]);
+			peers[count] = peer;
+		}
+		wl_event_loop_writev(bench->loop, writes, count);
+		for (i = 0; i < count; i++)
+			wl_connection_written(peers[i]->connection,
+					      writes[i].result);
+	}
+}
+
+static void *
+client_thread(void *data)
+{
+	struct bench *bench = data;
+	uint32_t request[4], reply[2];
+	uint64_t sent;
+	int i, r, len, n;
+
+	for (r = 0; r < bench->rounds; r++) {
+		for (i = 0; i < bench->count; i++) {
+			sent = now_ns();
+			request[0] = i;
+			request[1] = sizeof request << 16;
+			request[2] = sent;
+			request[3] = sent >> 32;
+			if (write(bench->client_fds[i],
+				  request, sizeof request) != sizeof request)
+				abort();
+		}
+		for (i = 0; i < bench->count; i++) {
+			for (len = 0; len < sizeof reply; len += n) {
+				n = read(bench->client_fds[i],
+					 (char *) reply + len,
+					 sizeof reply - len);
+				if (n <= 0)
+					abort();
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+run(uint32_t backend, int count)
+{
+	struct wl_event_loop_stats loop_stats;
+	struct wl_connection_stats before, after;
+	struct bench bench;
+	struct peer *peer;
+	pthread_t thread;
+	uint64_t syscalls;
+	int i, fd[2], total;
+
+	memset(&bench, 0, sizeof bench);
+	bench.loop = wl_event_loop_create_backend(backend);
+	if (bench.loop == NULL) {
+		fprintf(stderr, "%s: no event loop: %m\n",
+			backend == WL_EVENT_LOOP_EPOLL ? "epoll" : "io_uring");
+		return;
+	}
+	wl_list_init(&bench.flush_list);
+	wl_event_loop_set_flush_func(bench.loop, flush_peers, &bench);
+
+	bench.count = count;
+	bench.rounds = REQUESTS / count;
+	total = bench.rounds * count;
+	bench.peers = calloc(count, sizeof *bench.peers);
+	bench.client_fds = calloc(count, sizeof *bench.client_fds);
+	bench.latency = calloc(total, sizeof *bench.latency);
+	if (!bench.peers || !bench.client_fds || !bench.latency) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (socketpair(AF_LOCAL, SOCK_STREAM, 0, fd) < 0) {
+			fprintf(stderr, "socketpair failed: %m\n");
+			exit(EXIT_FAILURE);
+		}
+		fcntl(fd[1], F_SETFL, O_NONBLOCK);
+		bench.client_fds[i] = fd[0];
+
+		peer = &bench.peers[i];
+		peer->bench = &bench;
+		peer->fd = fd[1];
+		peer->mask = WL_CONNECTION_READABLE;
+		peer->connection = wl_connection_create(fd[1], peer_update,
+							peer);
+		wl_connection_cork(peer->connection);
+		peer->source = wl_event_loop_add_recv(bench.loop, fd[1],
+						      WL_EVENT_READABLE,
+						      peer_recv, peer);
+		if (peer->source == NULL)
+			peer->source =
+				wl_event_loop_add_fd(bench.loop, fd[1],
+						     WL_EVENT_READABLE,
+						     peer_data, peer);
+		if (peer->source == NULL) {
+			fprintf(stderr, "failed to add source: %m\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	wl_connection_get_stats(&before);
+	pthread_create(&thread, NULL, client_thread, &bench);
+	while (bench.received < total)
+		wl_event_loop_wait(bench.loop);
+	pthread_join(thread, NULL);
+	wl_connection_get_stats(&after);
+	wl_event_loop_get_stats(bench.loop, &loop_stats);
+
+	syscalls = loop_stats.waits + loop_stats.updates + loop_stats.submits +
+		after.reads - before.reads + after.writes - before.writes;
+	qsort(bench.latency, total, sizeof bench.latency[0], compare);
+	printf("%-8s %5d clients: %6.3f syscalls/request  "
+	       "p99 latency %7.1f us\n",
+	       backend == WL_EVENT_LOOP_EPOLL ? "epoll" : "io_uring", count,
+	       (double) syscalls / total,
+	       bench.latency[total * 99 / 100] / 1000.0);
+
+	for (i = 0; i < count; i++) {
+		wl_event_loop_remove_source(bench.loop, bench.peers[i].source);
+		wl_connection_destroy(bench.peers[i].connection);
+		close(bench.peers[i].fd);
+		close(bench.client_fds[i]);
+	}
+	wl_event_loop_destroy(bench.loop);
+	free(bench.peers);
+	free(bench.client_fds);
+	free(bench.latency);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int clients[] = { 1, 100, 1000 };
+	struct rlimit limit;
+	int i;
+
+	/* Two fds per client. */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < 4096) {
+		limit.rlim_cur = limit.rlim_max < 4096 ? limit.rlim_max : 4096;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	for (i = 0; i < ARRAY_LENGTH(clients); i++) {
+		run(WL_EVENT_LOOP_EPOLL, clients[i]);
+		run(WL_EVENT_LOOP_IO_URING, clients[i]);
+	}
+
+	return 0;
+}
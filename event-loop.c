@@ -3,48 +3,128 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <time.h>
 #include <unistd.h>
 #include "wayland.h"
 
+/* Every kind of event source implements dispatch, called when its
+ * fd is ready, and remove, which releases whatever the source owns.
+ * Removed sources aren't freed right away but parked on the
+ * destroy list until the end of wl_event_loop_wait(), since epoll
+ * may already have returned them in the current batch.
+ *
+ * A source that stops short of handling everything it has, to give
+ * others a turn, puts itself on the check list with
+ * wl_event_source_check(); the loop then dispatches it again, with an
+ * empty mask, once per iteration until it stops asking.
+ *
+ * A loop waits either with epoll or, see further down, with
+ * io_uring. */
+
+struct wl_event_source_interface {
+	void (*dispatch)(struct wl_event_source *source,
+			 struct epoll_event *ep);
+	void (*remove)(struct wl_event_source *source);
+	const char *name;
+};
+
+struct wl_event_loop_uring;
+
 struct wl_event_loop {
 	int epoll_fd;
-	wl_event_loop_idle_func_t idle_func;
-	void *idle_data;
+	struct wl_event_loop_uring *uring;
+	struct wl_list idle_list;
+	struct wl_list check_list;
+	struct wl_list destroy_list;
+	wl_event_loop_flush_func_t flush_func;
+	void *flush_data;
+	struct wl_event_loop_stats stats;
+
+	/* Profiling: dispatch times of every source dispatched since
+	 * it was turned on, idle callback latency and repaint time. */
+	int profiling;
+	struct wl_list profile_list;
+	struct wl_histogram idle_latency, repaint;
 };
 
 struct wl_event_source {
+	const struct wl_event_source_interface *interface;
+	struct wl_event_loop *loop;
+	struct wl_list link;
+	struct wl_list check_link;
 	int fd;
-	wl_event_loop_fd_func_t func;
+	int priority;
 	void *data;
+
+	/* For io_uring: the poll events wanted and those of the poll
+	 * in flight, and how many requests in flight refer to the
+	 * source.  A removed source isn't freed until that drops to
+	 * zero. */
+	uint32_t events, armed;
+	int inflight;
+
+	struct wl_event_source_profile *profile;
 };
 
-WL_EXPORT struct wl_event_source *
-wl_event_loop_add_fd(struct wl_event_loop *loop,
-		     int fd, uint32_t mask,
-		     wl_event_loop_fd_func_t func,
-		     void *data)
+struct wl_event_source_profile {
+	struct wl_event_source *source;
+	struct wl_list link;
+	struct wl_histogram dispatch;
+};
+
+static int wl_event_loop_uring_arm(struct wl_event_loop *loop,
+				   struct wl_event_source *source);
+static void wl_event_loop_uring_update(struct wl_event_loop *loop,
+				       struct wl_event_source *source,
+				       uint32_t events);
+static void wl_event_loop_uring_cancel(struct wl_event_loop *loop,
+				       struct wl_event_source *source);
+
+static struct wl_event_source *
+add_source(struct wl_event_loop *loop, size_t size,
+	   const struct wl_event_source_interface *interface,
+	   int fd, uint32_t events, void *data)
 {
 	struct wl_event_source *source;
 	struct epoll_event ep;
 
-	source = malloc(sizeof *source);
+	source = malloc(size);
 	if (source == NULL)
 		return NULL;
 
+	source->interface = interface;
+	source->loop = loop;
 	source->fd = fd;
-	source->func = func;
+	source->priority = 0;
 	source->data = data;
+	source->events = events;
+	source->armed = 0;
+	source->inflight = 0;
+	source->profile = NULL;
+	wl_list_init(&source->check_link);
 
-	ep.events = 0;
-	if (mask & WL_EVENT_READABLE)
-		ep.events |= EPOLLIN;
-	if (mask & WL_EVENT_WRITEABLE)
-		ep.events |= EPOLLOUT;
+	if (loop->uring) {
+		if (wl_event_loop_uring_arm(loop, source) < 0) {
+			free(source);
+			return NULL;
+		}
+		return source;
+	}
+
+	ep.events = events;
 	ep.data.ptr = source;
 
+	loop->stats.updates++;
 	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ep) < 0) {
 		free(source);
 		return NULL;
@@ -53,23 +133,63 @@ wl_event_loop_add_fd(struct wl_event_loop *loop,
 	return source;
 }
 
-struct wl_event_source idle_source;
+struct wl_event_source_fd {
+	struct wl_event_source base;
+	wl_event_loop_fd_func_t func;
+};
 
-WL_EXPORT int
-wl_event_loop_remove_source(struct wl_event_loop *loop,
-			    struct wl_event_source *source)
+static void
+wl_event_source_fd_dispatch(struct wl_event_source *source,
+			    struct epoll_event *ep)
 {
-	int fd;
+	struct wl_event_source_fd *fd_source =
+		(struct wl_event_source_fd *) source;
+	uint32_t mask;
 
-	if (source == &idle_source) {
-		loop->idle_func = NULL;
-		return 0;
-	} else {
-		fd = source->fd;
-		free(source);
-		return epoll_ctl(loop->epoll_fd,
-				 EPOLL_CTL_DEL, fd, NULL);
-	};
+	mask = 0;
+	if (ep->events & EPOLLIN)
+		mask |= WL_EVENT_READABLE;
+	if (ep->events & EPOLLOUT)
+		mask |= WL_EVENT_WRITEABLE;
+
+	fd_source->func(source->fd, mask, source->data);
+}
+
+static void
+wl_event_source_fd_remove(struct wl_event_source *source)
+{
+}
+
+static const struct wl_event_source_interface fd_source_interface = {
+	wl_event_source_fd_dispatch,
+	wl_event_source_fd_remove,
+	"fd"
+};
+
+WL_EXPORT struct wl_event_source *
+wl_event_loop_add_fd(struct wl_event_loop *loop,
+		     int fd, uint32_t mask,
+		     wl_event_loop_fd_func_t func,
+		     void *data)
+{
+	struct wl_event_source_fd *source;
+	uint32_t events;
+
+	events = 0;
+	if (mask & WL_EVENT_READABLE)
+		events |= EPOLLIN;
+	if (mask & WL_EVENT_WRITEABLE)
+		events |= EPOLLOUT;
+
+	source = (struct wl_event_source_fd *)
+		add_source(loop, sizeof *source, &fd_source_interface,
+			   fd, events, data);
+	if (source == NULL)
+		return NULL;
+
+	source->func = func;
+
+	return &source->base;
 }
 
 WL_EXPORT int
@@ -86,80 +206,1437 @@ wl_event_loop_update_source(struct wl_event_loop *loop,
 		ep.events |= EPOLLOUT;
 	ep.data.ptr = source;
 
+	if (loop->uring) {
+		wl_event_loop_uring_update(loop, source, ep.events);
+		return 0;
+	}
+
+	loop->stats.updates++;
 	return epoll_ctl(loop->epoll_fd,
 			 EPOLL_CTL_MOD, source->fd, &ep);
 }
 
-WL_EXPORT struct wl_event_loop *
-wl_event_loop_create(void)
+/* Timers fire once, delay milliseconds after the last call to
+ * wl_event_source_timer_update().  If the loop falls behind, several
+ * expiries are delivered as a single call. */
+
+struct wl_event_source_timer {
+	struct wl_event_source base;
+	wl_event_loop_timer_func_t func;
+};
+
+static void
+wl_event_source_timer_dispatch(struct wl_event_source *source,
+			       struct epoll_event *ep)
 {
-	struct wl_event_loop *loop;
+	struct wl_event_source_timer *timer_source =
+		(struct wl_event_source_timer *) source;
+	uint64_t expires;
 
-	loop = malloc(sizeof *loop);
-	if (loop == NULL)
+	if (read(source->fd, &expires, sizeof expires) != sizeof expires)
+		return;
+
+	timer_source->func(source->data);
+}
+
+static void
+wl_event_source_close_fd(struct wl_event_source *source)
+{
+	close(source->fd);
+}
+
+static const struct wl_event_source_interface timer_source_interface = {
+	wl_event_source_timer_dispatch,
+	wl_event_source_close_fd,
+	"timer"
+};
+
+WL_EXPORT struct wl_event_source *
+wl_event_loop_add_timer(struct wl_event_loop *loop,
+			wl_event_loop_timer_func_t func,
+			void *data)
+{
+	struct wl_event_source_timer *source;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
 		return NULL;
 
-	loop->epoll_fd = epoll_create(16);
-	if (loop->epoll_fd < 0) {
-		free(loop);
+	source = (struct wl_event_source_timer *)
+		add_source(loop, sizeof *source, &timer_source_interface,
+			   fd, EPOLLIN, data);
+	if (source == NULL) {
+		close(fd);
 		return NULL;
 	}
 
-	return loop;
+	source->func = func;
+
+	return &source->base;
 }
 
-WL_EXPORT void
-wl_event_loop_destroy(struct wl_event_loop *loop)
+/* Arm the timer to fire in delay milliseconds, or disarm it if delay
+ * is 0. */
+
+WL_EXPORT int
+wl_event_source_timer_update(struct wl_event_source *source, int delay)
 {
-	close(loop->epoll_fd);
-	free(loop);
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = delay / 1000;
+	its.it_value.tv_nsec = (delay % 1000) * 1000000;
+
+	return timerfd_settime(source->fd, 0, &its, NULL);
+}
+
+/* Signal sources block the signal and read it from a signalfd, so
+ * the handler runs from the loop like any other callback. */
+
+struct wl_event_source_signal {
+	struct wl_event_source base;
+	int signal_number;
+	wl_event_loop_signal_func_t func;
+};
+
+static void
+wl_event_source_signal_dispatch(struct wl_event_source *source,
+				struct epoll_event *ep)
+{
+	struct wl_event_source_signal *signal_source =
+		(struct wl_event_source_signal *) source;
+	struct signalfd_siginfo info;
+
+	if (read(source->fd, &info, sizeof info) != sizeof info)
+		return;
+
+	signal_source->func(signal_source->signal_number, source->data);
+}
+
+static const struct wl_event_source_interface signal_source_interface = {
+	wl_event_source_signal_dispatch,
+	wl_event_source_close_fd,
+	"signal"
+};
+
+WL_EXPORT struct wl_event_source *
+wl_event_loop_add_signal(struct wl_event_loop *loop,
+			 int signal_number,
+			 wl_event_loop_signal_func_t func,
+			 void *data)
+{
+	struct wl_event_source_signal *source;
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, signal_number);
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	source = (struct wl_event_source_signal *)
+		add_source(loop, sizeof *source, &signal_source_interface,
+			   fd, EPOLLIN, data);
+	if (source == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	source->signal_number = signal_number;
+	source->func = func;
+
+	return &source->base;
+}
+
+/* Idle sources run once, in the order they were added, after the
+ * events of the current iteration have been dispatched. */
+
+struct wl_event_source_idle {
+	struct wl_event_source base;
+	wl_event_loop_idle_func_t func;
+	uint64_t scheduled;
+};
+
+static void
+wl_event_source_idle_remove(struct wl_event_source *source)
+{
+	wl_list_remove(&source->link);
 }
 
+static const struct wl_event_source_interface idle_source_interface = {
+	NULL,
+	wl_event_source_idle_remove,
+	"idle"
+};
+
 WL_EXPORT struct wl_event_source *
 wl_event_loop_add_idle(struct wl_event_loop *loop,
 		       wl_event_loop_idle_func_t func,
 		       void *data)
 {
-	loop->idle_func = func;
-	loop->idle_data = data;
+	struct wl_event_source_idle *source;
 
-	return &idle_source;
-}
+	source = malloc(sizeof *source);
+	if (source == NULL)
+		return NULL;
 
-#define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
+	source->base.interface = &idle_source_interface;
+	source->base.loop = loop;
+	source->base.fd = -1;
+	source->base.priority = 0;
+	source->base.data = data;
+	source->base.events = 0;
+	source->base.armed = 0;
+	source->base.inflight = 0;
+	source->base.profile = NULL;
+	wl_list_init(&source->base.check_link);
+	source->func = func;
+	source->scheduled = loop->profiling ? wl_time_now() : 0;
+	wl_list_insert(loop->idle_list.prev, &source->base.link);
+
+	return &source->base;
+}
 
 WL_EXPORT int
-wl_event_loop_wait(struct wl_event_loop *loop)
+wl_event_loop_remove_source(struct wl_event_loop *loop,
+			    struct wl_event_source *source)
+{
+	int ret = 0;
+
+	if (loop->uring) {
+		wl_event_loop_uring_cancel(loop, source);
+	} else if (source->fd >= 0) {
+		loop->stats.updates++;
+		ret = epoll_ctl(loop->epoll_fd,
+				EPOLL_CTL_DEL, source->fd, NULL);
+	}
+
+	if (source->profile) {
+		wl_list_remove(&source->profile->link);
+		free(source->profile);
+		source->profile = NULL;
+	}
+
+	source->interface->remove(source);
+	source->interface = NULL;
+	wl_list_remove(&source->check_link);
+	wl_list_init(&source->check_link);
+	wl_list_insert(&loop->destroy_list, &source->link);
+
+	return ret;
+}
+
+WL_EXPORT void
+wl_event_source_check(struct wl_event_source *source)
+{
+	struct wl_event_loop *loop = source->loop;
+
+	if (source->check_link.next == &source->check_link)
+		wl_list_insert(loop->check_list.prev, &source->check_link);
+}
+
+/* Ready sources with a higher priority are dispatched first.  Input
+ * devices use this to stay responsive while clients are busy. */
+
+WL_EXPORT void
+wl_event_source_set_priority(struct wl_event_source *source, int priority)
+{
+	source->priority = priority;
+}
+
+/* Charge a dispatch that began at start to the source, unless
+ * profiling is off or the source removed itself. */
+
+static void
+wl_event_loop_profile_source(struct wl_event_source *source, uint64_t start)
+{
+	struct wl_event_source_profile *profile;
+
+	if (start == 0 || source->interface == NULL)
+		return;
+
+	profile = source->profile;
+	if (profile == NULL) {
+		profile = malloc(sizeof *profile);
+		if (profile == NULL)
+			return;
+		memset(profile, 0, sizeof *profile);
+		profile->source = source;
+		wl_list_insert(source->loop->profile_list.prev,
+			       &profile->link);
+		source->profile = profile;
+	}
+
+	wl_histogram_add(&profile->dispatch, wl_time_now() - start);
+}
+
+static void
+wl_event_loop_dispatch_source(struct wl_event_source *source,
+			      struct epoll_event *ep)
+{
+	uint64_t start;
+
+	wl_list_remove(&source->check_link);
+	wl_list_init(&source->check_link);
+	start = source->loop->profiling ? wl_time_now() : 0;
+	source->interface->dispatch(source, ep);
+	wl_event_loop_profile_source(source, start);
+}
+
+/* Move the sources on the from list to the back of the to list. */
+
+static void
+wl_event_loop_splice_check(struct wl_list *to, struct wl_list *from)
+{
+	if (from->next == from)
+		return;
+
+	from->next->prev = to->prev;
+	to->prev->next = from->next;
+	from->prev->next = to;
+	to->prev = from->prev;
+	wl_list_init(from);
+}
+
+/* Give every source on list one more turn.  Sources that check
+ * themselves again land on the loop's check list, which is left for
+ * the next iteration, so busy sources take turns. */
+
+static void
+wl_event_loop_dispatch_check(struct wl_list *list)
 {
-	struct epoll_event ep[32];
 	struct wl_event_source *source;
-	int i, count, timeout;
-	uint32_t mask;
+	struct epoll_event ep;
 
-	if (loop->idle_func)
-		timeout = 0;
-	else
-		timeout = -1;
+	memset(&ep, 0, sizeof ep);
+	while (list->next != list) {
+		source = container_of(list->next,
+				      struct wl_event_source, check_link);
+		ep.data.ptr = source;
+		wl_event_loop_dispatch_source(source, &ep);
+	}
+}
 
-	count = epoll_wait(loop->epoll_fd, ep, ARRAY_LENGTH(ep), timeout);
-	if (count < 0)
+static void
+wl_event_loop_dispatch_idle(struct wl_event_loop *loop)
+{
+	struct wl_event_source_idle *source;
+
+	while (loop->idle_list.next != &loop->idle_list) {
+		source = container_of(loop->idle_list.next,
+				      struct wl_event_source_idle, base.link);
+		wl_list_remove(&source->base.link);
+		wl_list_init(&source->base.link);
+		if (loop->profiling && source->scheduled)
+			wl_histogram_add(&loop->idle_latency,
+					 wl_time_now() - source->scheduled);
+		source->func(source->base.data);
+		/* Unless the callback removed it already. */
+		if (source->base.interface != NULL)
+			wl_event_loop_remove_source(loop, &source->base);
+	}
+}
+
+/* Sources that io_uring requests still refer to stay on the list
+ * until the last of those has completed. */
+
+static void
+wl_event_loop_process_destroy_list(struct wl_event_loop *loop)
+{
+	struct wl_event_source *source;
+	struct wl_list *node, *next;
+
+	for (node = loop->destroy_list.next;
+	     node != &loop->destroy_list; node = next) {
+		next = node->next;
+		source = container_of(node, struct wl_event_source, link);
+		if (source->inflight > 0)
+			continue;
+		wl_list_remove(&source->link);
+		free(source);
+	}
+}
+
+#define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
+
+/* The io_uring backend.  Without liburing this talks to the kernel
+ * directly: one ring for the loop's own requests and a small second
+ * one that wl_event_loop_writev() uses to push out a batch of writes
+ * with a single system call.
+ *
+ * Sources wait with one-shot polls that are armed again after every
+ * dispatch, which gives the same level-triggered behaviour as the
+ * epoll loop.  Receive sources instead keep a multishot receive in
+ * flight that fills buffers from a ring registered with the kernel,
+ * so data arrives with the completion and needs no read() of its
+ * own.  The low bits of a request's user data tell what it was for. */
+
+enum {
+	WL_URING_SOURCE = 0,	/* poll or receive of a source */
+	WL_URING_POLLOUT = 1,	/* writability poll of a receive source */
+	WL_URING_IGNORE = 2,	/* cancels and updates */
+	WL_URING_TAG_MASK = 3
+};
+
+#define WL_URING_ENTRIES	256
+#define WL_URING_CQ_ENTRIES	4096
+#define WL_URING_WRITE_ENTRIES	64
+#define WL_URING_BUFFERS	256
+#define WL_URING_BUFFER_SIZE	4096
+#define WL_URING_BUFFER_GROUP	0
+
+struct wl_uring {
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct wl_event_loop_uring {
+	struct wl_uring ring, write_ring;
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	char *buffers;
+	uint16_t buf_tail;
+};
+
+static int
+wl_uring_init(struct wl_uring *ring, unsigned int entries,
+	      unsigned int cq_entries)
+{
+	struct io_uring_params params;
+	unsigned int i;
+
+	memset(&params, 0, sizeof params);
+	if (cq_entries) {
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = cq_entries;
+	}
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(ring->fd);
+		errno = ENOSYS;
 		return -1;
+	}
 
-	for (i = 0; i < count; i++) {
-		source = ep[i].data.ptr;
-		mask = 0;
-		if (ep[i].events & EPOLLIN)
-			mask |= WL_EVENT_READABLE;
-		if (ep[i].events & EPOLLOUT)
-			mask |= WL_EVENT_WRITEABLE;
+	ring->sq_ring_size =
+		params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+	ring->cq_ring_size =
+		params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+	if (ring->cq_ring_size > ring->sq_ring_size)
+		ring->sq_ring_size = ring->cq_ring_size;
+	ring->cq_ring_size = ring->sq_ring_size;
 
-		source->func(source->fd, mask, source->data);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size,
+			     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
 	}
+	ring->cq_ring = ring->sq_ring;
 
-	if (count == 0 && loop->idle_func != NULL) {
-		loop->idle_func(loop->idle_data);
-		loop->idle_func = NULL;
+	ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size,
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		return -1;
 	}
-	
+
+	ring->entries = params.sq_entries;
+	ring->sq_head = ring->sq_ring + params.sq_off.head;
+	ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + params.sq_off.array;
+	ring->cq_head = ring->cq_ring + params.cq_off.head;
+	ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + params.cq_off.cqes;
+
+	/* Slot i of the submission queue always holds entry i. */
+	for (i = 0; i < ring->entries; i++)
+		ring->sq_array[i] = i;
+
 	return 0;
 }
+
+static void
+wl_uring_fini(struct wl_uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+static int
+wl_uring_enter(struct wl_uring *ring, unsigned int wait, unsigned int flags)
+{
+	unsigned int submit;
+	int ret;
+
+	submit = *ring->sq_tail -
+		__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+		      flags, NULL, 0);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/* Returns a cleared submission entry, submitting what is queued
+ * first if the queue is full. */
+
+static struct io_uring_sqe *
+wl_uring_get_sqe(struct wl_uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *ring->sq_tail;
+
+	while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+	       ring->entries) {
+		if (wl_uring_enter(ring, 0, 0) < 0 && errno != EINTR &&
+		    errno != EAGAIN && errno != EBUSY)
+			return NULL;
+	}
+
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+/* Copies out up to count completions and hands their slots back to
+ * the kernel, so callbacks are free to queue new requests. */
+
+static int
+wl_uring_reap(struct wl_uring *ring, struct io_uring_cqe *cqes, int count)
+{
+	unsigned int head, tail;
+	int i;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count && head != tail; i++, head++)
+		cqes[i] = ring->cqes[head & *ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return i;
+}
+
+/* Settles pending requests whose completions nobody will look at:
+ * entries the kernel hasn't taken yet are pulled back off the
+ * submission queue, and the rest are waited for and their
+ * completions dropped.  The ring already accepted those, so errors
+ * from waiting on it can only be transient. */
+
+static void
+wl_uring_drain(struct wl_uring *ring, int pending)
+{
+	struct io_uring_cqe cqes[16];
+	unsigned int head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	pending -= *ring->sq_tail - head;
+	__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+
+	while (pending > 0) {
+		wl_uring_enter(ring, pending, IORING_ENTER_GETEVENTS);
+		pending -= wl_uring_reap(ring, cqes, ARRAY_LENGTH(cqes));
+	}
+}
+
+static struct wl_event_loop_uring *
+wl_event_loop_uring_create(void)
+{
+	struct wl_event_loop_uring *uring;
+
+	uring = malloc(sizeof *uring);
+	if (uring == NULL)
+		return NULL;
+
+	memset(uring, 0, sizeof *uring);
+	if (wl_uring_init(&uring->ring,
+			  WL_URING_ENTRIES, WL_URING_CQ_ENTRIES) < 0) {
+		free(uring);
+		return NULL;
+	}
+	if (wl_uring_init(&uring->write_ring,
+			  WL_URING_WRITE_ENTRIES, 0) < 0) {
+		wl_uring_fini(&uring->ring);
+		free(uring);
+		return NULL;
+	}
+
+	return uring;
+}
+
+static void
+wl_event_loop_uring_destroy(struct wl_event_loop_uring *uring)
+{
+	struct io_uring_buf_reg reg;
+
+	if (uring->buf_ring) {
+		memset(&reg, 0, sizeof reg);
+		reg.bgid = WL_URING_BUFFER_GROUP;
+		syscall(__NR_io_uring_register, uring->ring.fd,
+			IORING_UNREGISTER_PBUF_RING, &reg, 1);
+		munmap(uring->buf_ring, uring->buf_ring_size);
+		free(uring->buffers);
+	}
+	wl_uring_fini(&uring->write_ring);
+	wl_uring_fini(&uring->ring);
+	free(uring);
+}
+
+static void
+wl_event_loop_uring_put_buffer(struct wl_event_loop_uring *uring, int bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &uring->buf_ring->bufs[uring->buf_tail & (WL_URING_BUFFERS - 1)];
+	buf->addr = (uintptr_t) (uring->buffers + bid * WL_URING_BUFFER_SIZE);
+	buf->len = WL_URING_BUFFER_SIZE;
+	buf->bid = bid;
+	uring->buf_tail++;
+	__atomic_store_n(&uring->buf_ring->tail,
+			 uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* The receive buffers are only set up once the first receive
+ * source is added. */
+
+static int
+wl_event_loop_uring_init_buffers(struct wl_event_loop_uring *uring)
+{
+	struct io_uring_buf_reg reg;
+	int i;
+
+	if (uring->buf_ring)
+		return 0;
+
+	uring->buf_ring_size = WL_URING_BUFFERS * sizeof (struct io_uring_buf);
+	uring->buf_ring = mmap(NULL, uring->buf_ring_size,
+			       PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uring->buf_ring == MAP_FAILED) {
+		uring->buf_ring = NULL;
+		return -1;
+	}
+
+	uring->buffers = malloc(WL_URING_BUFFERS * WL_URING_BUFFER_SIZE);
+	if (uring->buffers == NULL)
+		goto err_ring;
+
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uintptr_t) uring->buf_ring;
+	reg.ring_entries = WL_URING_BUFFERS;
+	reg.bgid = WL_URING_BUFFER_GROUP;
+	if (syscall(__NR_io_uring_register, uring->ring.fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto err_buffers;
+
+	uring->buf_tail = 0;
+	for (i = 0; i < WL_URING_BUFFERS; i++)
+		wl_event_loop_uring_put_buffer(uring, i);
+
+	return 0;
+
+err_buffers:
+	free(uring->buffers);
+err_ring:
+	munmap(uring->buf_ring, uring->buf_ring_size);
+	uring->buf_ring = NULL;
+	return -1;
+}
+
+static struct io_uring_sqe *
+wl_event_loop_uring_sqe(struct wl_event_loop *loop,
+			struct wl_event_source *source, int tag)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = wl_uring_get_sqe(&loop->uring->ring);
+	if (sqe == NULL) {
+		fprintf(stderr, "io_uring submission failed: %m\n");
+		return NULL;
+	}
+
+	sqe->user_data = (uintptr_t) source | tag;
+	if (tag != WL_URING_IGNORE)
+		source->inflight++;
+
+	return sqe;
+}
+
+/* Receive sources: a multishot receive while the owner wants input,
+ * and a one-shot poll while it waits for the socket to drain. */
+
+struct wl_event_source_recv {
+	struct wl_event_source base;
+	wl_event_loop_recv_func_t func;
+};
+
+static void
+wl_event_source_recv_dispatch(struct wl_event_source *source,
+			      struct epoll_event *ep)
+{
+	struct wl_event_source_recv *recv_source =
+		(struct wl_event_source_recv *) source;
+
+	recv_source->func(source->fd, 0, NULL, 0, source->data);
+}
+
+static void
+wl_event_source_recv_remove(struct wl_event_source *source)
+{
+}
+
+static const struct wl_event_source_interface recv_source_interface = {
+	wl_event_source_recv_dispatch,
+	wl_event_source_recv_remove,
+	"recv"
+};
+
+static int
+wl_event_loop_uring_arm(struct wl_event_loop *loop,
+			struct wl_event_source *source)
+{
+	struct io_uring_sqe *sqe;
+
+	if (source->interface != &recv_source_interface) {
+		if (source->armed || source->events == 0)
+			return 0;
+		sqe = wl_event_loop_uring_sqe(loop, source, WL_URING_SOURCE);
+		if (sqe == NULL)
+			return -1;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = source->fd;
+		sqe->poll32_events = source->events;
+		source->armed = source->events;
+		return 0;
+	}
+
+	if ((source->events & EPOLLIN) && !(source->armed & EPOLLIN)) {
+		sqe = wl_event_loop_uring_sqe(loop, source, WL_URING_SOURCE);
+		if (sqe == NULL)
+			return -1;
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = source->fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = WL_URING_BUFFER_GROUP;
+		source->armed |= EPOLLIN;
+	}
+
+	if ((source->events & EPOLLOUT) && !(source->armed & EPOLLOUT)) {
+		sqe = wl_event_loop_uring_sqe(loop, source, WL_URING_POLLOUT);
+		if (sqe == NULL)
+			return -1;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = source->fd;
+		sqe->poll32_events = EPOLLOUT;
+		source->armed |= EPOLLOUT;
+	}
+
+	return 0;
+}
+
+/* A poll in flight is only widened when events are added to it;
+ * events dropped from it are filtered out when it completes. */
+
+static void
+wl_event_loop_uring_update(struct wl_event_loop *loop,
+			   struct wl_event_source *source, uint32_t events)
+{
+	struct io_uring_sqe *sqe;
+
+	source->events = events;
+
+	if (source->interface == &recv_source_interface) {
+		if (!(events & EPOLLIN) && (source->armed & EPOLLIN)) {
+			sqe = wl_event_loop_uring_sqe(loop, NULL,
+						      WL_URING_IGNORE);
+			if (sqe == NULL)
+				return;
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uintptr_t) source | WL_URING_SOURCE;
+		}
+		wl_event_loop_uring_arm(loop, source);
+		return;
+	}
+
+	if (source->armed == 0) {
+		wl_event_loop_uring_arm(loop, source);
+	} else if (events & ~source->armed) {
+		sqe = wl_event_loop_uring_sqe(loop, NULL, WL_URING_IGNORE);
+		if (sqe == NULL)
+			return;
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = (uintptr_t) source | WL_URING_SOURCE;
+		sqe->len = IORING_POLL_UPDATE_EVENTS;
+		sqe->poll32_events = events;
+		source->armed = events;
+	}
+}
+
+static void
+wl_event_loop_uring_cancel(struct wl_event_loop *loop,
+			   struct wl_event_source *source)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t pollout;
+
+	source->events = 0;
+	if (source->armed == 0)
+		return;
+
+	if (source->interface == &recv_source_interface) {
+		pollout = source->armed & EPOLLOUT;
+		if (source->armed & EPOLLIN) {
+			sqe = wl_event_loop_uring_sqe(loop, NULL,
+						      WL_URING_IGNORE);
+			if (sqe == NULL)
+				return;
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uintptr_t) source | WL_URING_SOURCE;
+		}
+	} else {
+		pollout = 0;
+		sqe = wl_event_loop_uring_sqe(loop, NULL, WL_URING_IGNORE);
+		if (sqe == NULL)
+			return;
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = (uintptr_t) source | WL_URING_SOURCE;
+	}
+
+	if (pollout) {
+		sqe = wl_event_loop_uring_sqe(loop, NULL, WL_URING_IGNORE);
+		if (sqe == NULL)
+			return;
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = (uintptr_t) source | WL_URING_POLLOUT;
+	}
+}
+
+static void
+wl_event_loop_uring_complete(struct wl_event_loop *loop,
+			     struct io_uring_cqe *cqe)
+{
+	struct wl_event_loop_uring *uring = loop->uring;
+	struct wl_event_source *source;
+	struct wl_event_source_recv *recv_source;
+	struct epoll_event ep;
+	uint64_t start;
+	int tag, bid = -1;
+
+	tag = cqe->user_data & WL_URING_TAG_MASK;
+	if (tag == WL_URING_IGNORE)
+		return;
+
+	source = (struct wl_event_source *)
+		(uintptr_t) (cqe->user_data & ~(uint64_t) WL_URING_TAG_MASK);
+	if (cqe->flags & IORING_CQE_F_BUFFER)
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		source->inflight--;
+		if (tag == WL_URING_POLLOUT)
+			source->armed &= ~EPOLLOUT;
+		else if (source->interface == &recv_source_interface)
+			source->armed &= ~EPOLLIN;
+		else
+			source->armed = 0;
+	}
+
+	if (source->interface == NULL) {
+		if (bid >= 0)
+			wl_event_loop_uring_put_buffer(uring, bid);
+		return;
+	}
+
+	if (source->interface != &recv_source_interface) {
+		if (cqe->res < 0)
+			ep.events = EPOLLERR;
+		else
+			ep.events = cqe->res &
+				(source->events | EPOLLERR | EPOLLHUP);
+		ep.data.ptr = source;
+		if (ep.events)
+			wl_event_loop_dispatch_source(source, &ep);
+	} else {
+		recv_source = (struct wl_event_source_recv *) source;
+		wl_list_remove(&source->check_link);
+		wl_list_init(&source->check_link);
+		start = loop->profiling ? wl_time_now() : 0;
+		if (tag == WL_URING_POLLOUT) {
+			if (cqe->res >= 0 && (source->events & EPOLLOUT))
+				recv_source->func(source->fd,
+						  WL_EVENT_WRITEABLE,
+						  NULL, 0, source->data);
+		} else if (bid >= 0) {
+			recv_source->func(source->fd, WL_EVENT_READABLE,
+					  uring->buffers +
+					  bid * WL_URING_BUFFER_SIZE,
+					  cqe->res, source->data);
+		} else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+			recv_source->func(source->fd, WL_EVENT_READABLE,
+					  NULL, cqe->res, source->data);
+		}
+		wl_event_loop_profile_source(source, start);
+	}
+
+	if (bid >= 0)
+		wl_event_loop_uring_put_buffer(uring, bid);
+
+	if (source->interface != NULL)
+		wl_event_loop_uring_arm(loop, source);
+}
+
+static int
+wl_event_loop_uring_wait(struct wl_event_loop *loop, int timeout)
+{
+	struct io_uring_cqe cqes[256];
+	struct wl_uring *ring = &loop->uring->ring;
+	struct wl_event_source *source;
+	int i, count, pass, priority;
+
+	loop->stats.waits++;
+	if (wl_uring_enter(ring, timeout < 0 ? 1 : 0,
+			   IORING_ENTER_GETEVENTS) < 0 &&
+	    errno != EINTR && errno != EBUSY)
+		return -1;
+
+	count = wl_uring_reap(ring, cqes, ARRAY_LENGTH(cqes));
+
+	/* As with epoll, high priority sources go first.  Every
+	 * completion is accounted for, even those of removed
+	 * sources. */
+	for (pass = 1; pass >= 0; pass--) {
+		for (i = 0; i < count; i++) {
+			if ((cqes[i].user_data & WL_URING_TAG_MASK) ==
+			    WL_URING_IGNORE) {
+				priority = 0;
+			} else {
+				source = (struct wl_event_source *)
+					(uintptr_t) (cqes[i].user_data &
+						     ~(uint64_t) WL_URING_TAG_MASK);
+				priority = source->priority > 0;
+			}
+			if (priority == pass)
+				wl_event_loop_uring_complete(loop, &cqes[i]);
+		}
+	}
+
+	return 0;
+}
+
+/* Like wl_event_loop_add_fd(), but for a stream socket whose input
+ * the loop reads itself.  The callback gets READABLE with the data
+ * received, which is only valid during the call, and a size of 0 at
+ * end of file or a negative errno on error; WRITEABLE without data;
+ * and an empty mask when the source is checked.  Only io_uring loops
+ * support this; on others it returns NULL and the caller falls back
+ * to wl_event_loop_add_fd(). */
+
+WL_EXPORT struct wl_event_source *
+wl_event_loop_add_recv(struct wl_event_loop *loop,
+		       int fd, uint32_t mask,
+		       wl_event_loop_recv_func_t func,
+		       void *data)
+{
+	struct wl_event_source_recv *source;
+	uint32_t events;
+
+	if (loop->uring == NULL ||
+	    wl_event_loop_uring_init_buffers(loop->uring) < 0)
+		return NULL;
+
+	events = 0;
+	if (mask & WL_EVENT_READABLE)
+		events |= EPOLLIN;
+	if (mask & WL_EVENT_WRITEABLE)
+		events |= EPOLLOUT;
+
+	source = (struct wl_event_source_recv *)
+		add_source(loop, sizeof *source, &recv_source_interface,
+			   fd, events, data);
+	if (source == NULL)
+		return NULL;
+
+	source->func = func;
+
+	return &source->base;
+}
+
+/* Sends a batch of iovecs on stream sockets, leaving each send's
+ * byte count or negative errno in its result.  With io_uring the
+ * whole batch costs one system call; sends to the same socket
+ * shouldn't share a batch since they may complete in any order.
+ * io_uring would wait for a full socket to drain even if it is
+ * nonblocking, so the sends ask not to wait with MSG_DONTWAIT.  A
+ * send that can't get a submission entry goes out with sendmsg()
+ * instead.  Returns -1 if the ring fails, once none of the batch is
+ * left with the kernel. */
+
+WL_EXPORT int
+wl_event_loop_writev(struct wl_event_loop *loop,
+		     struct wl_event_loop_write *writes, int count)
+{
+	struct io_uring_cqe cqes[WL_URING_WRITE_ENTRIES];
+	struct msghdr msgs[WL_URING_WRITE_ENTRIES];
+	struct io_uring_sqe *sqe;
+	struct wl_uring *ring;
+	int i, j, n, queued, done;
+
+	if (loop->uring == NULL) {
+		for (i = 0; i < count; i++) {
+			writes[i].result = writev(writes[i].fd, writes[i].iov,
+						  writes[i].count);
+			if (writes[i].result < 0)
+				writes[i].result = -errno;
+		}
+		return 0;
+	}
+
+	ring = &loop->uring->write_ring;
+	for (i = 0; i < count; i += n) {
+		n = count - i;
+		if (n > WL_URING_WRITE_ENTRIES)
+			n = WL_URING_WRITE_ENTRIES;
+		queued = 0;
+		for (j = 0; j < n; j++) {
+			memset(&msgs[j], 0, sizeof msgs[j]);
+			msgs[j].msg_iov = (struct iovec *) writes[i + j].iov;
+			msgs[j].msg_iovlen = writes[i + j].count;
+			sqe = wl_uring_get_sqe(ring);
+			if (sqe == NULL) {
+				fprintf(stderr,
+					"io_uring submission failed: %m\n");
+				writes[i + j].result =
+					sendmsg(writes[i + j].fd, &msgs[j],
+						MSG_DONTWAIT);
+				if (writes[i + j].result < 0)
+					writes[i + j].result = -errno;
+				continue;
+			}
+			queued++;
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = writes[i + j].fd;
+			sqe->addr = (uintptr_t) &msgs[j];
+			sqe->len = 1;
+			sqe->msg_flags = MSG_DONTWAIT;
+			sqe->user_data = i + j;
+		}
+
+		for (done = 0; done < queued; ) {
+			loop->stats.submits++;
+			if (wl_uring_enter(ring, queued - done,
+					   IORING_ENTER_GETEVENTS) < 0 &&
+			    errno != EINTR) {
+				/* The sends point at msgs and the
+				 * caller's iovecs, so none may be left
+				 * with the kernel. */
+				wl_uring_drain(ring, queued - done);
+				return -1;
+			}
+			j = wl_uring_reap(ring, cqes, queued - done);
+			done += j;
+			while (j-- > 0)
+				writes[cqes[j].user_data].result = cqes[j].res;
+		}
+	}
+
+	return 0;
+}
+
+WL_EXPORT struct wl_event_loop *
+wl_event_loop_create_backend(uint32_t backend)
+{
+	struct wl_event_loop *loop;
+
+	loop = malloc(sizeof *loop);
+	if (loop == NULL)
+		return NULL;
+
+	memset(loop, 0, sizeof *loop);
+	if (backend == WL_EVENT_LOOP_IO_URING) {
+		loop->epoll_fd = -1;
+		loop->uring = wl_event_loop_uring_create();
+		if (loop->uring == NULL) {
+			free(loop);
+			return NULL;
+		}
+	} else {
+		loop->epoll_fd = epoll_create(16);
+		if (loop->epoll_fd < 0) {
+			free(loop);
+			return NULL;
+		}
+	}
+	wl_list_init(&loop->idle_list);
+	wl_list_init(&loop->check_list);
+	wl_list_init(&loop->destroy_list);
+	wl_list_init(&loop->profile_list);
+
+	return loop;
+}
+
+/* WAYLAND_EVENT_LOOP=io_uring selects the io_uring backend where
+ * the kernel allows it. */
+
+WL_EXPORT struct wl_event_loop *
+wl_event_loop_create(void)
+{
+	struct wl_event_loop *loop;
+	const char *backend;
+
+	backend = getenv("WAYLAND_EVENT_LOOP");
+	if (backend != NULL && strcmp(backend, "io_uring") == 0) {
+		loop = wl_event_loop_create_backend(WL_EVENT_LOOP_IO_URING);
+		if (loop != NULL)
+			return loop;
+		fprintf(stderr, "io_uring unavailable (%m), using epoll\n");
+	}
+
+	return wl_event_loop_create_backend(WL_EVENT_LOOP_EPOLL);
+}
+
+WL_EXPORT uint32_t
+wl_event_loop_get_backend(struct wl_event_loop *loop)
+{
+	return loop->uring ? WL_EVENT_LOOP_IO_URING : WL_EVENT_LOOP_EPOLL;
+}
+
+WL_EXPORT void
+wl_event_loop_destroy(struct wl_event_loop *loop)
+{
+	struct wl_event_source *source;
+	struct wl_list *node;
+
+	while (loop->idle_list.next != &loop->idle_list) {
+		source = container_of(loop->idle_list.next,
+				      struct wl_event_source, link);
+		wl_event_loop_remove_source(loop, source);
+	}
+
+	if (loop->uring) {
+		/* Closing the ring cancels whatever is in flight. */
+		wl_event_loop_uring_destroy(loop->uring);
+		for (node = loop->destroy_list.next;
+		     node != &loop->destroy_list; node = node->next) {
+			source = container_of(node,
+					      struct wl_event_source, link);
+			source->inflight = 0;
+		}
+	} else {
+		close(loop->epoll_fd);
+	}
+	wl_event_loop_process_destroy_list(loop);
+
+	free(loop);
+}
+
+/* The flush function runs once at the end of every
+ * wl_event_loop_wait(), after all sources have been dispatched, so
+ * output produced during the iteration goes out in one batch. */
+
+WL_EXPORT void
+wl_event_loop_set_flush_func(struct wl_event_loop *loop,
+			     wl_event_loop_flush_func_t func,
+			     void *data)
+{
+	loop->flush_func = func;
+	loop->flush_data = data;
+}
+
+WL_EXPORT void
+wl_event_loop_get_stats(struct wl_event_loop *loop,
+			struct wl_event_loop_stats *stats)
+{
+	*stats = loop->stats;
+}
+
+static int
+wl_event_loop_epoll_wait(struct wl_event_loop *loop, int timeout)
+{
+	struct epoll_event ep[32];
+	struct wl_event_source *source;
+	int i, count, pass;
+
+	loop->stats.waits++;
+	count = epoll_wait(loop->epoll_fd, ep, ARRAY_LENGTH(ep), timeout);
+	if (count < 0 && errno != EINTR)
+		return -1;
+
+	/* High priority sources first, then the rest.  Sources removed
+	 * by an earlier callback in this batch are skipped. */
+	for (pass = 1; pass >= 0; pass--) {
+		for (i = 0; i < count; i++) {
+			source = ep[i].data.ptr;
+			if (source->interface == NULL ||
+			    (source->priority > 0) != pass)
+				continue;
+			wl_event_loop_dispatch_source(source, &ep[i]);
+		}
+	}
+
+	return 0;
+}
+
+/* Profiling costs a clock read before and after every dispatch while
+ * it is on, and a branch when it is off.  Turning it off keeps what
+ * was collected; turning it on again starts over. */
+
+WL_EXPORT void
+wl_event_loop_set_profiling(struct wl_event_loop *loop, int enable)
+{
+	struct wl_event_source_profile *profile;
+
+	if (enable && !loop->profiling) {
+		while (loop->profile_list.next != &loop->profile_list) {
+			profile = container_of(loop->profile_list.next,
+					       struct wl_event_source_profile,
+					       link);
+			profile->source->profile = NULL;
+			wl_list_remove(&profile->link);
+			free(profile);
+		}
+		memset(&loop->idle_latency, 0, sizeof loop->idle_latency);
+		memset(&loop->repaint, 0, sizeof loop->repaint);
+	}
+
+	loop->profiling = enable;
+}
+
+/* Pass the collected histograms to func, one line at a time. */
+
+WL_EXPORT void
+wl_event_loop_dump_profile(struct wl_event_loop *loop,
+			   wl_event_loop_profile_func_t func, void *data)
+{
+	struct wl_event_source_profile *profile;
+	struct wl_event_source *source;
+	struct wl_list *node;
+	char line[256], summary[160];
+
+	wl_histogram_format(&loop->repaint, summary, sizeof summary);
+	snprintf(line, sizeof line, "repaint: %s", summary);
+	func(line, data);
+
+	wl_histogram_format(&loop->idle_latency, summary, sizeof summary);
+	snprintf(line, sizeof line, "idle latency: %s", summary);
+	func(line, data);
+
+	for (node = loop->profile_list.next;
+	     node != &loop->profile_list; node = node->next) {
+		profile = container_of(node,
+				       struct wl_event_source_profile, link);
+		source = profile->source;
+		wl_histogram_format(&profile->dispatch,
+				    summary, sizeof summary);
+		snprintf(line, sizeof line, "%s source fd %d data %p: %s",
+			 source->interface->name, source->fd, source->data,
+			 summary);
+		func(line, data);
+	}
+}
+
+/* The check list is set aside before polling.  A source that checks
+ * itself while handling a poll event, including one that was on the
+ * list and got the event first, has had its turn and waits for the
+ * next iteration; the rest run once the poll batch is done. */
+
+WL_EXPORT int
+wl_event_loop_wait(struct wl_event_loop *loop)
+{
+	struct wl_list check;
+	int timeout, ret;
+
+	if (loop->idle_list.next != &loop->idle_list ||
+	    loop->check_list.next != &loop->check_list)
+		timeout = 0;
+	else
+		timeout = -1;
+
+	wl_list_init(&check);
+	wl_event_loop_splice_check(&check, &loop->check_list);
+
+	if (loop->uring)
+		ret = wl_event_loop_uring_wait(loop, timeout);
+	else
+		ret = wl_event_loop_epoll_wait(loop, timeout);
+	if (ret < 0) {
+		wl_event_loop_splice_check(&check, &loop->check_list);
+		wl_event_loop_splice_check(&loop->check_list, &check);
+		return -1;
+	}
+
+	wl_event_loop_dispatch_check(&check);
+	wl_event_loop_dispatch_idle(loop);
+	wl_event_loop_process_destroy_list(loop);
+
+	if (loop->flush_func)
+		loop->flush_func(loop->flush_data);
+
+	return 0;
+}
+
+/* A frame clock paces repaints to a fixed refresh rate.  Frame
+ * deadlines fall on a grid of refresh periods; a repaint requested
+ * with wl_frame_clock_schedule() starts lead milliseconds before the
+ * next deadline it can still make.  Requests made before the repaint
+ * runs, including those made during it, are merged into a single
+ * frame. */
+
+#define WL_FRAME_CLOCK_DEFAULT_REFRESH 60000
+
+struct wl_frame_clock {
+	struct wl_event_loop *loop;
+	struct wl_event_source *source;
+	int fd;
+	uint64_t base, period, lead, deadline;
+	int armed, scheduled;
+	wl_frame_clock_func_t func;
+	void *data;
+	struct wl_frame_clock_stats stats;
+};
+
+static void
+wl_frame_clock_arm(struct wl_frame_clock *clock)
+{
+	struct itimerspec its;
+	uint64_t now, n, start;
+
+	now = wl_time_now();
+	n = (now + clock->lead - clock->base + clock->period - 1) /
+		clock->period;
+	clock->deadline = clock->base + n * clock->period;
+	start = clock->deadline - clock->lead;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = start / 1000000000;
+	its.it_value.tv_nsec = start % 1000000000;
+	if (timerfd_settime(clock->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		fprintf(stderr, "failed to arm frame clock: %m\n");
+		return;
+	}
+
+	clock->armed = 1;
+}
+
+static void
+wl_frame_clock_dispatch(int fd, uint32_t mask, void *data)
+{
+	struct wl_frame_clock *clock = data;
+	uint64_t expirations, start, now;
+
+	if (read(fd, &expirations, sizeof expirations) != sizeof expirations)
+		return;
+
+	/* Leave the clock marked as armed while the repaint runs, so
+	 * that requests made from it wait for the next deadline. */
+	clock->scheduled = 0;
+	start = clock->loop->profiling ? wl_time_now() : 0;
+	clock->func(clock->data);
+	clock->armed = 0;
+
+	now = wl_time_now();
+	if (start)
+		wl_histogram_add(&clock->loop->repaint, now - start);
+
+	clock->stats.frames++;
+	if (now > clock->deadline)
+		clock->stats.missed++;
+
+	if (clock->scheduled)
+		wl_frame_clock_arm(clock);
+}
+
+WL_EXPORT struct wl_frame_clock *
+wl_frame_clock_create(struct wl_event_loop *loop, uint32_t refresh,
+		      uint32_t lead, wl_frame_clock_func_t func, void *data)
+{
+	struct wl_frame_clock *clock;
+
+	clock = malloc(sizeof *clock);
+	if (clock == NULL)
+		return NULL;
+
+	memset(clock, 0, sizeof *clock);
+	clock->loop = loop;
+	clock->func = func;
+	clock->data = data;
+	clock->base = wl_time_now();
+	wl_frame_clock_set_refresh(clock, refresh, lead);
+
+	clock->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (clock->fd < 0) {
+		free(clock);
+		return NULL;
+	}
+
+	clock->source = wl_event_loop_add_fd(loop, clock->fd,
+					     WL_EVENT_READABLE,
+					     wl_frame_clock_dispatch, clock);
+	if (clock->source == NULL) {
+		close(clock->fd);
+		free(clock);
+		return NULL;
+	}
+
+	return clock;
+}
+
+WL_EXPORT void
+wl_frame_clock_destroy(struct wl_frame_clock *clock)
+{
+	wl_event_loop_remove_source(clock->loop, clock->source);
+	close(clock->fd);
+	free(clock);
+}
+
+/* Refresh rate in mHz, lead time in milliseconds.  A rate of 0
+ * means the backend doesn't know it, and paces at 60 Hz instead.
+ * The lead is clamped to one refresh period. */
+
+WL_EXPORT void
+wl_frame_clock_set_refresh(struct wl_frame_clock *clock,
+			   uint32_t refresh, uint32_t lead)
+{
+	if (refresh == 0)
+		refresh = WL_FRAME_CLOCK_DEFAULT_REFRESH;
+	clock->period = 1000000000000ull / refresh;
+	clock->lead = (uint64_t) lead * 1000000;
+	if (clock->lead > clock->period)
+		clock->lead = clock->period;
+}
+
+WL_EXPORT void
+wl_frame_clock_schedule(struct wl_frame_clock *clock)
+{
+	clock->scheduled = 1;
+	if (!clock->armed)
+		wl_frame_clock_arm(clock);
+}
+
+WL_EXPORT void
+wl_frame_clock_get_stats(struct wl_frame_clock *clock,
+			 struct wl_frame_clock_stats *stats)
+{
+	*stats = clock->stats;
+}
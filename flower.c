@@ -78,6 +78,7 @@ draw_stuff(int width, int height)
 }
 
 struct flower {
+	struct wl_display *display;
 	struct wl_surface *surface;
 	struct wl_buffer *buffer;
 	int i;
@@ -93,6 +94,7 @@ move_flower(gpointer data)
 		       flower->x + cos(flower->i / 31.0) * 400 - flower->width / 2,
 		       flower->y + sin(flower->i / 27.0) * 300 - flower->height / 2,
 		       flower->width, flower->height);
+	wl_display_commit(flower->display, 0);
 	flower->i++;
 
 	return TRUE;
@@ -118,6 +120,7 @@ int main(int argc, char *argv[])
 	source = wayland_source_new(display);
 	g_source_attach(source, NULL);
 
+	flower.display = display;
 	flower.x = 512;
 	flower.y = 384;
 	flower.width = 200;
@@ -131,7 +134,8 @@ int main(int argc, char *argv[])
 	s = draw_stuff(flower.width, flower.height);
 	flower.buffer = wl_buffer_create_from_cairo_surface(display, s);
 
-	wl_surface_attach_buffer(flower.surface, flower.buffer);
+	wl_surface_attach_buffer(flower.surface, flower.buffer,
+				 WL_SURFACE_FORMAT_ARGB8888);
 
 	g_timeout_add(20, move_flower, &flower);
 
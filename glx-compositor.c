@@ -18,6 +18,11 @@
 
 #define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
 
+/* Refresh rate in mHz, and how many milliseconds before each frame
+ * deadline the repaint starts. */
+#define REFRESH_RATE 60000
+#define REPAINT_LEAD 4
+
 struct glx_compositor {
 	struct wl_compositor base;
 	Display *display;
@@ -26,81 +31,210 @@ struct glx_compositor {
 	struct wl_display *wl_display;
 	struct wl_backend *backend;
 	struct wl_event_source *x_source;
+	struct wl_frame_clock *frame_clock;
+	int width, height;
+	struct wl_damage damage;
+	struct wl_cull cull;
 };
 
 struct surface_data {
+	struct wl_renderer_surface base;
 	GLuint texture;
-	GLuint width;
-	GLuint height;
-	struct wl_map map;
 };
 
 static void
-repaint(void *data)
+draw_surface(struct surface_data *sd, int blend)
+{
+	GLint vertices[12];
+	GLint tex_coords[8];
+
+	vertices[0] = sd->base.map.x;
+	vertices[1] = sd->base.map.y;
+	vertices[2] = 0;
+	tex_coords[0] = 0;
+	tex_coords[1] = 0;
+
+	vertices[3] = sd->base.map.x;
+	vertices[4] = sd->base.map.y + sd->base.map.height;
+	vertices[5] = 0;
+	tex_coords[2] = 0;
+	tex_coords[3] = sd->base.height;
+
+	vertices[6] = sd->base.map.x + sd->base.map.width;
+	vertices[7] = sd->base.map.y;
+	vertices[8] = 0;
+	tex_coords[4] = sd->base.width;
+	tex_coords[5] = 0;
+
+	vertices[9] = sd->base.map.x + sd->base.map.width;
+	vertices[10] = sd->base.map.y + sd->base.map.height;
+	vertices[11] = 0;
+	tex_coords[6] = sd->base.width;
+	tex_coords[7] = sd->base.height;
+
+	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, sd->texture);
+	glEnable(GL_TEXTURE_RECTANGLE_ARB);
+	if (blend) {
+		glEnable(GL_BLEND);
+		/* Assume pre-multiplied alpha for now, this probably
+		 * needs to be a wayland visual type of thing. */
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	} else {
+		glDisable(GL_BLEND);
+	}
+
+	glBegin (GL_TRIANGLE_STRIP);
+	glTexCoord2iv (&tex_coords[0]); glVertex3iv (&vertices[0]);
+	glTexCoord2iv (&tex_coords[2]); glVertex3iv (&vertices[3]);
+	glTexCoord2iv (&tex_coords[4]); glVertex3iv (&vertices[6]);
+	glTexCoord2iv (&tex_coords[6]); glVertex3iv (&vertices[9]);
+	glEnd ();
+}
+
+/* Draw each damage box with the scissor set to it, clearing it
+ * first and drawing only the surfaces that overlap it.  This is
+ * what we fall back to when culling runs out of memory. */
+
+static void
+draw_damage(struct glx_compositor *gc)
 {
-	struct glx_compositor *gc = data;
 	struct wl_surface_iterator *iterator;
 	struct wl_surface *surface;
 	struct surface_data *sd;
-	GLint vertices[12];
-	GLint tex_coords[8];
+	struct wl_box *box;
+	int i;
+
+	glEnable(GL_SCISSOR_TEST);
+	for (i = 0; i < gc->damage.region.count; i++) {
+		box = &gc->damage.region.boxes[i];
+		glScissor(box->x1, gc->height - box->y2,
+			  box->x2 - box->x1, box->y2 - box->y1);
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		iterator = wl_surface_iterator_create(gc->wl_display, 0);
+		while (wl_surface_iterator_next(iterator, &surface)) {
+			sd = wl_surface_get_data(surface);
+			if (sd == NULL ||
+			    sd->base.map.x >= box->x2 ||
+			    sd->base.map.y >= box->y2 ||
+			    sd->base.map.x + sd->base.map.width <= box->x1 ||
+			    sd->base.map.y + sd->base.map.height <= box->y1)
+				continue;
+			draw_surface(sd, 1);
+		}
+		wl_surface_iterator_destroy(iterator);
+	}
+	glDisable(GL_SCISSOR_TEST);
+}
 
+/* Stack the surfaces bottom to top and work out what of each is
+ * visible within the damage. */
+
+static int
+cull_surfaces(struct glx_compositor *gc)
+{
+	struct wl_surface_iterator *iterator;
+	struct wl_surface *surface;
+	struct surface_data *sd;
+
+	wl_cull_clear(&gc->cull);
 	iterator = wl_surface_iterator_create(gc->wl_display, 0);
 	while (wl_surface_iterator_next(iterator, &surface)) {
 		sd = wl_surface_get_data(surface);
 		if (sd == NULL)
 			continue;
+		if (wl_cull_add(&gc->cull, &sd->base.map,
+				sd->base.map.x, sd->base.map.y,
+				&sd->base.opaque, sd) < 0) {
+			wl_surface_iterator_destroy(iterator);
+			return -1;
+		}
+	}
+	wl_surface_iterator_destroy(iterator);
 
-		vertices[0] = sd->map.x;
-		vertices[1] = sd->map.y;
-		vertices[2] = 0;
- 		tex_coords[0] = 0;
- 		tex_coords[1] = 0;
-
-		vertices[3] = sd->map.x;
-		vertices[4] = sd->map.y + sd->map.height;
-		vertices[5] = 0;
- 		tex_coords[2] = 0;
- 		tex_coords[3] = sd->height;
-
-		vertices[6] = sd->map.x + sd->map.width;
-		vertices[7] = sd->map.y;
-		vertices[8] = 0;
- 		tex_coords[4] = sd->width;
- 		tex_coords[5] = 0;
-
-		vertices[9] = sd->map.x + sd->map.width;
-		vertices[10] = sd->map.y + sd->map.height;
-		vertices[11] = 0;
- 		tex_coords[6] = sd->width;
- 		tex_coords[7] = sd->height;
-
-		glBindTexture(GL_TEXTURE_RECTANGLE_ARB, sd->texture);
-		glEnable(GL_TEXTURE_RECTANGLE_ARB);
-		glEnable(GL_BLEND);
-		/* Assume pre-multiplied alpha for now, this probably
-		 * needs to be a wayland visual type of thing. */
-		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	return wl_cull_run(&gc->cull, &gc->damage.region);
+}
+
+/* Draw a box with the scissor set to it, from the item's surface or
+ * as background if there's no item. */
 
-		glBegin (GL_TRIANGLE_STRIP);
-		glTexCoord2iv (&tex_coords[0]); glVertex3iv (&vertices[0]);
-		glTexCoord2iv (&tex_coords[2]); glVertex3iv (&vertices[3]);
-		glTexCoord2iv (&tex_coords[4]); glVertex3iv (&vertices[6]);
-		glTexCoord2iv (&tex_coords[6]); glVertex3iv (&vertices[9]);
-		glEnd ();
+static void
+draw_box(struct wl_cull_item *item, int blend,
+	 const struct wl_box *box, void *data)
+{
+	struct glx_compositor *gc = data;
+
+	glScissor(box->x1, gc->height - box->y2,
+		  box->x2 - box->x1, box->y2 - box->y1);
+	if (item == NULL)
+		glClear(GL_COLOR_BUFFER_BIT);
+	else
+		draw_surface(item->data, blend);
+}
+
+/* Swapping leaves the back buffer undefined, which would mean
+ * redrawing the whole window every frame.  Instead the back buffer
+ * is kept and only the damaged boxes are copied to the front. */
+
+static void
+present_damage(struct glx_compositor *gc)
+{
+	struct wl_box *box;
+	int i;
+
+	glDisable(GL_TEXTURE_RECTANGLE_ARB);
+	glDisable(GL_BLEND);
+	glReadBuffer(GL_BACK);
+	glDrawBuffer(GL_FRONT);
+	for (i = 0; i < gc->damage.region.count; i++) {
+		box = &gc->damage.region.boxes[i];
+		glRasterPos2i(box->x1, box->y2);
+		glCopyPixels(box->x1, gc->height - box->y2,
+			     box->x2 - box->x1, box->y2 - box->y1, GL_COLOR);
+	}
+	glDrawBuffer(GL_BACK);
+	glFlush();
+}
+
+static void
+repaint(void *data)
+{
+	struct glx_compositor *gc = data;
+	struct wl_surface_iterator *iterator;
+	struct wl_surface *surface;
+	struct surface_data *sd;
+
+	iterator = wl_surface_iterator_create(gc->wl_display, 0);
+	while (wl_surface_iterator_next(iterator, &surface)) {
+		sd = wl_surface_get_data(surface);
+		if (sd != NULL)
+			wl_renderer_surface_flush_damage(&sd->base,
+							 &gc->damage);
 	}
 	wl_surface_iterator_destroy(iterator);
 
-	glXSwapBuffers(gc->display, gc->window);
+	wl_damage_clip(&gc->damage);
+	if (!wl_region_is_empty(&gc->damage.region)) {
+		if (cull_surfaces(gc) < 0) {
+			fprintf(stderr, "out of memory culling surfaces\n");
+			draw_damage(gc);
+		} else {
+			glEnable(GL_SCISSOR_TEST);
+			wl_cull_for_each_box(&gc->cull, draw_box, gc);
+			glDisable(GL_SCISSOR_TEST);
+		}
+
+		present_damage(gc);
+		wl_region_clear(&gc->damage.region);
+	}
+
+	wl_display_post_frame(gc->wl_display);
 }
 
 static void
 schedule_repaint(struct glx_compositor *gc)
 {
-	struct wl_event_loop *loop;
-
-	loop = wl_display_get_event_loop(gc->wl_display);
-	wl_event_loop_add_idle(loop, repaint, gc);
+	wl_frame_clock_schedule(gc->frame_clock);
 }
 
 static void
@@ -113,6 +247,8 @@ notify_surface_create(struct wl_compositor *compositor,
 	if (sd == NULL)
 		return;
 
+	memset(sd, 0, sizeof *sd);
+	wl_renderer_surface_init(&sd->base);
 	wl_surface_set_data(surface, sd);
 
 	glGenTextures(1, &sd->texture);
@@ -131,6 +267,9 @@ notify_surface_destroy(struct wl_compositor *compositor,
 
 	glDeleteTextures(1, &sd->texture);
 
+	wl_renderer_surface_damage_map(&sd->base, &gc->damage);
+	wl_renderer_surface_fini(&sd->base);
+	wl_surface_set_data(surface, NULL);
 	free(sd);
 
 	schedule_repaint(gc);
@@ -140,7 +279,7 @@ static void
 notify_surface_attach(struct wl_compositor *compositor,
 		      struct wl_surface *surface, uint32_t name, 
 		      uint32_t width, uint32_t height,
-		      uint32_t stride)
+		      uint32_t stride, uint32_t format)
 {
 	struct glx_compositor *gc = (struct glx_compositor *) compositor;
 	struct wl_backend *backend;
@@ -153,8 +292,6 @@ notify_surface_attach(struct wl_compositor *compositor,
 	if (sd == NULL)
 		return;
 
-	sd->width = width;
-	sd->height = height;
 	b = wl_backend_open_buffer (backend, width, height, stride, name);
 	data = wl_buffer_get_data (b);
 	if (data == NULL) {
@@ -170,18 +307,35 @@ notify_surface_attach(struct wl_compositor *compositor,
 	glTexParameterf(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_WRAP_R, GL_REPEAT);
 	glTexParameterf(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameterf(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	/* Opaque formats get a texture without alpha, so sampling
+	 * them gives 1 whatever the client left in the X byte. */
+	if (format == WL_SURFACE_FORMAT_RGB565) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / 2);
+		glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGB,
+			     width, height, 0,
+			     GL_RGB, GL_UNSIGNED_SHORT_5_6_5, data);
+	} else {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / 4);
 #if __BYTE_ORDER == __LITTLE_ENDIAN
-	glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, width, height, 0,
-		     GL_BGRA, GL_UNSIGNED_BYTE, data);
+		glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0,
+			     format == WL_SURFACE_FORMAT_ARGB8888 ?
+			     GL_RGBA : GL_RGB, width, height, 0,
+			     GL_BGRA, GL_UNSIGNED_BYTE, data);
 #else
-	glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, width, height, 0,
-		     GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
+		glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0,
+			     format == WL_SURFACE_FORMAT_ARGB8888 ?
+			     GL_RGBA : GL_RGB, width, height, 0,
+			     GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
 #endif
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 
 	wl_buffer_free_data(b, data);
 	wl_buffer_destroy (b);
 
-	schedule_repaint(gc);
+	wl_renderer_surface_attach(&sd->base, &gc->damage,
+				   width, height, format);
 }
 
 static void
@@ -195,9 +349,7 @@ notify_surface_map(struct wl_compositor *compositor,
 	if (sd == NULL)
 		return;
 
-	sd->map = *map;
-
-	schedule_repaint(gc);
+	wl_renderer_surface_map(&sd->base, &gc->damage, map);
 }
 
 static void
@@ -213,12 +365,54 @@ static void
 notify_surface_damage(struct wl_compositor *compositor,
 		      struct wl_surface *surface,
 		      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct glx_compositor *gc = (struct glx_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_damage(&sd->base, &gc->damage,
+				   x, y, width, height);
+}
+
+static void
+notify_commit(struct wl_compositor *compositor)
 {
 	struct glx_compositor *gc = (struct glx_compositor *) compositor;
 
 	schedule_repaint(gc);
 }
 
+static void
+notify_surface_opaque(struct wl_compositor *compositor,
+		      struct wl_surface *surface,
+		      const struct wl_region *opaque)
+{
+	struct glx_compositor *gc = (struct glx_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_set_opaque(&sd->base, &gc->damage, opaque);
+}
+
+static void
+notify_surface_stack(struct wl_compositor *compositor,
+		     struct wl_surface *surface)
+{
+	struct glx_compositor *gc = (struct glx_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_damage_map(&sd->base, &gc->damage);
+}
 
 static const struct wl_compositor_interface interface = {
 	notify_surface_create,
@@ -226,7 +420,11 @@ static const struct wl_compositor_interface interface = {
 	notify_surface_attach,
 	notify_surface_map,
 	notify_surface_copy,
-	notify_surface_damage
+	notify_surface_damage,
+	NULL, /* notify_display_destroy */
+	notify_commit,
+	notify_surface_opaque,
+	notify_surface_stack
 };
 
 static void
@@ -237,7 +435,16 @@ display_data(int fd, uint32_t mask, void *data)
 
 	while (XPending(gc->display) > 0) {
 		XNextEvent(gc->display, &ev);
-		/* Some day we'll do something useful with these events. */
+		/* The front buffer is only partially updated, so
+		 * whatever the X server exposes is redrawn and copied
+		 * out again; the rest of it is still good. */
+		if (ev.type == Expose) {
+			wl_damage_add(&gc->damage,
+				      ev.xexpose.x, ev.xexpose.y,
+				      ev.xexpose.width, ev.xexpose.height);
+			schedule_repaint(gc);
+		}
+		/* Some day we'll do something useful with the others. */
 	}
 }
 
@@ -268,6 +475,14 @@ wl_compositor_init(int argc, char **argv)
 		return NULL;
 
 	gc->base.interface = &interface;
+	gc->width = width;
+	gc->height = height;
+	wl_cull_init(&gc->cull);
+	if (wl_damage_init(&gc->damage, width, height) < 0) {
+		free(gc);
+		return NULL;
+	}
+
 	backend = wl_backend_create("shm", NULL);
 	gc->wl_display = wl_display_create(backend, &gc->base);
 	if (gc->wl_display == NULL) {
@@ -286,6 +501,12 @@ wl_compositor_init(int argc, char **argv)
 					    ConnectionNumber(gc->display),
 					    WL_EVENT_READABLE,
 					    display_data, gc);
+	gc->frame_clock = wl_frame_clock_create(loop, REFRESH_RATE,
+						REPAINT_LEAD, repaint, gc);
+	if (gc->frame_clock == NULL) {
+		fprintf(stderr, "failed to create frame clock\n");
+		return NULL;
+	}
 
 	screen = DefaultScreen(gc->display);
 	root = RootWindow(gc->display, screen);
@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "wayland.h"
+#include "grid.h"
+
+/* Microbenchmark for the surface grid: picking the topmost of n
+ * windows at random points, against walking all of them the way a
+ * list would, moving windows and finding the windows under a
+ * cursor-sized rectangle.  Windows are 100-800 by 100-600 pixels
+ * scattered over a 1080p screen, over a fullscreen one at the
+ * bottom. */
+
+#define POINTS 4096
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+place(struct wl_grid_item *item, int i)
+{
+	if (i == 0) {
+		item->map.x = 0;
+		item->map.y = 0;
+		item->map.width = 1920;
+		item->map.height = 1080;
+		return;
+	}
+
+	item->map.width = 100 + rand() % 700;
+	item->map.height = 100 + rand() % 500;
+	item->map.x = rand() % 1920 - item->map.width / 2;
+	item->map.y = rand() % 1080 - item->map.height / 2;
+}
+
+static struct wl_grid_item *
+pick_linear(struct wl_grid_item *items, int n, int32_t x, int32_t y)
+{
+	struct wl_grid_item *item;
+	int i;
+
+	for (i = n - 1; i >= 0; i--) {
+		item = &items[i];
+		if (item->map.x <= x && x < item->map.x + item->map.width &&
+		    item->map.y <= y && y < item->map.y + item->map.height)
+			return item;
+	}
+
+	return NULL;
+}
+
+static void
+count_item(struct wl_grid_item *item, void *data)
+{
+	int *count = data;
+
+	(*count)++;
+}
+
+static void
+run(int n, int rounds)
+{
+	struct wl_grid *grid;
+	struct wl_grid_item *items;
+	struct wl_map rect;
+	int32_t px[POINTS], py[POINTS];
+	double pick, linear, move, query, start;
+	int i, r, mismatches = 0, found = 0;
+
+	grid = calloc(1, sizeof *grid);
+	items = calloc(n, sizeof *items);
+	if (grid == NULL || items == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	srand(n);
+	for (i = 0; i < n; i++) {
+		place(&items[i], i);
+		items[i].order = i;
+		wl_grid_insert(grid, &items[i]);
+	}
+	for (i = 0; i < POINTS; i++) {
+		px[i] = rand() % 1920;
+		py[i] = rand() % 1080;
+	}
+
+	for (i = 0; i < POINTS; i++)
+		if (wl_grid_pick(grid, px[i], py[i], NULL, NULL) !=
+		    pick_linear(items, n, px[i], py[i]))
+			mismatches++;
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < POINTS; i++)
+			wl_grid_pick(grid, px[i], py[i], NULL, NULL);
+	pick = now() - start;
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < POINTS; i++)
+			pick_linear(items, n, px[i], py[i]);
+	linear = now() - start;
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < POINTS; i++) {
+			rect.x = px[i];
+			rect.y = py[i];
+			rect.width = 16;
+			rect.height = 16;
+			wl_grid_for_each(grid, &rect, count_item, &found);
+		}
+	query = now() - start;
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 1; i < n; i++) {
+			wl_grid_remove(grid, &items[i]);
+			items[i].map.x += r & 1 ? -8 : 8;
+			wl_grid_insert(grid, &items[i]);
+		}
+	move = now() - start;
+
+	if (mismatches > 0)
+		fprintf(stderr, "grid picked differently at %d points\n",
+			mismatches);
+
+	printf("%6d windows: pick %7.1f ns  linear %8.1f ns  "
+	       "16x16 query %7.1f ns (%.1f found)  move %7.1f ns\n",
+	       n, pick * 1e9 / POINTS / rounds,
+	       linear * 1e9 / POINTS / rounds,
+	       query * 1e9 / POINTS / rounds,
+	       (double) found / POINTS / rounds,
+	       n > 1 ? move * 1e9 / (n - 1) / rounds : 0.0);
+
+	wl_grid_release(grid);
+	free(grid);
+	free(items);
+}
+
+int main(int argc, char *argv[])
+{
+	run(10, 1000);
+	run(100, 200);
+	run(1000, 20);
+
+	return 0;
+}
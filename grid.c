@@ -0,0 +1,279 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wayland.h"
+#include "grid.h"
+
+enum {
+	WL_GRID_NONE,
+	WL_GRID_CELLS,
+	WL_GRID_LARGE
+};
+
+/* Cell coordinates round towards minus infinity, so negative
+ * positions get cells of their own rather than sharing cell 0. */
+
+static inline int32_t
+grid_cell(int32_t v)
+{
+	return v >> WL_GRID_CELL_SHIFT;
+}
+
+static inline struct wl_grid_bucket *
+grid_bucket(struct wl_grid *grid, int32_t cx, int32_t cy)
+{
+	uint32_t h = (uint32_t) cx * 73856093u ^ (uint32_t) cy * 19349663u;
+
+	return &grid->buckets[h & (WL_GRID_BUCKETS - 1)];
+}
+
+static inline int
+grid_contains(const struct wl_map *map, int32_t x, int32_t y)
+{
+	return map->x <= x && x < map->x + map->width &&
+		map->y <= y && y < map->y + map->height;
+}
+
+static inline int
+grid_intersects(const struct wl_map *a, const struct wl_map *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+		a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/* Buckets are kept sorted bottom to top, so picking can scan down
+ * from the top and stop at the first hit.  This returns the index of
+ * the first item not below order. */
+
+static int
+bucket_find(struct wl_grid_bucket *bucket, int64_t order)
+{
+	int low = 0, high = bucket->count, mid;
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (bucket->items[mid]->order < order)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+static int
+bucket_add(struct wl_grid_bucket *bucket, struct wl_grid_item *item)
+{
+	struct wl_grid_item **items;
+	int alloc, i;
+
+	if (bucket->count == bucket->alloc) {
+		alloc = bucket->alloc ? bucket->alloc * 2 : 4;
+		items = realloc(bucket->items, alloc * sizeof *items);
+		if (items == NULL)
+			return -1;
+		bucket->items = items;
+		bucket->alloc = alloc;
+	}
+
+	i = bucket_find(bucket, item->order);
+	memmove(&bucket->items[i + 1], &bucket->items[i],
+		(bucket->count - i) * sizeof *bucket->items);
+	bucket->items[i] = item;
+	bucket->count++;
+
+	return 0;
+}
+
+/* An item listed twice in a bucket, for two cells that hash alike,
+ * is removed once per cell. */
+
+static void
+bucket_remove(struct wl_grid_bucket *bucket, struct wl_grid_item *item)
+{
+	int i;
+
+	i = bucket_find(bucket, item->order);
+	if (i == bucket->count || bucket->items[i] != item)
+		return;
+
+	bucket->count--;
+	memmove(&bucket->items[i], &bucket->items[i + 1],
+		(bucket->count - i) * sizeof *bucket->items);
+}
+
+void
+wl_grid_release(struct wl_grid *grid)
+{
+	int i;
+
+	for (i = 0; i < WL_GRID_BUCKETS; i++)
+		free(grid->buckets[i].items);
+	free(grid->large.items);
+}
+
+/* Take item out of the first count of its cells, row by row. */
+
+static void
+grid_remove_cells(struct wl_grid *grid, struct wl_grid_item *item,
+		  int count)
+{
+	int32_t cx, cy, cx0, cy0, cx1, cy1;
+
+	cx0 = grid_cell(item->map.x);
+	cy0 = grid_cell(item->map.y);
+	cx1 = grid_cell(item->map.x + item->map.width - 1);
+	cy1 = grid_cell(item->map.y + item->map.height - 1);
+	for (cy = cy0; cy <= cy1; cy++)
+		for (cx = cx0; cx <= cx1; cx++) {
+			if (count-- == 0)
+				return;
+			bucket_remove(grid_bucket(grid, cx, cy), item);
+		}
+}
+
+/* Index item at item->map and item->order, neither of which may
+ * change until it's removed again.  Empty maps aren't indexed.  If
+ * the cells can't be grown, the item goes on the large list instead.
+ * Putting an item back where it was removed from never fails, since
+ * there's room left behind in all the buckets it goes into. */
+
+int
+wl_grid_insert(struct wl_grid *grid, struct wl_grid_item *item)
+{
+	int32_t cx, cy, cx0, cy0, cx1, cy1;
+	int count = 0;
+
+	item->where = WL_GRID_NONE;
+	if (item->map.width <= 0 || item->map.height <= 0)
+		return 0;
+
+	cx0 = grid_cell(item->map.x);
+	cy0 = grid_cell(item->map.y);
+	cx1 = grid_cell(item->map.x + item->map.width - 1);
+	cy1 = grid_cell(item->map.y + item->map.height - 1);
+
+	if ((int64_t) (cx1 - cx0 + 1) * (cy1 - cy0 + 1) <= WL_GRID_MAX_CELLS) {
+		for (cy = cy0; cy <= cy1; cy++)
+			for (cx = cx0; cx <= cx1; cx++) {
+				if (bucket_add(grid_bucket(grid, cx, cy),
+					       item) < 0)
+					goto fail;
+				count++;
+			}
+		item->where = WL_GRID_CELLS;
+		return 0;
+
+	fail:
+		grid_remove_cells(grid, item, count);
+	}
+
+	if (bucket_add(&grid->large, item) < 0)
+		return -1;
+	item->where = WL_GRID_LARGE;
+
+	return 0;
+}
+
+void
+wl_grid_remove(struct wl_grid *grid, struct wl_grid_item *item)
+{
+	switch (item->where) {
+	case WL_GRID_CELLS:
+		grid_remove_cells(grid, item, WL_GRID_MAX_CELLS);
+		break;
+	case WL_GRID_LARGE:
+		bucket_remove(&grid->large, item);
+		break;
+	}
+
+	item->where = WL_GRID_NONE;
+}
+
+static struct wl_grid_item *
+bucket_pick(struct wl_grid_bucket *bucket, struct wl_grid_item *top,
+	    int32_t x, int32_t y, wl_grid_accept_func_t accept, void *data)
+{
+	struct wl_grid_item *item;
+	int i;
+
+	for (i = bucket->count - 1; i >= 0; i--) {
+		item = bucket->items[i];
+		if (top != NULL && item->order < top->order)
+			break;
+		if (grid_contains(&item->map, x, y) &&
+		    (accept == NULL || accept(item, x, y, data)))
+			return item;
+	}
+
+	return top;
+}
+
+/* The topmost item containing x, y that accept, if given, takes, or
+ * NULL. */
+
+struct wl_grid_item *
+wl_grid_pick(struct wl_grid *grid, int32_t x, int32_t y,
+	     wl_grid_accept_func_t accept, void *data)
+{
+	struct wl_grid_item *top;
+
+	top = bucket_pick(grid_bucket(grid, grid_cell(x), grid_cell(y)),
+			  NULL, x, y, accept, data);
+
+	return bucket_pick(&grid->large, top, x, y, accept, data);
+}
+
+static void
+bucket_for_each(struct wl_grid *grid, struct wl_grid_bucket *bucket,
+		const struct wl_map *rect, wl_grid_func_t func, void *data)
+{
+	struct wl_grid_item *item;
+	int i;
+
+	for (i = 0; i < bucket->count; i++) {
+		item = bucket->items[i];
+		if (item->stamp == grid->stamp ||
+		    !grid_intersects(&item->map, rect))
+			continue;
+		item->stamp = grid->stamp;
+		func(item, data);
+	}
+}
+
+/* Call func once for every item intersecting rect, in no particular
+ * order.  A rect covering more cells than there are buckets just
+ * scans every bucket. */
+
+void
+wl_grid_for_each(struct wl_grid *grid, const struct wl_map *rect,
+		 wl_grid_func_t func, void *data)
+{
+	int32_t cx, cy, cx0, cy0, cx1, cy1;
+	int i;
+
+	if (rect->width <= 0 || rect->height <= 0)
+		return;
+
+	/* Zero is what new items start out with. */
+	if (++grid->stamp == 0)
+		grid->stamp = 1;
+
+	cx0 = grid_cell(rect->x);
+	cy0 = grid_cell(rect->y);
+	cx1 = grid_cell(rect->x + rect->width - 1);
+	cy1 = grid_cell(rect->y + rect->height - 1);
+
+	if ((int64_t) (cx1 - cx0 + 1) * (cy1 - cy0 + 1) > WL_GRID_BUCKETS) {
+		for (i = 0; i < WL_GRID_BUCKETS; i++)
+			bucket_for_each(grid, &grid->buckets[i],
+					rect, func, data);
+	} else {
+		for (cy = cy0; cy <= cy1; cy++)
+			for (cx = cx0; cx <= cx1; cx++)
+				bucket_for_each(grid, grid_bucket(grid, cx, cy),
+						rect, func, data);
+	}
+
+	bucket_for_each(grid, &grid->large, rect, func, data);
+}
@@ -0,0 +1,47 @@
+#ifndef _GRID_H_
+#define _GRID_H_
+
+/* Spatial index over rectangles.  The plane is cut into square
+ * cells and every item is listed in each cell its rectangle touches.
+ * Cells are hashed into a fixed table of buckets, so coordinates are
+ * unbounded and an empty grid costs nothing to query.  Items that
+ * would touch more than WL_GRID_MAX_CELLS cells go on a list of
+ * their own that every query scans; there are only ever a few
+ * fullscreen surfaces. */
+
+#define WL_GRID_CELL_SHIFT 7
+#define WL_GRID_BUCKETS 1024
+#define WL_GRID_MAX_CELLS 64
+
+struct wl_grid_item {
+	struct wl_map map;
+	/* Stacking order, higher is on top. */
+	int64_t order;
+	uint32_t stamp;
+	int where;
+};
+
+struct wl_grid_bucket {
+	struct wl_grid_item **items;
+	int count, alloc;
+};
+
+struct wl_grid {
+	struct wl_grid_bucket buckets[WL_GRID_BUCKETS];
+	struct wl_grid_bucket large;
+	uint32_t stamp;
+};
+
+typedef void (*wl_grid_func_t)(struct wl_grid_item *item, void *data);
+typedef int (*wl_grid_accept_func_t)(struct wl_grid_item *item,
+				     int32_t x, int32_t y, void *data);
+
+void wl_grid_release(struct wl_grid *grid);
+int wl_grid_insert(struct wl_grid *grid, struct wl_grid_item *item);
+void wl_grid_remove(struct wl_grid *grid, struct wl_grid_item *item);
+struct wl_grid_item *wl_grid_pick(struct wl_grid *grid, int32_t x, int32_t y,
+				  wl_grid_accept_func_t accept, void *data);
+void wl_grid_for_each(struct wl_grid *grid, const struct wl_map *rect,
+		      wl_grid_func_t func, void *data);
+
+#endif
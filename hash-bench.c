@@ -0,0 +1,87 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "wayland.h"
+#include "hash.h"
+
+/* Microbenchmark for the object hash: insert, lookup and delete of n
+ * objects with ids allocated the way the server hands them out, in
+ * blocks of 256 per client. */
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+object_id(int i)
+{
+	return 256 + (i / 200) * 256 + i % 200;
+}
+
+static void
+run(int n, int rounds)
+{
+	struct wl_hash hash = { 0 };
+	struct wl_object *objects;
+	double insert, lookup, delete, start;
+	int i, r, misses;
+
+	objects = malloc(n * sizeof *objects);
+	if (objects == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+		objects[i].id = object_id(i);
+		objects[i].interface = NULL;
+	}
+
+	insert = lookup = delete = 0;
+	misses = 0;
+	for (r = 0; r < rounds; r++) {
+		start = now();
+		for (i = 0; i < n; i++)
+			wl_hash_insert(&hash, &objects[i]);
+		insert += now() - start;
+
+		start = now();
+		for (i = 0; i < n; i++)
+			if (wl_hash_lookup(&hash, objects[(uint64_t) i * 7919 % n].id) == NULL)
+				misses++;
+		lookup += now() - start;
+
+		start = now();
+		for (i = 0; i < n; i++)
+			wl_hash_delete(&hash, &objects[(uint64_t) i * 104729 % n]);
+		delete += now() - start;
+	}
+
+	if (misses > 0 || hash.count != 0)
+		fprintf(stderr, "hash inconsistency: %d misses, %u left\n",
+			misses, hash.count);
+
+	printf("%8d objects: insert %7.1f ns  lookup %7.1f ns  delete %7.1f ns\n",
+	       n, insert * 1e9 / n / rounds, lookup * 1e9 / n / rounds,
+	       delete * 1e9 / n / rounds);
+
+	free(hash.objects);
+	free(objects);
+}
+
+int main(int argc, char *argv[])
+{
+	run(10, 100000);
+	run(1000, 1000);
+	run(100000, 10);
+
+	return 0;
+}
@@ -3,25 +3,69 @@
 #include "wayland.h"
 #include "hash.h"
 
+/* Fibonacci hashing: multiply by 2^32 / phi and keep the top bits.
+ * Ids are handed out sequentially from each client's range, so this
+ * spreads neighbouring ids over the whole table. */
+
+static inline uint32_t
+hash_index(struct wl_hash *hash, uint32_t id)
+{
+	return (id * 2654435761u) >> hash->shift;
+}
+
+static int
+hash_resize(struct wl_hash *hash, uint32_t alloc)
+{
+	struct wl_object **objects, **old;
+	uint32_t i, j, mask, old_alloc, shift;
+
+	objects = calloc(alloc, sizeof *objects);
+	if (objects == NULL)
+		return -1;
+
+	for (shift = 32; (1u << (32 - shift)) < alloc; shift--)
+		;
+
+	old = hash->objects;
+	old_alloc = hash->alloc;
+	hash->objects = objects;
+	hash->alloc = alloc;
+	hash->shift = shift;
+
+	mask = alloc - 1;
+	for (i = 0; i < old_alloc; i++) {
+		if (old[i] == NULL)
+			continue;
+		j = hash_index(hash, old[i]->id);
+		while (objects[j] != NULL)
+			j = (j + 1) & mask;
+		objects[j] = old[i];
+	}
+
+	free(old);
+
+	return 0;
+}
+
 int wl_hash_insert(struct wl_hash *hash, struct wl_object *object)
 {
-	struct wl_object **objects;
-	uint32_t alloc;
-
-	if (hash->count == hash->alloc) {
-		if (hash->alloc == 0)
-			alloc = 16;
-		else
-			alloc = hash->alloc * 2;
-		objects = realloc(hash->objects, alloc * sizeof *objects);
-		if (objects == NULL)
+	uint32_t i, mask;
+
+	/* Keep the load factor below 3/4. */
+	if ((hash->count + 1) * 4 > hash->alloc * 3) {
+		if (hash_resize(hash, hash->alloc ? hash->alloc * 2 : 16) < 0)
 			return -1;
+	}
 
-		hash->objects = objects;
-		hash->alloc = alloc;
+	mask = hash->alloc - 1;
+	i = hash_index(hash, object->id);
+	while (hash->objects[i] != NULL) {
+		if (hash->objects[i]->id == object->id)
+			return -1;
+		i = (i + 1) & mask;
 	}
 
-	hash->objects[hash->count] = object;
+	hash->objects[i] = object;
 	hash->count++;
 
 	return 0;
@@ -30,11 +74,18 @@ int wl_hash_insert(struct wl_hash *hash, struct wl_object *object)
 struct wl_object *
 wl_hash_lookup(struct wl_hash *hash, uint32_t id)
 {
-	int i;
+	struct wl_object *object;
+	uint32_t i, mask;
+
+	if (hash->count == 0)
+		return NULL;
 
-	for (i = 0; i < hash->count; i++) {
-		if (hash->objects[i]->id == id)
-			return hash->objects[i];
+	mask = hash->alloc - 1;
+	i = hash_index(hash, id);
+	while ((object = hash->objects[i]) != NULL) {
+		if (object->id == id)
+			return object;
+		i = (i + 1) & mask;
 	}
 
 	return NULL;
@@ -43,5 +94,34 @@ wl_hash_lookup(struct wl_hash *hash, uint32_t id)
 void
 wl_hash_delete(struct wl_hash *hash, struct wl_object *object)
 {
-	/* writeme */
+	uint32_t i, j, k, mask;
+
+	if (hash->count == 0)
+		return;
+
+	mask = hash->alloc - 1;
+	i = hash_index(hash, object->id);
+	while (hash->objects[i] != object) {
+		if (hash->objects[i] == NULL)
+			return;
+		i = (i + 1) & mask;
+	}
+
+	/* Shift later entries of the probe sequence back into the
+	 * hole, unless their home slot lies cyclically in (i, j]. */
+	j = i;
+	while (1) {
+		hash->objects[i] = NULL;
+		do {
+			j = (j + 1) & mask;
+			if (hash->objects[j] == NULL) {
+				hash->count--;
+				return;
+			}
+			k = hash_index(hash, hash->objects[j]->id);
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+
+		hash->objects[i] = hash->objects[j];
+		i = j;
+	}
 }
@@ -2,9 +2,14 @@
 #define _HASH_H_
 
 
+/* Open addressing hash table keyed on the object id.  The table size
+ * is always a power of two and collisions are resolved by linear
+ * probing, so deletion moves entries back instead of leaving
+ * tombstones. */
+
 struct wl_hash {
 	struct wl_object **objects;
-	uint32_t count, alloc, id;
+	uint32_t count, alloc, shift;
 };
 
 int wl_hash_insert(struct wl_hash *hash, struct wl_object *object);
@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "wayland.h"
+#include "wayland-backend.h"
+
+/* A compositor without any hardware: surfaces are composited in
+ * software from their shm buffers into an XRGB frame in memory, or
+ * in a file when output=FILE is given so other processes can map it.
+ * With dump=PREFIX every frame is also written out as PREFIX%06u.ppm.
+ * It runs anywhere, which makes it the compositor to run clients and
+ * benchmarks against.
+ *
+ * Options, after the module path on the command line:
+ *
+ *   size=WIDTHxHEIGHT  output size, 1024x768 by default
+ *   refresh=MHZ        refresh rate in mHz, 60000 by default
+ *   output=FILE        composite into FILE instead of anonymous memory
+ *   dump=PREFIX        write each frame to a PPM file
+ *   threads=N          repaint threads, one per CPU by default
+ *
+ * Repaints go through the tiled renderer, so only what changed is
+ * redrawn: a surface's old and new map area when it moves or goes
+ * away, and whatever the client attaches, damages or copies to.
+ * Content damage is collected per surface in surface coordinates
+ * and moved into the output's damage region at repaint, clipped to
+ * the surface's map.
+ *
+ * XRGB and RGB565 buffers are opaque as a whole; ARGB surfaces are
+ * opaque where the client's opaque region says so.  RGB565 buffers
+ * are expanded to XRGB at repaint whenever they've been damaged. */
+
+#define REFRESH_RATE 60000
+#define REPAINT_LEAD 4
+
+#define BACKGROUND 0xff002040
+
+struct headless_compositor {
+	struct wl_compositor base;
+	struct wl_display *wl_display;
+	struct wl_backend *backend;
+	struct wl_frame_clock *frame_clock;
+	struct wl_image fb;
+	struct wl_renderer *renderer;
+	struct wl_damage *damage;
+	struct wl_renderer_layer *layers;
+	int layer_alloc;
+	size_t size;
+	int mapped;
+	const char *dump;
+	uint32_t frame;
+};
+
+struct surface_data {
+	struct wl_renderer_surface base;
+	struct wl_buffer *buffer;
+};
+
+static void
+dump_frame(struct headless_compositor *hc)
+{
+	char path[256];
+	unsigned char *row;
+	uint32_t p;
+	FILE *file;
+	int x, y;
+
+	snprintf(path, sizeof path, "%s%06u.ppm", hc->dump, hc->frame);
+	file = fopen(path, "w");
+	if (file == NULL) {
+		fprintf(stderr, "failed to open %s: %m\n", path);
+		return;
+	}
+
+	row = malloc(hc->fb.width * 3);
+	if (row == NULL) {
+		fclose(file);
+		return;
+	}
+
+	fprintf(file, "P6\n%d %d\n255\n", hc->fb.width, hc->fb.height);
+	for (y = 0; y < hc->fb.height; y++) {
+		for (x = 0; x < hc->fb.width; x++) {
+			p = hc->fb.data[y * hc->fb.stride / 4 + x];
+			row[x * 3] = p >> 16;
+			row[x * 3 + 1] = p >> 8;
+			row[x * 3 + 2] = p;
+		}
+		fwrite(row, 3, hc->fb.width, file);
+	}
+
+	free(row);
+	fclose(file);
+}
+
+/* shm buffer data is the mapped segment itself, so there's nothing
+ * to free once the frame is done. */
+
+static void
+repaint(void *data)
+{
+	struct headless_compositor *hc = data;
+	struct wl_surface_iterator *iterator;
+	struct wl_surface *surface;
+	struct surface_data *sd;
+	void *pixels;
+	int count = 0;
+
+	iterator = wl_surface_iterator_create(hc->wl_display, 0);
+	while (wl_surface_iterator_next(iterator, &surface)) {
+		sd = wl_surface_get_data(surface);
+		if (sd == NULL)
+			continue;
+		wl_renderer_surface_flush_damage(&sd->base, hc->damage);
+		if (sd->buffer == NULL)
+			continue;
+		pixels = wl_buffer_get_data(sd->buffer);
+		if (pixels == NULL)
+			continue;
+		count = wl_renderer_surface_add_layer(&sd->base, pixels,
+						      sd->buffer->stride,
+						      &hc->layers,
+						      &hc->layer_alloc, count);
+	}
+	wl_surface_iterator_destroy(iterator);
+
+	wl_renderer_render(hc->renderer, hc->layers, count, BACKGROUND);
+
+	if (hc->dump)
+		dump_frame(hc);
+	hc->frame++;
+
+	wl_display_post_frame(hc->wl_display);
+}
+
+static void
+schedule_repaint(struct headless_compositor *hc)
+{
+	wl_frame_clock_schedule(hc->frame_clock);
+}
+
+static void
+notify_surface_create(struct wl_compositor *compositor,
+		      struct wl_surface *surface)
+{
+	struct surface_data *sd;
+
+	sd = malloc(sizeof *sd);
+	if (sd == NULL)
+		return;
+
+	memset(sd, 0, sizeof *sd);
+	wl_renderer_surface_init(&sd->base);
+	wl_surface_set_data(surface, sd);
+}
+
+static void
+notify_surface_destroy(struct wl_compositor *compositor,
+		       struct wl_surface *surface)
+{
+	struct headless_compositor *hc = (struct headless_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	if (sd->buffer)
+		wl_buffer_destroy(sd->buffer);
+	wl_renderer_surface_damage_map(&sd->base, hc->damage);
+	wl_renderer_surface_fini(&sd->base);
+	free(sd);
+	wl_surface_set_data(surface, NULL);
+
+	schedule_repaint(hc);
+}
+
+/* The shm backend hands out the client's memory directly, so we keep
+ * the buffer open and composite from it at repaint time rather than
+ * taking a copy here. */
+
+static void
+notify_surface_attach(struct wl_compositor *compositor,
+		      struct wl_surface *surface, uint32_t name,
+		      uint32_t width, uint32_t height, uint32_t stride,
+		      uint32_t format)
+{
+	struct headless_compositor *hc = (struct headless_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	if (sd->buffer)
+		wl_buffer_destroy(sd->buffer);
+	sd->buffer = wl_backend_open_buffer(hc->backend,
+					    width, height, stride, name);
+	if (sd->buffer == NULL)
+		fprintf(stderr, "failed to open buffer %u\n", name);
+
+	wl_renderer_surface_attach(&sd->base, hc->damage,
+				   width, height, format);
+}
+
+static void
+notify_surface_map(struct wl_compositor *compositor,
+		   struct wl_surface *surface, struct wl_map *map)
+{
+	struct headless_compositor *hc = (struct headless_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_map(&sd->base, hc->damage, map);
+}
+
+static void
+notify_surface_copy(struct wl_compositor *compositor,
+		    struct wl_surface *surface,
+		    int32_t dst_x, int32_t dst_y,
+		    uint32_t name, uint32_t stride,
+		    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct headless_compositor *hc = (struct headless_compositor *) compositor;
+	struct surface_data *sd;
+	struct wl_buffer *src;
+	char *s, *d;
+	int32_t i, cpp;
+
+	/* Written so that no client value can overflow the sums. */
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL || sd->buffer == NULL ||
+	    x < 0 || y < 0 || width <= 0 || height <= 0 ||
+	    dst_x < 0 || dst_y < 0 ||
+	    x > INT32_MAX - width || y > INT32_MAX - height ||
+	    dst_x > sd->buffer->width ||
+	    width > sd->buffer->width - dst_x ||
+	    dst_y > sd->buffer->height ||
+	    height > sd->buffer->height - dst_y)
+		return;
+
+	src = wl_backend_open_buffer(hc->backend,
+				     x + width, y + height, stride, name);
+	if (src == NULL)
+		return;
+
+	cpp = sd->base.format == WL_SURFACE_FORMAT_RGB565 ? 2 : 4;
+	s = wl_buffer_get_data(src);
+	d = wl_buffer_get_data(sd->buffer);
+	if (s != NULL && d != NULL)
+		for (i = 0; i < height; i++)
+			memmove(d + (dst_y + i) * sd->buffer->stride + dst_x * cpp,
+				s + (y + i) * stride + x * cpp, width * cpp);
+
+	if (d != NULL)
+		wl_buffer_free_data(sd->buffer, d);
+	if (s != NULL)
+		wl_buffer_free_data(src, s);
+	wl_buffer_destroy(src);
+
+	wl_renderer_surface_damage(&sd->base, hc->damage,
+				   dst_x, dst_y, width, height);
+}
+
+static void
+notify_surface_damage(struct wl_compositor *compositor,
+		      struct wl_surface *surface,
+		      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct headless_compositor *hc = (struct headless_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_damage(&sd->base, hc->damage,
+				   x, y, width, height);
+}
+
+static void
+notify_commit(struct wl_compositor *compositor)
+{
+	struct headless_compositor *hc = (struct headless_compositor *) compositor;
+
+	schedule_repaint(hc);
+}
+
+static void
+notify_surface_opaque(struct wl_compositor *compositor,
+		      struct wl_surface *surface,
+		      const struct wl_region *opaque)
+{
+	struct headless_compositor *hc = (struct headless_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_set_opaque(&sd->base, hc->damage, opaque);
+}
+
+static void
+notify_surface_stack(struct wl_compositor *compositor,
+		     struct wl_surface *surface)
+{
+	struct headless_compositor *hc = (struct headless_compositor *) compositor;
+	struct surface_data *sd;
+
+	sd = wl_surface_get_data(surface);
+	if (sd == NULL)
+		return;
+
+	wl_renderer_surface_damage_map(&sd->base, hc->damage);
+}
+
+static void
+notify_display_destroy(struct wl_compositor *compositor,
+		       struct wl_display *display)
+{
+	struct headless_compositor *hc = (struct headless_compositor *) compositor;
+	struct wl_frame_clock_stats stats;
+	struct wl_surface_iterator *iterator;
+	struct wl_surface *surface;
+
+	iterator = wl_surface_iterator_create(display, 0);
+	while (wl_surface_iterator_next(iterator, &surface))
+		notify_surface_destroy(compositor, surface);
+	wl_surface_iterator_destroy(iterator);
+
+	/* No frame clock if wl_compositor_init() failed to make one. */
+	if (hc->frame_clock != NULL) {
+		wl_frame_clock_get_stats(hc->frame_clock, &stats);
+		fprintf(stderr, "headless: %llu frames, %llu missed\n",
+			(unsigned long long) stats.frames,
+			(unsigned long long) stats.missed);
+		wl_frame_clock_destroy(hc->frame_clock);
+	}
+	wl_renderer_destroy(hc->renderer);
+	free(hc->layers);
+
+	/* Unlinks the shm segment, so the next server can create it. */
+	wl_backend_destroy(hc->backend);
+
+	if (hc->mapped)
+		munmap(hc->fb.data, hc->size);
+	else
+		free(hc->fb.data);
+}
+
+static const struct wl_compositor_interface interface = {
+	notify_surface_create,
+	notify_surface_destroy,
+	notify_surface_attach,
+	notify_surface_map,
+	notify_surface_copy,
+	notify_surface_damage,
+	notify_display_destroy,
+	notify_commit,
+	notify_surface_opaque,
+	notify_surface_stack
+};
+
+static int
+create_output(struct headless_compositor *hc, const char *path)
+{
+	int fd;
+
+	hc->fb.stride = hc->fb.width * 4;
+	hc->size = (size_t) hc->fb.stride * hc->fb.height;
+
+	if (path == NULL) {
+		hc->fb.data = malloc(hc->size);
+		return hc->fb.data ? 0 : -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, hc->size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	hc->fb.data = mmap(NULL, hc->size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+	close(fd);
+	if (hc->fb.data == MAP_FAILED)
+		return -1;
+	hc->mapped = 1;
+
+	return 0;
+}
+
+WL_EXPORT struct wl_display *
+wl_compositor_init(int argc, char **argv)
+{
+	struct headless_compositor *hc;
+	struct wl_event_loop *loop;
+	const char *output = NULL;
+	uint32_t refresh = REFRESH_RATE;
+	int i, threads;
+
+	hc = malloc(sizeof *hc);
+	if (hc == NULL)
+		return NULL;
+
+	memset(hc, 0, sizeof *hc);
+	hc->base.interface = &interface;
+	hc->fb.width = 1024;
+	hc->fb.height = 768;
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (i = 1; i < argc; i++) {
+		if (sscanf(argv[i], "size=%dx%d",
+			   &hc->fb.width, &hc->fb.height) == 2)
+			continue;
+		else if (sscanf(argv[i], "refresh=%u", &refresh) == 1)
+			continue;
+		else if (sscanf(argv[i], "threads=%d", &threads) == 1)
+			continue;
+		else if (strncmp(argv[i], "output=", 7) == 0)
+			output = argv[i] + 7;
+		else if (strncmp(argv[i], "dump=", 5) == 0)
+			hc->dump = argv[i] + 5;
+		else
+			fprintf(stderr, "headless: unknown option %s\n",
+				argv[i]);
+	}
+
+	if (hc->fb.width <= 0 || hc->fb.height <= 0 || refresh == 0) {
+		fprintf(stderr, "headless: bad size or refresh rate\n");
+		goto err_free;
+	}
+
+	if (create_output(hc, output) < 0) {
+		fprintf(stderr, "headless: failed to create output: %m\n");
+		goto err_free;
+	}
+
+	hc->renderer = wl_renderer_create(&hc->fb, NULL, threads);
+	if (hc->renderer == NULL) {
+		fprintf(stderr, "headless: failed to create renderer\n");
+		goto err_output;
+	}
+	hc->damage = wl_renderer_get_damage(hc->renderer);
+
+	hc->backend = wl_backend_create("shm", NULL);
+	if (hc->backend == NULL) {
+		fprintf(stderr, "headless: failed to create shm backend: %m\n");
+		goto err_renderer;
+	}
+
+	hc->wl_display = wl_display_create(hc->backend, &hc->base);
+	if (hc->wl_display == NULL)
+		goto err_backend;
+
+	loop = wl_display_get_event_loop(hc->wl_display);
+	hc->frame_clock = wl_frame_clock_create(loop, refresh, REPAINT_LEAD,
+						repaint, hc);
+	if (hc->frame_clock == NULL) {
+		fprintf(stderr, "failed to create frame clock\n");
+		goto err_display;
+	}
+
+	schedule_repaint(hc);
+
+	return hc->wl_display;
+
+err_display:
+	/* notify_display_destroy() takes the backend, renderer and
+	 * output down with the display. */
+	wl_display_destroy(hc->wl_display);
+	goto err_free;
+err_backend:
+	wl_backend_destroy(hc->backend);
+err_renderer:
+	wl_renderer_destroy(hc->renderer);
+err_output:
+	if (hc->mapped)
+		munmap(hc->fb.data, hc->size);
+	else
+		free(hc->fb.data);
+err_free:
+	free(hc);
+	return NULL;
+}
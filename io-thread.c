@@ -0,0 +1,712 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "wayland.h"
+#include "connection.h"
+#include "io-thread.h"
+
+/* Each I/O thread runs its own event loop over the sockets of its
+ * clients and talks to the compositor thread through two rings: the
+ * control ring carries new clients and changes to them from the
+ * compositor thread, the message ring carries requests back.  Every
+ * ring has exactly one producer and one consumer, so head is only
+ * written by the one and tail only by the other and no locks are
+ * needed.  Eventfds wake up the other side; the I/O thread signals
+ * at most once per loop iteration and only if the compositor thread
+ * hasn't been woken already. */
+
+#define WL_IO_MESSAGE_RING_SIZE (256 * 1024)
+#define WL_IO_CONTROL_RING_SIZE (16 * 1024)
+
+/* Requests framed per client before the others on the thread get a
+ * turn, and records the compositor thread takes from a ring before
+ * the rest of its event loop gets one. */
+#define WL_IO_CLIENT_BUDGET 64
+#define WL_IO_DISPATCH_BUDGET 256
+
+enum {
+	WL_IO_PAD,
+	/* I/O thread to compositor thread. */
+	WL_IO_MESSAGE,
+	WL_IO_ERROR,
+	WL_IO_REMOVED,
+	/* Compositor thread to I/O thread. */
+	WL_IO_ADD,
+	WL_IO_REMOVE,
+	WL_IO_PAUSE,
+	WL_IO_RESUME,
+	WL_IO_QUIT
+};
+
+/* Records are padded to 16 bytes, so a record header always fits in
+ * what is left at the end of the ring.  A record that doesn't fit
+ * there in full is preceded by a pad record, keeping every record
+ * contiguous. */
+
+struct wl_io_record {
+	struct wl_io_client *client;
+	uint32_t type;
+	uint32_t size;
+};
+
+#define WL_IO_RECORD_SIZE(size) \
+	((sizeof (struct wl_io_record) + (size) + 15) & ~15u)
+
+struct wl_io_ring {
+	char *data;
+	uint32_t size;
+	/* Free running offsets on separate cache lines. */
+	uint32_t head __attribute__ ((aligned (64)));
+	uint32_t tail __attribute__ ((aligned (64)));
+	/* Set by a producer waiting for the consumer to make room. */
+	int waiting;
+};
+
+struct wl_io_thread {
+	struct wl_io_pool *pool;
+	pthread_t thread;
+	int started;
+
+	struct wl_io_ring control, messages;
+	int wake_fd, notify_fd;
+	int notified;
+
+	/* Only used on the I/O thread. */
+	struct wl_event_loop *loop;
+	struct wl_event_source *wake_source;
+	struct wl_list client_list;
+	struct wl_list blocked_list;
+	int run, pushed;
+
+	/* Only used on the compositor thread. */
+	struct wl_event_source *notify_source;
+	int client_count;
+};
+
+struct wl_io_pool {
+	struct wl_event_loop *loop;
+	const struct wl_io_interface *interface;
+	struct wl_io_thread *threads;
+	int count;
+};
+
+enum {
+	WL_IO_CLIENT_PAUSED = 0x01,
+	WL_IO_CLIENT_BLOCKED = 0x02,
+	WL_IO_CLIENT_FAILED = 0x04,
+	WL_IO_CLIENT_REMOVED = 0x08
+};
+
+struct wl_io_client {
+	struct wl_io_thread *thread;
+	int fd;
+
+	/* Only used on the compositor thread.  Cleared when the client
+	 * is destroyed, so that messages still in flight are dropped. */
+	void *data;
+
+	/* Only used on the I/O thread. */
+	struct wl_connection *connection;
+	struct wl_event_source *source;
+	struct wl_list link;
+	struct wl_list blocked_link;
+	uint32_t flags;
+};
+
+static int
+wl_io_ring_init(struct wl_io_ring *ring, uint32_t size)
+{
+	ring->data = malloc(size);
+	if (ring->data == NULL)
+		return -1;
+
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->waiting = 0;
+
+	return 0;
+}
+
+/* Producer side: append a record, or fail if the ring is full. */
+
+static int
+wl_io_ring_push(struct wl_io_ring *ring, struct wl_io_client *client,
+		uint32_t type, const void *data, uint32_t size)
+{
+	struct wl_io_record *record;
+	uint32_t head, tail, start, pad, length;
+
+	length = WL_IO_RECORD_SIZE(size);
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	start = head & (ring->size - 1);
+	pad = start + length > ring->size ? ring->size - start : 0;
+	if (head + pad + length - tail > ring->size)
+		return -1;
+
+	if (pad > 0) {
+		record = (struct wl_io_record *) (ring->data + start);
+		record->client = NULL;
+		record->type = WL_IO_PAD;
+		record->size = pad - sizeof *record;
+		head += pad;
+		start = 0;
+	}
+
+	record = (struct wl_io_record *) (ring->data + start);
+	record->client = client;
+	record->type = type;
+	record->size = size;
+	if (size > 0)
+		memcpy(record + 1, data, size);
+
+	__atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Consumer side: the oldest record stays in place until it is
+ * consumed. */
+
+static struct wl_io_record *
+wl_io_ring_peek(struct wl_io_ring *ring)
+{
+	uint32_t head;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (head == ring->tail)
+		return NULL;
+
+	return (struct wl_io_record *)
+		(ring->data + (ring->tail & (ring->size - 1)));
+}
+
+static void
+wl_io_ring_consume(struct wl_io_ring *ring, struct wl_io_record *record)
+{
+	__atomic_store_n(&ring->tail,
+			 ring->tail + WL_IO_RECORD_SIZE(record->size),
+			 __ATOMIC_RELEASE);
+}
+
+static void
+wl_io_signal(int fd)
+{
+	uint64_t one = 1;
+
+	write(fd, &one, sizeof one);
+}
+
+/* Compositor thread: queue a control record for an I/O thread.  The
+ * control ring only fills up if the thread is badly behind, in which
+ * case we wait for it. */
+
+static void
+wl_io_thread_send(struct wl_io_thread *thread,
+		  struct wl_io_client *client, uint32_t type)
+{
+	while (wl_io_ring_push(&thread->control, client, type, NULL, 0) < 0) {
+		wl_io_signal(thread->wake_fd);
+		sched_yield();
+	}
+
+	wl_io_signal(thread->wake_fd);
+}
+
+/* I/O thread: pass a record on to the compositor thread.  If the
+ * message ring is full, the client stops reading and waits on the
+ * blocked list until the compositor thread has made room. */
+
+static int
+wl_io_client_push(struct wl_io_client *client, uint32_t type,
+		  const void *data, uint32_t size)
+{
+	struct wl_io_thread *thread = client->thread;
+	struct wl_io_ring *ring = &thread->messages;
+
+	if (wl_io_ring_push(ring, client, type, data, size) == 0) {
+		thread->pushed = 1;
+		return 0;
+	}
+
+	/* Ask for a wakeup, then try once more in case the compositor
+	 * thread made room before it could see the request. */
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (wl_io_ring_push(ring, client, type, data, size) == 0) {
+		thread->pushed = 1;
+		return 0;
+	}
+
+	if (client->source)
+		wl_event_loop_update_source(thread->loop, client->source, 0);
+	client->flags |= WL_IO_CLIENT_BLOCKED;
+	wl_list_insert(thread->blocked_list.prev, &client->blocked_link);
+
+	return -1;
+}
+
+static void
+wl_io_client_fail(struct wl_io_client *client)
+{
+	if (client->source) {
+		wl_event_loop_remove_source(client->thread->loop,
+					    client->source);
+		client->source = NULL;
+	}
+
+	client->flags |= WL_IO_CLIENT_FAILED;
+	wl_io_client_push(client, WL_IO_ERROR, NULL, 0);
+}
+
+static void
+wl_io_client_data(int fd, uint32_t mask, void *data)
+{
+	struct wl_io_client *client = data;
+	struct wl_connection *connection = client->connection;
+	const uint32_t *p;
+	uint32_t cmask = 0, size;
+	int len, budget;
+
+	if (client->flags & WL_IO_CLIENT_PAUSED)
+		return;
+
+	if (mask & WL_EVENT_READABLE)
+		cmask |= WL_CONNECTION_READABLE;
+
+	len = wl_connection_data(connection, cmask);
+	if (len < 0) {
+		wl_io_client_fail(client);
+		return;
+	}
+
+	budget = WL_IO_CLIENT_BUDGET;
+	while (len >= 2 * sizeof p[0]) {
+		p = wl_connection_view(connection, 2 * sizeof p[0]);
+		size = p[1] >> 16;
+		if (size < 2 * sizeof p[0] || size & 3) {
+			/* We can't find the next message after this. */
+			fprintf(stderr, "bad message size %d from client %p\n",
+				size, client);
+			wl_io_client_fail(client);
+			return;
+		}
+		if (len < size)
+			break;
+
+		if (budget-- == 0) {
+			wl_event_source_check(client->source);
+			break;
+		}
+
+		p = wl_connection_view(connection, size);
+		if (p == NULL) {
+			fprintf(stderr, "out of memory for request\n");
+			wl_io_client_fail(client);
+			return;
+		}
+
+		if (wl_io_client_push(client, WL_IO_MESSAGE, p, size) < 0)
+			return;
+
+		wl_connection_consume(connection, size);
+		len -= size;
+	}
+}
+
+static int
+wl_io_client_update(struct wl_connection *connection,
+		    uint32_t mask, void *data)
+{
+	/* The I/O thread only reads; output goes out on the compositor
+	 * thread's connection for the same socket. */
+	return 0;
+}
+
+static void
+wl_io_client_add(struct wl_io_thread *thread, struct wl_io_client *client)
+{
+	wl_list_insert(thread->client_list.prev, &client->link);
+	client->connection = wl_connection_create(client->fd,
+						  wl_io_client_update, client);
+	client->source = wl_event_loop_add_fd(thread->loop, client->fd,
+					      WL_EVENT_READABLE,
+					      wl_io_client_data, client);
+	if (client->source == NULL)
+		wl_io_client_fail(client);
+}
+
+/* The last record for a client is WL_IO_REMOVED; once it is pushed
+ * the compositor thread frees the client. */
+
+static void
+wl_io_client_remove(struct wl_io_client *client)
+{
+	if (client->source) {
+		wl_event_loop_remove_source(client->thread->loop,
+					    client->source);
+		client->source = NULL;
+	}
+
+	wl_connection_destroy(client->connection);
+	client->connection = NULL;
+	wl_list_remove(&client->link);
+	client->flags |= WL_IO_CLIENT_REMOVED;
+
+	if (!(client->flags & WL_IO_CLIENT_BLOCKED))
+		wl_io_client_push(client, WL_IO_REMOVED, NULL, 0);
+}
+
+static void
+wl_io_client_set_paused(struct wl_io_client *client, int paused)
+{
+	struct wl_io_thread *thread = client->thread;
+
+	if (paused)
+		client->flags |= WL_IO_CLIENT_PAUSED;
+	else
+		client->flags &= ~WL_IO_CLIENT_PAUSED;
+
+	if (client->source == NULL || (client->flags & WL_IO_CLIENT_BLOCKED))
+		return;
+
+	wl_event_loop_update_source(thread->loop, client->source,
+				    paused ? 0 : WL_EVENT_READABLE);
+	if (!paused)
+		wl_event_source_check(client->source);
+}
+
+/* Give blocked clients another go now that the compositor thread has
+ * made room.  A client that fills the ring again goes back on the
+ * list, and the rest wait for the next wakeup. */
+
+static void
+wl_io_thread_unblock(struct wl_io_thread *thread)
+{
+	struct wl_io_client *client;
+	uint32_t type;
+
+	while (thread->blocked_list.next != &thread->blocked_list) {
+		client = container_of(thread->blocked_list.next,
+				      struct wl_io_client, blocked_link);
+		wl_list_remove(&client->blocked_link);
+		client->flags &= ~WL_IO_CLIENT_BLOCKED;
+
+		if (client->flags &
+		    (WL_IO_CLIENT_REMOVED | WL_IO_CLIENT_FAILED)) {
+			if (client->flags & WL_IO_CLIENT_REMOVED)
+				type = WL_IO_REMOVED;
+			else
+				type = WL_IO_ERROR;
+			if (wl_io_client_push(client, type, NULL, 0) < 0)
+				break;
+			continue;
+		}
+
+		if (!(client->flags & WL_IO_CLIENT_PAUSED)) {
+			wl_event_loop_update_source(thread->loop,
+						    client->source,
+						    WL_EVENT_READABLE);
+			wl_event_source_check(client->source);
+		}
+	}
+}
+
+static void
+wl_io_thread_wake(int fd, uint32_t mask, void *data)
+{
+	struct wl_io_thread *thread = data;
+	struct wl_io_record *record;
+	struct wl_io_client *client;
+	uint64_t count;
+
+	read(fd, &count, sizeof count);
+
+	while ((record = wl_io_ring_peek(&thread->control)) != NULL) {
+		client = record->client;
+		switch (record->type) {
+		case WL_IO_ADD:
+			wl_io_client_add(thread, client);
+			break;
+		case WL_IO_REMOVE:
+			wl_io_client_remove(client);
+			break;
+		case WL_IO_PAUSE:
+			wl_io_client_set_paused(client, 1);
+			break;
+		case WL_IO_RESUME:
+			wl_io_client_set_paused(client, 0);
+			break;
+		case WL_IO_QUIT:
+			thread->run = 0;
+			break;
+		}
+		wl_io_ring_consume(&thread->control, record);
+	}
+
+	wl_io_thread_unblock(thread);
+}
+
+static void
+wl_io_thread_flush(void *data)
+{
+	struct wl_io_thread *thread = data;
+
+	if (!thread->pushed)
+		return;
+
+	thread->pushed = 0;
+	if (!__atomic_exchange_n(&thread->notified, 1, __ATOMIC_ACQ_REL))
+		wl_io_signal(thread->notify_fd);
+}
+
+static void *
+wl_io_thread_run(void *data)
+{
+	struct wl_io_thread *thread = data;
+	struct wl_io_client *client;
+
+	while (thread->run)
+		wl_event_loop_wait(thread->loop);
+
+	while (thread->client_list.next != &thread->client_list) {
+		client = container_of(thread->client_list.next,
+				      struct wl_io_client, link);
+		wl_list_remove(&client->link);
+		if (client->source)
+			wl_event_loop_remove_source(thread->loop,
+						    client->source);
+		wl_connection_destroy(client->connection);
+		free(client);
+	}
+
+	return NULL;
+}
+
+/* Compositor thread: hand the messages in the ring to the owners of
+ * the clients, in order. */
+
+static void
+wl_io_thread_notify(int fd, uint32_t mask, void *data)
+{
+	struct wl_io_thread *thread = data;
+	const struct wl_io_interface *interface = thread->pool->interface;
+	struct wl_io_ring *ring = &thread->messages;
+	struct wl_io_record *record;
+	struct wl_io_client *client;
+	uint64_t count;
+	int budget;
+
+	if (mask & WL_EVENT_READABLE)
+		read(fd, &count, sizeof count);
+	__atomic_exchange_n(&thread->notified, 0, __ATOMIC_ACQ_REL);
+
+	budget = WL_IO_DISPATCH_BUDGET;
+	while ((record = wl_io_ring_peek(ring)) != NULL) {
+		if (record->type != WL_IO_PAD && budget-- == 0) {
+			wl_event_source_check(thread->notify_source);
+			break;
+		}
+
+		client = record->client;
+		switch (record->type) {
+		case WL_IO_MESSAGE:
+			if (client->data)
+				interface->dispatch(client->data,
+						    (const uint32_t *) (record + 1));
+			break;
+		case WL_IO_ERROR:
+			if (client->data)
+				interface->error(client->data);
+			break;
+		case WL_IO_REMOVED:
+			free(client);
+			break;
+		}
+		wl_io_ring_consume(ring, record);
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED))
+		wl_io_signal(thread->wake_fd);
+}
+
+static void
+wl_io_thread_fini(struct wl_io_thread *thread)
+{
+	if (thread->started) {
+		wl_io_thread_send(thread, NULL, WL_IO_QUIT);
+		pthread_join(thread->thread, NULL);
+	}
+
+	if (thread->notify_source)
+		wl_event_loop_remove_source(thread->pool->loop,
+					    thread->notify_source);
+	if (thread->wake_source)
+		wl_event_loop_remove_source(thread->loop,
+					    thread->wake_source);
+	if (thread->loop)
+		wl_event_loop_destroy(thread->loop);
+	if (thread->wake_fd >= 0)
+		close(thread->wake_fd);
+	if (thread->notify_fd >= 0)
+		close(thread->notify_fd);
+	free(thread->control.data);
+	free(thread->messages.data);
+}
+
+static int
+wl_io_thread_init(struct wl_io_pool *pool, struct wl_io_thread *thread)
+{
+	thread->pool = pool;
+	thread->wake_fd = -1;
+	thread->notify_fd = -1;
+	wl_list_init(&thread->client_list);
+	wl_list_init(&thread->blocked_list);
+
+	if (wl_io_ring_init(&thread->control, WL_IO_CONTROL_RING_SIZE) < 0 ||
+	    wl_io_ring_init(&thread->messages, WL_IO_MESSAGE_RING_SIZE) < 0)
+		return -1;
+
+	thread->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	thread->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (thread->wake_fd < 0 || thread->notify_fd < 0)
+		return -1;
+
+	thread->loop = wl_event_loop_create();
+	if (thread->loop == NULL)
+		return -1;
+	wl_event_loop_set_flush_func(thread->loop,
+				     wl_io_thread_flush, thread);
+
+	thread->wake_source = wl_event_loop_add_fd(thread->loop,
+						   thread->wake_fd,
+						   WL_EVENT_READABLE,
+						   wl_io_thread_wake, thread);
+	thread->notify_source = wl_event_loop_add_fd(pool->loop,
+						     thread->notify_fd,
+						     WL_EVENT_READABLE,
+						     wl_io_thread_notify,
+						     thread);
+	if (thread->wake_source == NULL || thread->notify_source == NULL)
+		return -1;
+
+	thread->run = 1;
+	if (pthread_create(&thread->thread, NULL,
+			   wl_io_thread_run, thread) != 0)
+		return -1;
+	thread->started = 1;
+
+	return 0;
+}
+
+struct wl_io_pool *
+wl_io_pool_create(struct wl_event_loop *loop, int count,
+		  const struct wl_io_interface *interface)
+{
+	struct wl_io_pool *pool;
+	sigset_t all, saved;
+	int i, ret;
+
+	pool = malloc(sizeof *pool);
+	if (pool == NULL)
+		return NULL;
+
+	pool->loop = loop;
+	pool->interface = interface;
+	pool->threads = calloc(count, sizeof pool->threads[0]);
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	/* Signals are handled on the compositor thread, through its
+	 * event loop; the I/O threads start out with all of them
+	 * blocked. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	for (i = 0, ret = 0; i < count && ret == 0; i++)
+		ret = wl_io_thread_init(pool, &pool->threads[i]);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	pool->count = i;
+	if (ret < 0) {
+		fprintf(stderr, "failed to start I/O threads\n");
+		wl_io_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void
+wl_io_pool_destroy(struct wl_io_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->count; i++)
+		wl_io_thread_fini(&pool->threads[i]);
+
+	free(pool->threads);
+	free(pool);
+}
+
+struct wl_io_client *
+wl_io_client_create(struct wl_io_pool *pool, int fd, void *data)
+{
+	struct wl_io_thread *thread;
+	struct wl_io_client *client;
+	int i;
+
+	client = malloc(sizeof *client);
+	if (client == NULL)
+		return NULL;
+
+	memset(client, 0, sizeof *client);
+
+	/* Shard by load: new clients go to the thread with the fewest. */
+	thread = &pool->threads[0];
+	for (i = 1; i < pool->count; i++)
+		if (pool->threads[i].client_count < thread->client_count)
+			thread = &pool->threads[i];
+
+	client->thread = thread;
+	client->fd = fd;
+	client->data = data;
+	thread->client_count++;
+	wl_io_thread_send(thread, client, WL_IO_ADD);
+
+	return client;
+}
+
+/* The client is freed once the I/O thread has let go of it. */
+
+void
+wl_io_client_destroy(struct wl_io_client *client)
+{
+	client->data = NULL;
+	client->thread->client_count--;
+	wl_io_thread_send(client->thread, client, WL_IO_REMOVE);
+}
+
+void
+wl_io_client_pause(struct wl_io_client *client)
+{
+	wl_io_thread_send(client->thread, client, WL_IO_PAUSE);
+}
+
+void
+wl_io_client_resume(struct wl_io_client *client)
+{
+	wl_io_thread_send(client->thread, client, WL_IO_RESUME);
+}
@@ -0,0 +1,35 @@
+#ifndef _IO_THREAD_H_
+#define _IO_THREAD_H_
+
+/* A pool of threads that read client sockets on behalf of the
+ * compositor thread.  Each thread owns a shard of the connections,
+ * reads and frames their requests and passes every complete message
+ * on through a single-producer/single-consumer ring.  The compositor
+ * thread drains the rings from its event loop and gets the messages
+ * of a client in the order they were sent. */
+
+struct wl_io_pool;
+struct wl_io_client;
+struct wl_event_loop;
+
+struct wl_io_interface {
+	/* A complete request.  The message, header included, stays
+	 * valid until the callback returns. */
+	void (*dispatch)(void *data, const uint32_t *message);
+	/* The client hung up or sent something we can't frame.  No
+	 * more messages follow; the client still has to be destroyed
+	 * with wl_io_client_destroy(). */
+	void (*error)(void *data);
+};
+
+struct wl_io_pool *wl_io_pool_create(struct wl_event_loop *loop, int count,
+				     const struct wl_io_interface *interface);
+void wl_io_pool_destroy(struct wl_io_pool *pool);
+
+struct wl_io_client *wl_io_client_create(struct wl_io_pool *pool,
+					 int fd, void *data);
+void wl_io_client_destroy(struct wl_io_client *client);
+void wl_io_client_pause(struct wl_io_client *client);
+void wl_io_client_resume(struct wl_io_client *client);
+
+#endif
@@ -70,8 +70,11 @@ event_handler(struct wl_display *display,
 {
 	struct pointer *pointer = data;
 
-	if (pointer->pointer != NULL && id == pointer->pointer->id && opcode == 0)
+	if (pointer->pointer != NULL && id == pointer->pointer->id &&
+	    opcode == WL_INPUT_DEVICE_MOTION) {
 		wl_surface_map(pointer->surface, arg1, arg2, pointer->width, pointer->height);
+		wl_display_commit(display, 0);
+	}
 }
 
 int main(int argc, char *argv[])
@@ -102,8 +105,15 @@ int main(int argc, char *argv[])
 	s = draw_pointer(pointer.width, pointer.height);
 	buffer = wl_buffer_create_from_cairo_surface(display, s);
 
-	wl_surface_attach_buffer(pointer.surface, buffer);
+	wl_surface_attach_buffer(pointer.surface, buffer,
+				 WL_SURFACE_FORMAT_ARGB8888);
 	wl_surface_map(pointer.surface, 512, 384, pointer.width, pointer.height);
+	/* The pointer follows motion over every surface and must not
+	 * take the events itself. */
+	wl_surface_set_input_region(pointer.surface, NULL, 0);
+	if (pointer.pointer != NULL)
+		wl_input_device_watch(pointer.pointer);
+	wl_display_commit(display, 0);
 
 	wl_display_set_event_handler(display, event_handler, &pointer);
 
@@ -0,0 +1,422 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "wayland.h"
+
+/* Regions are sets of non-overlapping boxes in y-x banded order, the
+ * way X and pixman keep them: boxes come in bands that share the
+ * same y1 and y2, bands are sorted top to bottom and the boxes in a
+ * band left to right.  Boxes in a band never touch, and a band is
+ * merged into the one above when they touch and have the same
+ * boxes, so every region has exactly one representation.
+ *
+ * All three set operations are one sweep over the bands of both
+ * operands, combining the spans of each y interval where neither
+ * operand changes. */
+
+enum {
+	WL_REGION_UNION,
+	WL_REGION_INTERSECT,
+	WL_REGION_SUBTRACT
+};
+
+WL_EXPORT void
+wl_region_init(struct wl_region *region)
+{
+	memset(region, 0, sizeof *region);
+}
+
+WL_EXPORT int
+wl_region_init_rect(struct wl_region *region,
+		    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	wl_region_init(region);
+	if (width <= 0 || height <= 0)
+		return 0;
+
+	region->boxes = malloc(sizeof *region->boxes);
+	if (region->boxes == NULL)
+		return -1;
+
+	region->boxes[0].x1 = x;
+	region->boxes[0].y1 = y;
+	region->boxes[0].x2 = x + width;
+	region->boxes[0].y2 = y + height;
+	region->count = 1;
+	region->alloc = 1;
+	region->extents = region->boxes[0];
+
+	return 0;
+}
+
+WL_EXPORT void
+wl_region_fini(struct wl_region *region)
+{
+	free(region->boxes);
+}
+
+WL_EXPORT void
+wl_region_clear(struct wl_region *region)
+{
+	region->count = 0;
+	memset(&region->extents, 0, sizeof region->extents);
+}
+
+WL_EXPORT int
+wl_region_is_empty(const struct wl_region *region)
+{
+	return region->count == 0;
+}
+
+/* Boxes are sorted by band, so the scan stops at the first band
+ * below the point. */
+
+WL_EXPORT int
+wl_region_contains_point(const struct wl_region *region,
+			 int32_t x, int32_t y)
+{
+	const struct wl_box *box, *end;
+
+	if (region->count == 0 ||
+	    x < region->extents.x1 || x >= region->extents.x2 ||
+	    y < region->extents.y1 || y >= region->extents.y2)
+		return 0;
+
+	end = region->boxes + region->count;
+	for (box = region->boxes; box < end && box->y1 <= y; box++)
+		if (y < box->y2 && box->x1 <= x && x < box->x2)
+			return 1;
+
+	return 0;
+}
+
+WL_EXPORT int
+wl_region_copy(struct wl_region *dst, const struct wl_region *src)
+{
+	struct wl_box *boxes;
+
+	if (src->count > dst->alloc) {
+		boxes = realloc(dst->boxes, src->count * sizeof *boxes);
+		if (boxes == NULL)
+			return -1;
+		dst->boxes = boxes;
+		dst->alloc = src->count;
+	}
+
+	memcpy(dst->boxes, src->boxes, src->count * sizeof *src->boxes);
+	dst->count = src->count;
+	dst->extents = src->extents;
+
+	return 0;
+}
+
+WL_EXPORT void
+wl_region_translate(struct wl_region *region, int32_t dx, int32_t dy)
+{
+	int i;
+
+	for (i = 0; i < region->count; i++) {
+		region->boxes[i].x1 += dx;
+		region->boxes[i].y1 += dy;
+		region->boxes[i].x2 += dx;
+		region->boxes[i].y2 += dy;
+	}
+
+	if (region->count > 0) {
+		region->extents.x1 += dx;
+		region->extents.y1 += dy;
+		region->extents.x2 += dx;
+		region->extents.y2 += dy;
+	}
+}
+
+static int
+wl_region_append(struct wl_region *region,
+		 int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	struct wl_box *boxes;
+	int alloc;
+
+	if (region->count == region->alloc) {
+		alloc = region->alloc ? region->alloc * 2 : 8;
+		boxes = realloc(region->boxes, alloc * sizeof *boxes);
+		if (boxes == NULL)
+			return -1;
+		region->boxes = boxes;
+		region->alloc = alloc;
+	}
+
+	region->boxes[region->count].x1 = x1;
+	region->boxes[region->count].y1 = y1;
+	region->boxes[region->count].x2 = x2;
+	region->boxes[region->count].y2 = y2;
+	region->count++;
+
+	return 0;
+}
+
+/* The spans of one band of the result: walk the edges of both
+ * operands' spans left to right and emit a box wherever the
+ * operation turns on and off. */
+
+static int
+wl_region_combine(struct wl_region *region, int32_t y1, int32_t y2,
+		  const struct wl_box *a, int na,
+		  const struct wl_box *b, int nb, int op)
+{
+	int i = 0, j = 0, ina = 0, inb = 0, in, was = 0;
+	int32_t xa, xb, x, start = 0;
+
+	while (i < na || j < nb) {
+		xa = i < na ? (ina ? a[i].x2 : a[i].x1) : INT32_MAX;
+		xb = j < nb ? (inb ? b[j].x2 : b[j].x1) : INT32_MAX;
+		x = xa < xb ? xa : xb;
+		if (xa == x) {
+			i += ina;
+			ina = !ina;
+		}
+		if (xb == x) {
+			j += inb;
+			inb = !inb;
+		}
+
+		switch (op) {
+		case WL_REGION_UNION:
+			in = ina || inb;
+			break;
+		case WL_REGION_INTERSECT:
+			in = ina && inb;
+			break;
+		default:
+			in = ina && !inb;
+			break;
+		}
+
+		if (in && !was)
+			start = x;
+		else if (!in && was &&
+			 wl_region_append(region, start, y1, x, y2) < 0)
+			return -1;
+		was = in;
+	}
+
+	return 0;
+}
+
+/* Merge the band starting at box index band into the one before it
+ * (starting at prev) if they touch and have the same spans. */
+
+static void
+wl_region_coalesce(struct wl_region *region, int prev, int band)
+{
+	int i, n = band - prev;
+
+	if (prev < 0 || region->count - band != n ||
+	    region->boxes[prev].y2 != region->boxes[band].y1)
+		return;
+
+	for (i = 0; i < n; i++)
+		if (region->boxes[prev + i].x1 != region->boxes[band + i].x1 ||
+		    region->boxes[prev + i].x2 != region->boxes[band + i].x2)
+			return;
+
+	for (i = 0; i < n; i++)
+		region->boxes[prev + i].y2 = region->boxes[band].y2;
+	region->count = band;
+}
+
+static int
+wl_region_band_end(const struct wl_region *region, int start)
+{
+	int end = start;
+
+	while (end < region->count &&
+	       region->boxes[end].y1 == region->boxes[start].y1)
+		end++;
+
+	return end;
+}
+
+static int
+wl_region_op(struct wl_region *dst, const struct wl_region *a,
+	     const struct wl_region *b, int op)
+{
+	struct wl_region result;
+	int ia = 0, ib = 0, ea, eb, prev = -1, band, i;
+	int32_t y, top, bottom, ay1, ay2, by1, by2;
+
+	wl_region_init(&result);
+	ea = wl_region_band_end(a, 0);
+	eb = wl_region_band_end(b, 0);
+	y = INT32_MIN;
+
+	while (ia < a->count || ib < b->count) {
+		ay1 = ia < a->count ? a->boxes[ia].y1 : INT32_MAX;
+		ay2 = ia < a->count ? a->boxes[ia].y2 : INT32_MAX;
+		by1 = ib < b->count ? b->boxes[ib].y1 : INT32_MAX;
+		by2 = ib < b->count ? b->boxes[ib].y2 : INT32_MAX;
+
+		top = ay1 < by1 ? ay1 : by1;
+		if (top < y)
+			top = y;
+		bottom = ay1 > top ? ay1 : ay2;
+		if (by1 > top && by1 < bottom)
+			bottom = by1;
+		else if (by1 <= top && by2 < bottom)
+			bottom = by2;
+
+		band = result.count;
+		if (wl_region_combine(&result, top, bottom,
+				      a->boxes + ia,
+				      ay1 <= top ? ea - ia : 0,
+				      b->boxes + ib,
+				      by1 <= top ? eb - ib : 0, op) < 0) {
+			wl_region_fini(&result);
+			return -1;
+		}
+		if (result.count > band) {
+			wl_region_coalesce(&result, prev, band);
+			prev = result.count > band ? band : prev;
+		}
+
+		y = bottom;
+		if (ay2 <= y) {
+			ia = ea;
+			ea = wl_region_band_end(a, ia);
+		}
+		if (by2 <= y) {
+			ib = eb;
+			eb = wl_region_band_end(b, ib);
+		}
+	}
+
+	if (result.count > 0) {
+		result.extents = result.boxes[0];
+		result.extents.y2 = result.boxes[result.count - 1].y2;
+		for (i = 1; i < result.count; i++) {
+			if (result.boxes[i].x1 < result.extents.x1)
+				result.extents.x1 = result.boxes[i].x1;
+			if (result.boxes[i].x2 > result.extents.x2)
+				result.extents.x2 = result.boxes[i].x2;
+		}
+	}
+
+	wl_region_fini(dst);
+	*dst = result;
+
+	return 0;
+}
+
+/* dst may be one of the operands.  These fail only when out of
+ * memory, leaving dst as it was. */
+
+WL_EXPORT int
+wl_region_union(struct wl_region *dst,
+		const struct wl_region *a, const struct wl_region *b)
+{
+	return wl_region_op(dst, a, b, WL_REGION_UNION);
+}
+
+WL_EXPORT int
+wl_region_intersect(struct wl_region *dst,
+		    const struct wl_region *a, const struct wl_region *b)
+{
+	return wl_region_op(dst, a, b, WL_REGION_INTERSECT);
+}
+
+WL_EXPORT int
+wl_region_subtract(struct wl_region *dst,
+		   const struct wl_region *a, const struct wl_region *b)
+{
+	return wl_region_op(dst, a, b, WL_REGION_SUBTRACT);
+}
+
+static int
+wl_region_op_rect(struct wl_region *region,
+		  int32_t x, int32_t y, int32_t width, int32_t height, int op)
+{
+	struct wl_region rect;
+	int ret;
+
+	if (wl_region_init_rect(&rect, x, y, width, height) < 0)
+		return -1;
+	ret = wl_region_op(region, region, &rect, op);
+	wl_region_fini(&rect);
+
+	return ret;
+}
+
+WL_EXPORT int
+wl_region_union_rect(struct wl_region *region,
+		     int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	if (width <= 0 || height <= 0)
+		return 0;
+
+	return wl_region_op_rect(region, x, y, width, height,
+				 WL_REGION_UNION);
+}
+
+WL_EXPORT int
+wl_region_intersect_rect(struct wl_region *region,
+			 int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	return wl_region_op_rect(region, x, y, width, height,
+				 WL_REGION_INTERSECT);
+}
+
+/* Damage to an output.  If we run out of memory accumulating it, we
+ * fall back to damaging the whole output, which needs no
+ * allocation. */
+
+WL_EXPORT void
+wl_damage_all(struct wl_damage *damage)
+{
+	wl_region_fini(&damage->region);
+	if (wl_region_init_rect(&damage->region, 0, 0,
+				damage->width, damage->height) < 0)
+		fprintf(stderr, "out of memory tracking damage\n");
+}
+
+WL_EXPORT int
+wl_damage_init(struct wl_damage *damage, int32_t width, int32_t height)
+{
+	damage->width = width;
+	damage->height = height;
+
+	return wl_region_init_rect(&damage->region, 0, 0, width, height);
+}
+
+WL_EXPORT void
+wl_damage_fini(struct wl_damage *damage)
+{
+	wl_region_fini(&damage->region);
+}
+
+WL_EXPORT void
+wl_damage_add(struct wl_damage *damage,
+	      int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	if (wl_region_union_rect(&damage->region, x, y, width, height) < 0)
+		wl_damage_all(damage);
+}
+
+WL_EXPORT void
+wl_damage_add_region(struct wl_damage *damage,
+		     const struct wl_region *region)
+{
+	if (wl_region_union(&damage->region, &damage->region, region) < 0)
+		wl_damage_all(damage);
+}
+
+/* Clip the damage to the output, before drawing it. */
+
+WL_EXPORT void
+wl_damage_clip(struct wl_damage *damage)
+{
+	if (wl_region_intersect_rect(&damage->region, 0, 0,
+				     damage->width, damage->height) < 0)
+		wl_damage_all(damage);
+}
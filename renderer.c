@@ -0,0 +1,797 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "wayland.h"
+
+/* Tiled software repaint.  The target is cut into tiles and only
+ * tiles that were damaged since the last frame are redrawn, and
+ * within those only the damaged boxes, so a blinking cursor costs a
+ * few hundred pixels rather than a tile.  Each frame the layers are
+ * binned into the damaged tiles they touch, so a tile only looks at
+ * the surfaces that cover it, and the tiles are then handed out to a
+ * pool of worker threads, with the calling thread pitching in.
+ * wl_renderer_render() returns once all of them are done, so the
+ * frame can be presented right after.
+ *
+ * Before that, a pass from the top layer down works out what of each
+ * layer is visible: whatever a layer's opaque region covers is taken
+ * out of the damage left for the layers below, and is copied rather
+ * than blended.  A maximized opaque window costs one copy no matter
+ * how many surfaces are stacked under it.
+ *
+ * With a front buffer, every tile is copied there as soon as it is
+ * finished, which spreads the copy out over the threads too. */
+
+/* Wide tiles keep the rows long enough for the hardware prefetcher;
+ * 128x128 tiles were several times slower to fill and copy than
+ * 512x64 ones. */
+#define TILE_WIDTH 512
+#define TILE_HEIGHT 64
+
+struct wl_renderer {
+	struct wl_image target, front;
+	int has_front;
+	int tiles_x, tiles_y;
+	struct wl_damage damage;
+	uint8_t *damaged;
+
+	/* The tiles to draw this frame, and for each tile the
+	 * indices of the layers that touch it, bottom to top. */
+	int *tiles, tile_count;
+	int *bins, *bin_counts, bin_alloc;
+	const struct wl_renderer_layer *layers;
+	uint32_t background;
+
+	/* What of each layer is visible this frame. */
+	struct wl_cull cull;
+
+	pthread_t *threads;
+	int thread_count;
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond, done_cond;
+	uint32_t generation;
+	int busy, quit;
+	int next_tile;
+};
+
+static void
+wl_renderer_tile_rect(struct wl_renderer *renderer, int tile,
+		      struct wl_map *rect)
+{
+	rect->x = (tile % renderer->tiles_x) * TILE_WIDTH;
+	rect->y = (tile / renderer->tiles_x) * TILE_HEIGHT;
+	rect->width = TILE_WIDTH;
+	rect->height = TILE_HEIGHT;
+}
+
+static int
+wl_map_intersect(struct wl_map *dst,
+		 const struct wl_map *a, const struct wl_map *b)
+{
+	int32_t x0, y0, x1, y1;
+
+	x0 = a->x > b->x ? a->x : b->x;
+	y0 = a->y > b->y ? a->y : b->y;
+	x1 = a->x + a->width < b->x + b->width ?
+		a->x + a->width : b->x + b->width;
+	y1 = a->y + a->height < b->y + b->height ?
+		a->y + a->height : b->y + b->height;
+	if (x0 >= x1 || y0 >= y1)
+		return 0;
+
+	dst->x = x0;
+	dst->y = y0;
+	dst->width = x1 - x0;
+	dst->height = y1 - y0;
+
+	return 1;
+}
+
+/* Draw the parts of region inside the tile into dst, from a layer or
+ * the background when layer is NULL.  Bands are sorted, so stop at
+ * the first one below the tile. */
+
+static void
+wl_renderer_draw_region(struct wl_renderer *renderer, struct wl_image *dst,
+			const struct wl_region *region,
+			const struct wl_map *tile,
+			const struct wl_renderer_layer *layer, uint32_t op)
+{
+	const struct wl_box *box;
+	struct wl_map box_rect, rect;
+	int i;
+
+	for (i = 0; i < region->count; i++) {
+		box = &region->boxes[i];
+		if (box->y1 >= tile->y + tile->height)
+			break;
+		box_rect.x = box->x1;
+		box_rect.y = box->y1;
+		box_rect.width = box->x2 - box->x1;
+		box_rect.height = box->y2 - box->y1;
+		if (!wl_map_intersect(&rect, tile, &box_rect))
+			continue;
+
+		if (layer == NULL)
+			wl_composite_fill(dst, NULL, rect.x, rect.y,
+					  rect.width, rect.height,
+					  renderer->background);
+		else
+			wl_composite_image(dst, &rect,
+					   layer->x, layer->y, &layer->image,
+					   op);
+	}
+}
+
+static void
+wl_renderer_draw_tile(struct wl_renderer *renderer, int tile)
+{
+	const struct wl_renderer_layer *layer;
+	const struct wl_cull_item *item;
+	struct wl_renderer_layer frame;
+	struct wl_map rect;
+	int i, *bin;
+
+	wl_renderer_tile_rect(renderer, tile, &rect);
+	wl_renderer_draw_region(renderer, &renderer->target,
+				&renderer->cull.uncovered, &rect, NULL, 0);
+
+	bin = renderer->bins + tile * renderer->bin_alloc;
+	for (i = 0; i < renderer->bin_counts[tile]; i++) {
+		layer = &renderer->layers[bin[i]];
+		item = &renderer->cull.items[bin[i]];
+		wl_renderer_draw_region(renderer, &renderer->target,
+					&item->copy, &rect,
+					layer, WL_COMPOSITE_SRC);
+		wl_renderer_draw_region(renderer, &renderer->target,
+					&item->blend, &rect,
+					layer, layer->op);
+	}
+
+	if (!renderer->has_front)
+		return;
+
+	memset(&frame, 0, sizeof frame);
+	frame.image = renderer->target;
+	wl_renderer_draw_region(renderer, &renderer->front,
+				&renderer->damage.region, &rect,
+				&frame, WL_COMPOSITE_SRC);
+}
+
+static void
+wl_renderer_draw_tiles(struct wl_renderer *renderer)
+{
+	int i;
+
+	while (i = __sync_fetch_and_add(&renderer->next_tile, 1),
+	       i < renderer->tile_count)
+		wl_renderer_draw_tile(renderer, renderer->tiles[i]);
+}
+
+static void *
+wl_renderer_thread(void *data)
+{
+	struct wl_renderer *renderer = data;
+	uint32_t generation = 0;
+
+	pthread_mutex_lock(&renderer->mutex);
+	while (1) {
+		while (!renderer->quit && renderer->generation == generation)
+			pthread_cond_wait(&renderer->start_cond,
+					  &renderer->mutex);
+		if (renderer->quit)
+			break;
+		generation = renderer->generation;
+		pthread_mutex_unlock(&renderer->mutex);
+
+		wl_renderer_draw_tiles(renderer);
+
+		pthread_mutex_lock(&renderer->mutex);
+		if (--renderer->busy == 0)
+			pthread_cond_signal(&renderer->done_cond);
+	}
+	pthread_mutex_unlock(&renderer->mutex);
+
+	return NULL;
+}
+
+/* Render into target using up to thread_count threads, the caller's
+ * included.  front may be NULL. */
+
+WL_EXPORT struct wl_renderer *
+wl_renderer_create(struct wl_image *target, struct wl_image *front,
+		   int thread_count)
+{
+	struct wl_renderer *renderer;
+	sigset_t all, saved;
+	int i, count;
+
+	renderer = malloc(sizeof *renderer);
+	if (renderer == NULL)
+		return NULL;
+
+	memset(renderer, 0, sizeof *renderer);
+	wl_region_init(&renderer->damage.region);
+	wl_cull_init(&renderer->cull);
+	renderer->target = *target;
+	if (front != NULL) {
+		renderer->front = *front;
+		renderer->has_front = 1;
+	}
+	renderer->tiles_x = (target->width + TILE_WIDTH - 1) / TILE_WIDTH;
+	renderer->tiles_y = (target->height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+	count = renderer->tiles_x * renderer->tiles_y;
+	renderer->damaged = malloc(count);
+	renderer->tiles = malloc(count * sizeof *renderer->tiles);
+	renderer->bin_counts = malloc(count * sizeof *renderer->bin_counts);
+	if (renderer->damaged == NULL || renderer->tiles == NULL ||
+	    renderer->bin_counts == NULL) {
+		wl_renderer_destroy(renderer);
+		return NULL;
+	}
+	if (wl_damage_init(&renderer->damage,
+			   target->width, target->height) < 0) {
+		wl_renderer_destroy(renderer);
+		return NULL;
+	}
+
+	pthread_mutex_init(&renderer->mutex, NULL);
+	pthread_cond_init(&renderer->start_cond, NULL);
+	pthread_cond_init(&renderer->done_cond, NULL);
+
+	if (thread_count < 1)
+		thread_count = 1;
+	renderer->threads = calloc(thread_count, sizeof *renderer->threads);
+	if (renderer->threads == NULL) {
+		wl_renderer_destroy(renderer);
+		return NULL;
+	}
+
+	/* Like the I/O threads, leave signals to the compositor
+	 * thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	for (i = 0; i < thread_count - 1; i++) {
+		if (pthread_create(&renderer->threads[i], NULL,
+				   wl_renderer_thread, renderer) != 0) {
+			fprintf(stderr, "failed to start render thread: %m\n");
+			break;
+		}
+		renderer->thread_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	return renderer;
+}
+
+WL_EXPORT void
+wl_renderer_destroy(struct wl_renderer *renderer)
+{
+	int i;
+
+	if (renderer->threads != NULL) {
+		pthread_mutex_lock(&renderer->mutex);
+		renderer->quit = 1;
+		pthread_cond_broadcast(&renderer->start_cond);
+		pthread_mutex_unlock(&renderer->mutex);
+		for (i = 0; i < renderer->thread_count; i++)
+			pthread_join(renderer->threads[i], NULL);
+
+		pthread_mutex_destroy(&renderer->mutex);
+		pthread_cond_destroy(&renderer->start_cond);
+		pthread_cond_destroy(&renderer->done_cond);
+	}
+
+	free(renderer->threads);
+	wl_damage_fini(&renderer->damage);
+	wl_cull_fini(&renderer->cull);
+	free(renderer->damaged);
+	free(renderer->tiles);
+	free(renderer->bins);
+	free(renderer->bin_counts);
+	free(renderer);
+}
+
+WL_EXPORT void
+wl_renderer_damage(struct wl_renderer *renderer,
+		   int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	wl_damage_add(&renderer->damage, x, y, width, height);
+}
+
+WL_EXPORT void
+wl_renderer_damage_region(struct wl_renderer *renderer,
+			  const struct wl_region *region)
+{
+	wl_damage_add_region(&renderer->damage, region);
+}
+
+WL_EXPORT struct wl_damage *
+wl_renderer_get_damage(struct wl_renderer *renderer)
+{
+	return &renderer->damage;
+}
+
+static void
+wl_renderer_mark_tiles(struct wl_renderer *renderer)
+{
+	const struct wl_box *box;
+	int32_t tx0, ty0, tx1, ty1, tx, ty;
+	int i;
+
+	memset(renderer->damaged, 0, renderer->tiles_x * renderer->tiles_y);
+	for (i = 0; i < renderer->damage.region.count; i++) {
+		box = &renderer->damage.region.boxes[i];
+		tx0 = box->x1 / TILE_WIDTH;
+		ty0 = box->y1 / TILE_HEIGHT;
+		tx1 = (box->x2 + TILE_WIDTH - 1) / TILE_WIDTH;
+		ty1 = (box->y2 + TILE_HEIGHT - 1) / TILE_HEIGHT;
+		if (tx1 > renderer->tiles_x)
+			tx1 = renderer->tiles_x;
+		if (ty1 > renderer->tiles_y)
+			ty1 = renderer->tiles_y;
+
+		for (ty = ty0; ty < ty1; ty++)
+			for (tx = tx0; tx < tx1; tx++)
+				renderer->damaged[ty * renderer->tiles_x + tx] = 1;
+	}
+}
+
+WL_EXPORT void
+wl_cull_init(struct wl_cull *cull)
+{
+	memset(cull, 0, sizeof *cull);
+	wl_region_init(&cull->uncovered);
+}
+
+WL_EXPORT void
+wl_cull_fini(struct wl_cull *cull)
+{
+	int i;
+
+	for (i = 0; i < cull->alloc; i++) {
+		wl_region_fini(&cull->items[i].copy);
+		wl_region_fini(&cull->items[i].blend);
+	}
+	free(cull->items);
+	wl_region_fini(&cull->uncovered);
+}
+
+/* Start a new stack.  The items' regions are kept for reuse. */
+
+WL_EXPORT void
+wl_cull_clear(struct wl_cull *cull)
+{
+	cull->count = 0;
+}
+
+/* Add an item on top of the stack. */
+
+WL_EXPORT int
+wl_cull_add(struct wl_cull *cull, const struct wl_map *rect,
+	    int32_t x, int32_t y, const struct wl_region *opaque, void *data)
+{
+	struct wl_cull_item *items, *item;
+	int i, alloc;
+
+	if (cull->count == cull->alloc) {
+		alloc = cull->alloc ? cull->alloc * 2 : 16;
+		items = realloc(cull->items, alloc * sizeof *items);
+		if (items == NULL)
+			return -1;
+		for (i = cull->alloc; i < alloc; i++) {
+			wl_region_init(&items[i].copy);
+			wl_region_init(&items[i].blend);
+		}
+		cull->items = items;
+		cull->alloc = alloc;
+	}
+
+	item = &cull->items[cull->count++];
+	item->rect = *rect;
+	item->x = x;
+	item->y = y;
+	item->opaque = opaque;
+	item->data = data;
+
+	return 0;
+}
+
+/* Walk the items top down, handing each the damage that's still
+ * uncovered within its rectangle, and taking out what its opaque
+ * region covers. */
+
+WL_EXPORT int
+wl_cull_run(struct wl_cull *cull, const struct wl_region *damage)
+{
+	struct wl_cull_item *item;
+	struct wl_region opaque;
+	int i, ret = -1;
+
+	if (wl_region_copy(&cull->uncovered, damage) < 0)
+		return -1;
+
+	wl_region_init(&opaque);
+	for (i = cull->count - 1; i >= 0; i--) {
+		item = &cull->items[i];
+		wl_region_clear(&item->copy);
+		wl_region_clear(&item->blend);
+		if (wl_region_is_empty(&cull->uncovered) ||
+		    item->rect.width <= 0 || item->rect.height <= 0)
+			continue;
+
+		if (wl_region_copy(&item->blend, &cull->uncovered) < 0 ||
+		    wl_region_intersect_rect(&item->blend,
+					     item->rect.x, item->rect.y,
+					     item->rect.width,
+					     item->rect.height) < 0)
+			goto out;
+		if (item->opaque == NULL || wl_region_is_empty(item->opaque) ||
+		    wl_region_is_empty(&item->blend))
+			continue;
+
+		if (wl_region_copy(&opaque, item->opaque) < 0)
+			goto out;
+		wl_region_translate(&opaque, item->x, item->y);
+		if (wl_region_intersect(&item->copy, &item->blend,
+					&opaque) < 0 ||
+		    wl_region_subtract(&item->blend, &item->blend,
+				       &item->copy) < 0 ||
+		    wl_region_subtract(&cull->uncovered, &cull->uncovered,
+				       &item->copy) < 0)
+			goto out;
+	}
+	ret = 0;
+
+ out:
+	wl_region_fini(&opaque);
+
+	return ret;
+}
+
+/* Hand func the boxes to draw, bottom up: the background, with a
+ * NULL item, then for each item what to copy and what to blend. */
+
+WL_EXPORT void
+wl_cull_for_each_box(struct wl_cull *cull,
+		     wl_cull_box_func_t func, void *data)
+{
+	struct wl_cull_item *item;
+	int i, j;
+
+	for (j = 0; j < cull->uncovered.count; j++)
+		func(NULL, 0, &cull->uncovered.boxes[j], data);
+
+	for (i = 0; i < cull->count; i++) {
+		item = &cull->items[i];
+		for (j = 0; j < item->copy.count; j++)
+			func(item, 0, &item->copy.boxes[j], data);
+		for (j = 0; j < item->blend.count; j++)
+			func(item, 1, &item->blend.boxes[j], data);
+	}
+}
+
+static int
+wl_renderer_cull(struct wl_renderer *renderer,
+		 const struct wl_renderer_layer *layers, int count)
+{
+	const struct wl_renderer_layer *layer;
+	struct wl_map image, rect;
+	int i;
+
+	wl_cull_clear(&renderer->cull);
+	for (i = 0; i < count; i++) {
+		layer = &layers[i];
+		image.x = layer->x;
+		image.y = layer->y;
+		image.width = layer->image.width;
+		image.height = layer->image.height;
+		if (!wl_map_intersect(&rect, &image, &layer->clip))
+			memset(&rect, 0, sizeof rect);
+		if (wl_cull_add(&renderer->cull, &rect, layer->x, layer->y,
+				layer->opaque, NULL) < 0)
+			return -1;
+	}
+
+	return wl_cull_run(&renderer->cull, &renderer->damage.region);
+}
+
+static int
+wl_renderer_bin_layers(struct wl_renderer *renderer, int count)
+{
+	const struct wl_cull_item *item;
+	const struct wl_box *copy, *blend;
+	struct wl_box rect;
+	int32_t tx0, ty0, tx1, ty1, tx, ty;
+	int i, tile, *bins;
+
+	if (count > renderer->bin_alloc) {
+		bins = malloc(renderer->tiles_x * renderer->tiles_y *
+			      count * sizeof *bins);
+		if (bins == NULL)
+			return -1;
+		free(renderer->bins);
+		renderer->bins = bins;
+		renderer->bin_alloc = count;
+	}
+
+	for (i = 0; i < renderer->tile_count; i++)
+		renderer->bin_counts[renderer->tiles[i]] = 0;
+
+	/* Layers are binned by what's visible of them, which is
+	 * within the damage and so on screen. */
+	for (i = 0; i < count; i++) {
+		item = &renderer->cull.items[i];
+		copy = &item->copy.extents;
+		blend = &item->blend.extents;
+		if (wl_region_is_empty(&item->copy))
+			rect = *blend;
+		else if (wl_region_is_empty(&item->blend))
+			rect = *copy;
+		else {
+			rect.x1 = copy->x1 < blend->x1 ? copy->x1 : blend->x1;
+			rect.y1 = copy->y1 < blend->y1 ? copy->y1 : blend->y1;
+			rect.x2 = copy->x2 > blend->x2 ? copy->x2 : blend->x2;
+			rect.y2 = copy->y2 > blend->y2 ? copy->y2 : blend->y2;
+		}
+		if (rect.x1 >= rect.x2)
+			continue;
+
+		tx0 = rect.x1 / TILE_WIDTH;
+		ty0 = rect.y1 / TILE_HEIGHT;
+		tx1 = (rect.x2 + TILE_WIDTH - 1) / TILE_WIDTH;
+		ty1 = (rect.y2 + TILE_HEIGHT - 1) / TILE_HEIGHT;
+		if (tx1 > renderer->tiles_x)
+			tx1 = renderer->tiles_x;
+		if (ty1 > renderer->tiles_y)
+			ty1 = renderer->tiles_y;
+
+		for (ty = ty0; ty < ty1; ty++) {
+			for (tx = tx0; tx < tx1; tx++) {
+				tile = ty * renderer->tiles_x + tx;
+				if (!renderer->damaged[tile])
+					continue;
+				renderer->bins[tile * renderer->bin_alloc +
+					       renderer->bin_counts[tile]++] = i;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Draw the damaged area: the background, then the layers in order
+ * on top, each clipped to its clip rectangle, and copied rather than
+ * blended within its opaque region.  Returns the number of tiles
+ * touched. */
+
+WL_EXPORT int
+wl_renderer_render(struct wl_renderer *renderer,
+		   const struct wl_renderer_layer *layers, int count,
+		   uint32_t background)
+{
+	int i, tile_count;
+
+	wl_damage_clip(&renderer->damage);
+	wl_renderer_mark_tiles(renderer);
+
+	renderer->tile_count = 0;
+	for (i = 0; i < renderer->tiles_x * renderer->tiles_y; i++)
+		if (renderer->damaged[i])
+			renderer->tiles[renderer->tile_count++] = i;
+	if (renderer->tile_count == 0)
+		return 0;
+
+	if (wl_renderer_cull(renderer, layers, count) < 0) {
+		fprintf(stderr, "out of memory culling layers\n");
+		return -1;
+	}
+
+	if (wl_renderer_bin_layers(renderer, count) < 0) {
+		fprintf(stderr, "out of memory binning layers\n");
+		return -1;
+	}
+
+	renderer->layers = layers;
+	renderer->background = background;
+	renderer->next_tile = 0;
+
+	if (renderer->thread_count > 0 && renderer->tile_count > 1) {
+		pthread_mutex_lock(&renderer->mutex);
+		renderer->busy = renderer->thread_count;
+		renderer->generation++;
+		pthread_cond_broadcast(&renderer->start_cond);
+		pthread_mutex_unlock(&renderer->mutex);
+
+		wl_renderer_draw_tiles(renderer);
+
+		pthread_mutex_lock(&renderer->mutex);
+		while (renderer->busy > 0)
+			pthread_cond_wait(&renderer->done_cond,
+					  &renderer->mutex);
+		pthread_mutex_unlock(&renderer->mutex);
+	} else {
+		wl_renderer_draw_tiles(renderer);
+	}
+
+	tile_count = renderer->tile_count;
+	wl_region_clear(&renderer->damage.region);
+
+	return tile_count;
+}
+
+WL_EXPORT void
+wl_renderer_surface_init(struct wl_renderer_surface *rs)
+{
+	memset(rs, 0, sizeof *rs);
+	wl_region_init(&rs->damage);
+	wl_region_init(&rs->opaque_hint);
+	wl_region_init(&rs->opaque);
+}
+
+WL_EXPORT void
+wl_renderer_surface_fini(struct wl_renderer_surface *rs)
+{
+	wl_region_fini(&rs->damage);
+	wl_region_fini(&rs->opaque_hint);
+	wl_region_fini(&rs->opaque);
+	free(rs->rgb.data);
+}
+
+/* XRGB and RGB565 buffers are opaque as a whole, ARGB ones where the
+ * client says so.  Anything we can't work out is treated as
+ * translucent, which is always safe. */
+
+static void
+wl_renderer_surface_update_opaque(struct wl_renderer_surface *rs)
+{
+	if (rs->format != WL_SURFACE_FORMAT_ARGB8888) {
+		wl_region_fini(&rs->opaque);
+		wl_region_init_rect(&rs->opaque, 0, 0, rs->width, rs->height);
+	} else if (wl_region_copy(&rs->opaque, &rs->opaque_hint) < 0 ||
+		   wl_region_intersect_rect(&rs->opaque, 0, 0,
+					    rs->width, rs->height) < 0) {
+		wl_region_clear(&rs->opaque);
+	}
+}
+
+WL_EXPORT void
+wl_renderer_surface_damage_map(struct wl_renderer_surface *rs,
+			       struct wl_damage *output)
+{
+	wl_damage_add(output, rs->map.x, rs->map.y,
+		      rs->map.width, rs->map.height);
+}
+
+/* Moving a surface damages where it was and where it's going. */
+
+WL_EXPORT void
+wl_renderer_surface_map(struct wl_renderer_surface *rs,
+			struct wl_damage *output, const struct wl_map *map)
+{
+	wl_renderer_surface_damage_map(rs, output);
+	rs->map = *map;
+	wl_renderer_surface_damage_map(rs, output);
+}
+
+/* A new buffer damages all of the surface's contents. */
+
+WL_EXPORT void
+wl_renderer_surface_attach(struct wl_renderer_surface *rs,
+			   struct wl_damage *output,
+			   int32_t width, int32_t height, uint32_t format)
+{
+	rs->width = width;
+	rs->height = height;
+	rs->format = format;
+	free(rs->rgb.data);
+	rs->rgb.data = NULL;
+	wl_renderer_surface_update_opaque(rs);
+	wl_renderer_surface_damage(rs, output, 0, 0, width, height);
+}
+
+WL_EXPORT void
+wl_renderer_surface_set_opaque(struct wl_renderer_surface *rs,
+			       struct wl_damage *output,
+			       const struct wl_region *opaque)
+{
+	if (wl_region_copy(&rs->opaque_hint, opaque) < 0)
+		wl_region_clear(&rs->opaque_hint);
+	wl_renderer_surface_update_opaque(rs);
+	wl_renderer_surface_damage_map(rs, output);
+}
+
+/* If the content damage can't be recorded, the whole map is
+ * redrawn instead. */
+
+WL_EXPORT void
+wl_renderer_surface_damage(struct wl_renderer_surface *rs,
+			   struct wl_damage *output,
+			   int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	if (wl_region_union_rect(&rs->damage, x, y, width, height) < 0)
+		wl_renderer_surface_damage_map(rs, output);
+	rs->stale = 1;
+}
+
+WL_EXPORT void
+wl_renderer_surface_flush_damage(struct wl_renderer_surface *rs,
+				 struct wl_damage *output)
+{
+	if (wl_region_is_empty(&rs->damage))
+		return;
+
+	if (wl_region_intersect_rect(&rs->damage, 0, 0,
+				     rs->map.width, rs->map.height) < 0) {
+		wl_renderer_surface_damage_map(rs, output);
+	} else {
+		wl_region_translate(&rs->damage, rs->map.x, rs->map.y);
+		wl_damage_add_region(output, &rs->damage);
+	}
+	wl_region_clear(&rs->damage);
+}
+
+/* Append a layer that draws the surface unscaled at its map
+ * position, clipped to the map, from data, the buffer contents with
+ * the given stride.  RGB565 contents are expanded to XRGB first if
+ * they've been damaged since the last frame.  *layers grows as needed;
+ * returns the new count, which is unchanged if there's nothing to
+ * draw. */
+
+WL_EXPORT int
+wl_renderer_surface_add_layer(struct wl_renderer_surface *rs,
+			      void *data, int32_t stride,
+			      struct wl_renderer_layer **layers,
+			      int *alloc, int count)
+{
+	struct wl_renderer_layer *layer;
+	int size;
+
+	if (count == *alloc) {
+		size = *alloc ? *alloc * 2 : 16;
+		layer = realloc(*layers, size * sizeof *layer);
+		if (layer == NULL)
+			return count;
+		*layers = layer;
+		*alloc = size;
+	}
+
+	layer = &(*layers)[count];
+	layer->image.data = data;
+	layer->image.width = rs->width;
+	layer->image.height = rs->height;
+	layer->image.stride = stride;
+	if (rs->format == WL_SURFACE_FORMAT_RGB565) {
+		if (rs->rgb.data == NULL) {
+			rs->rgb.width = rs->width;
+			rs->rgb.height = rs->height;
+			rs->rgb.stride = rs->width * 4;
+			rs->rgb.data = malloc(rs->rgb.stride * rs->height);
+			if (rs->rgb.data == NULL) {
+				fprintf(stderr,
+					"failed to allocate rgb565 image\n");
+				return count;
+			}
+			rs->stale = 1;
+		}
+		if (rs->stale)
+			wl_composite_convert_rgb565(&rs->rgb, data, stride);
+		layer->image = rs->rgb;
+	}
+	rs->stale = 0;
+
+	layer->x = rs->map.x;
+	layer->y = rs->map.y;
+	layer->clip = rs->map;
+	if (rs->format == WL_SURFACE_FORMAT_ARGB8888)
+		layer->op = WL_COMPOSITE_OVER;
+	else
+		layer->op = WL_COMPOSITE_SRC;
+	layer->opaque = wl_region_is_empty(&rs->opaque) ? NULL : &rs->opaque;
+
+	return count + 1;
+}
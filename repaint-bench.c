@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wayland.h"
+
+/* Frame time of the tiled renderer against thread count, at 1080p
+ * and 4K with 1 to 50 surfaces: translucent-edged windows scattered
+ * over the screen, the whole frame damaged every time and copied to
+ * a front buffer like the fb compositor does.  Thread counts go in
+ * powers of two up to the number of CPUs, or the first argument.
+ * The last column damages only a 16x16 box per frame, like a
+ * blinking cursor, on one thread.  The "max" rows put a maximized
+ * opaque window on top of the others, which should cost about as
+ * much as drawing that one window. */
+
+#define SHADOW 16
+#define FRAMES 50
+#define CURSOR 16
+
+static void
+init_window(struct wl_image *image, int width, int height, uint32_t color)
+{
+	uint32_t a, *p;
+	int x, y, d;
+
+	image->width = width;
+	image->height = height;
+	image->stride = width * 4;
+	image->data = malloc(image->stride * height);
+	if (image->data == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (y = 0; y < height; y++) {
+		p = image->data + y * width;
+		for (x = 0; x < width; x++) {
+			d = x;
+			if (width - 1 - x < d)
+				d = width - 1 - x;
+			if (y < d)
+				d = y;
+			if (height - 1 - y < d)
+				d = height - 1 - y;
+			if (d >= SHADOW) {
+				p[x] = color;
+			} else {
+				a = (d + 1) * 0x60 / SHADOW;
+				p[x] = a << 24;
+			}
+		}
+	}
+}
+
+static double
+run(int width, int height, int surfaces, int maximized,
+    int threads, int damage)
+{
+	struct wl_renderer_layer *layers;
+	struct wl_image target, front;
+	struct wl_renderer *renderer;
+	struct wl_region opaque;
+	uint64_t start, elapsed;
+	int i, count;
+
+	target.width = front.width = width;
+	target.height = front.height = height;
+	target.stride = front.stride = width * 4;
+	target.data = malloc(target.stride * height);
+	front.data = malloc(front.stride * height);
+	count = surfaces + maximized;
+	layers = calloc(count, sizeof *layers);
+	if (target.data == NULL || front.data == NULL || layers == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	srand(surfaces);
+	for (i = 0; i < surfaces; i++) {
+		init_window(&layers[i].image,
+			    width / 6 + rand() % (width / 3),
+			    height / 6 + rand() % (height / 3),
+			    0xff000000 | rand());
+		layers[i].x = rand() % (width - layers[i].image.width);
+		layers[i].y = rand() % (height - layers[i].image.height);
+		layers[i].clip.x = layers[i].x;
+		layers[i].clip.y = layers[i].y;
+		layers[i].clip.width = layers[i].image.width;
+		layers[i].clip.height = layers[i].image.height;
+		layers[i].op = WL_COMPOSITE_OVER;
+	}
+
+	wl_region_init_rect(&opaque, 0, 0, width, height);
+	if (maximized) {
+		init_window(&layers[surfaces].image, width, height,
+			    0xff304050);
+		for (i = 0; i < width * height; i++)
+			layers[surfaces].image.data[i] |= 0xff000000;
+		layers[surfaces].clip.width = width;
+		layers[surfaces].clip.height = height;
+		layers[surfaces].op = WL_COMPOSITE_OVER;
+		layers[surfaces].opaque = &opaque;
+	}
+
+	renderer = wl_renderer_create(&target, &front, threads);
+	if (renderer == NULL) {
+		fprintf(stderr, "failed to create renderer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The first frame is drawn in full. */
+	wl_renderer_render(renderer, layers, count, 0xff002040);
+
+	start = wl_time_now();
+	for (i = 0; i < FRAMES; i++) {
+		if (damage)
+			wl_renderer_damage(renderer, width / 2, height / 2,
+					   damage, damage);
+		else
+			wl_renderer_damage(renderer, 0, 0, width, height);
+		wl_renderer_render(renderer, layers, count, 0xff002040);
+	}
+	elapsed = wl_time_now() - start;
+
+	wl_renderer_destroy(renderer);
+	for (i = 0; i < count; i++)
+		free(layers[i].image.data);
+	free(layers);
+	wl_region_fini(&opaque);
+	free(target.data);
+	free(front.data);
+
+	return elapsed / 1e6 / FRAMES;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct { int width, height; const char *name; } sizes[] = {
+		{ 1920, 1080, "1080p" },
+		{ 3840, 2160, "4K" }
+	};
+	static const struct { int surfaces, maximized; } scenes[] = {
+		{ 1, 0 }, { 10, 0 }, { 50, 0 }, { 10, 1 }, { 50, 1 }
+	};
+	char name[16];
+	int threads[8], thread_count = 0, cpus, i, j, k;
+
+	if (argc > 1)
+		cpus = atoi(argv[1]);
+	else
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	for (i = 1; i < cpus && thread_count < ARRAY_LENGTH(threads) - 1;
+	     i *= 2)
+		threads[thread_count++] = i;
+	threads[thread_count++] = cpus;
+
+	printf("%s kernels, ms/frame\n%-6s %8s", wl_composite_get_kernel(),
+	       "size", "surfaces");
+	for (k = 0; k < thread_count; k++)
+		printf(" %4d thr", threads[k]);
+	printf(" %8s\n", "cursor");
+
+	for (i = 0; i < ARRAY_LENGTH(sizes); i++) {
+		for (j = 0; j < ARRAY_LENGTH(scenes); j++) {
+			snprintf(name, sizeof name, "%d%s", scenes[j].surfaces,
+				 scenes[j].maximized ? "+max" : "");
+			printf("%-6s %8s", sizes[i].name, name);
+			for (k = 0; k < thread_count; k++)
+				printf(" %8.2f", run(sizes[i].width,
+						     sizes[i].height,
+						     scenes[j].surfaces,
+						     scenes[j].maximized,
+						     threads[k], 0));
+			printf(" %8.3f\n", run(sizes[i].width, sizes[i].height,
+					       scenes[j].surfaces,
+					       scenes[j].maximized,
+					       1, CURSOR));
+		}
+	}
+
+	return 0;
+}
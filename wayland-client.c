@@ -1,4 +1,3 @@
-#include <alloca.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -218,14 +217,12 @@ static void
 handle_event(struct wl_display *display, uint32_t id, uint32_t opcode,
 	     uint32_t size)
 {
-	if (size < 4096) {
-		uint32_t *p = alloca (size);
+	const uint32_t *p;
 
-		wl_connection_copy(display->connection, p, size);
-		if (display->event_handler != NULL)
-			display->event_handler(display, id, opcode, p[2], p[3],
-					       display->event_handler_data);
-	}
+	p = wl_connection_view(display->connection, size);
+	if (p != NULL && display->event_handler != NULL)
+		display->event_handler(display, id, opcode, p[2], p[3],
+				       display->event_handler_data);
 
 	wl_connection_consume(display->connection, size);
 }
@@ -233,17 +230,22 @@ handle_event(struct wl_display *display, uint32_t id, uint32_t opcode,
 WL_EXPORT void
 wl_display_iterate(struct wl_display *display, uint32_t mask)
 {
-	uint32_t p[2], opcode, size;
+	const uint32_t *p;
+	uint32_t opcode, size;
 	int len;
 
 	len = wl_connection_data(display->connection, mask);
 	while (len > 0) {
-		if (len < sizeof p)
+		if (len < 2 * sizeof p[0])
 			break;
 		
-		wl_connection_copy(display->connection, p, sizeof p);
+		p = wl_connection_view(display->connection, 2 * sizeof p[0]);
 		opcode = p[1] & 0xffff;
 		size = p[1] >> 16;
+		if (size < 2 * sizeof p[0] || size & 3) {
+			fprintf(stderr, "bad event size %d\n", size);
+			exit(EXIT_FAILURE);
+		}
 		if (len < size)
 			break;
 
@@ -268,6 +270,7 @@ wl_display_set_event_handler(struct wl_display *display,
 }
 
 #define WL_DISPLAY_CREATE_SURFACE 0
+#define WL_DISPLAY_COMMIT 1
 
 WL_EXPORT struct wl_surface *
 wl_display_create_surface(struct wl_display *display)
@@ -286,6 +289,13 @@ wl_display_create_surface(struct wl_display *display)
 	return surface;
 }
 
+WL_EXPORT void
+wl_display_commit(struct wl_display *display, uint32_t cookie)
+{
+	wl_connection_marshal(display->connection, NULL, display->proxy.id,
+			      WL_DISPLAY_COMMIT, "i", cookie);
+}
+
 WL_EXPORT EGLDisplay
 wl_display_get_egl_display(struct wl_display *display)
 {
@@ -315,6 +325,11 @@ wl_display_create_buffer_from_data(struct wl_display *display,
 #define WL_SURFACE_MAP		2
 #define WL_SURFACE_COPY		3
 #define WL_SURFACE_DAMAGE	4
+#define WL_SURFACE_DAMAGE_RECTANGLES	5
+#define WL_SURFACE_SET_OPAQUE_REGION	6
+#define WL_SURFACE_RAISE	7
+#define WL_SURFACE_LOWER	8
+#define WL_SURFACE_SET_INPUT_REGION	9
 
 WL_EXPORT void
 wl_surface_destroy(struct wl_surface *surface)
@@ -325,11 +340,12 @@ wl_surface_destroy(struct wl_surface *surface)
 
 WL_EXPORT void
 wl_surface_attach(struct wl_surface *surface, uint32_t name,
-		  int32_t width, int32_t height, uint32_t stride)
+		  int32_t width, int32_t height, uint32_t stride,
+		  uint32_t format)
 {
 	wl_connection_marshal(surface->proxy.display->connection, NULL,
-			      surface->proxy.id, WL_SURFACE_ATTACH, "iiii",
-			      name, width, height, stride);
+			      surface->proxy.id, WL_SURFACE_ATTACH, "iiiii",
+			      name, width, height, stride, format);
 }
 
 WL_EXPORT void
@@ -360,15 +376,92 @@ wl_surface_damage(struct wl_surface *surface,
 			      x, y, width, height);
 }
 
+/* Send count rectangles of x, y, width and height as the one array
+ * argument of a surface request. */
+
+static void
+wl_surface_marshal_rectangles(struct wl_surface *surface, uint32_t opcode,
+			      const int32_t *rectangles, int count)
+{
+	struct wl_array array;
+
+	array.size = count * 4 * sizeof rectangles[0];
+	array.alloc = 0;
+	array.data = (void *) rectangles;
+	wl_connection_marshal(surface->proxy.display->connection, NULL,
+			      surface->proxy.id, opcode, "a", &array);
+}
+
+WL_EXPORT void
+wl_surface_damage_rectangles(struct wl_surface *surface,
+			     const int32_t *rectangles, int count)
+{
+	wl_surface_marshal_rectangles(surface, WL_SURFACE_DAMAGE_RECTANGLES,
+				      rectangles, count);
+}
+
+/* Takes effect on the next commit and stays until replaced; count 0
+ * clears it. */
+
+WL_EXPORT void
+wl_surface_set_opaque_region(struct wl_surface *surface,
+			     const int32_t *rectangles, int count)
+{
+	wl_surface_marshal_rectangles(surface, WL_SURFACE_SET_OPAQUE_REGION,
+				      rectangles, count);
+}
+
+/* Move the surface to the top or bottom of the stack on the next
+ * commit. */
+
+WL_EXPORT void
+wl_surface_raise(struct wl_surface *surface)
+{
+	wl_connection_marshal(surface->proxy.display->connection, NULL,
+			      surface->proxy.id, WL_SURFACE_RAISE, "");
+}
+
+WL_EXPORT void
+wl_surface_lower(struct wl_surface *surface)
+{
+	wl_connection_marshal(surface->proxy.display->connection, NULL,
+			      surface->proxy.id, WL_SURFACE_LOWER, "");
+}
+
+/* Pointer events only go to the surface under the pointer within the
+ * input region, which is the whole surface until one is set.  With
+ * no rectangles, they go to whatever is underneath. */
+
+WL_EXPORT void
+wl_surface_set_input_region(struct wl_surface *surface,
+			    const int32_t *rectangles, int count)
+{
+	wl_surface_marshal_rectangles(surface, WL_SURFACE_SET_INPUT_REGION,
+				      rectangles, count);
+}
+
+#define WL_INPUT_DEVICE_WATCH 0
+
+/* Get motion events wherever the pointer is, not just over our own
+ * surfaces.  Only cursors should need this. */
+
+WL_EXPORT void
+wl_input_device_watch(struct wl_proxy *device)
+{
+	wl_connection_marshal(device->display->connection, NULL,
+			      device->id, WL_INPUT_DEVICE_WATCH, "");
+}
+
 
 /* Higher-level APIs.  */
 
 WL_EXPORT void
 wl_surface_attach_buffer(struct wl_surface *surface,
-			 struct wl_buffer *buffer)
+			 struct wl_buffer *buffer, uint32_t format)
 {
 	return wl_surface_attach(surface, buffer->name,
-				 buffer->width, buffer->height, buffer->stride);
+				 buffer->width, buffer->height, buffer->stride,
+				 format);
 }
 
 
@@ -56,6 +56,13 @@ void wl_display_set_event_handler(struct wl_display *display,
 struct wl_surface *
 wl_display_create_surface(struct wl_display *display);
 
+/* Surface requests take effect together at the next commit.  Once
+ * they are on screen, the display sends a commit_done event with
+ * the cookie. */
+#define WL_DISPLAY_COMMIT_DONE 3
+
+void wl_display_commit(struct wl_display *display, uint32_t cookie);
+
 EGLDisplay wl_display_get_egl_display(struct wl_display *display);
 
 struct wl_buffer *wl_display_create_buffer(struct wl_display *display,
@@ -67,9 +74,17 @@ struct wl_buffer *wl_display_create_buffer_from_data(struct wl_display *display,
 
 /* Surface functions.  */
 
+/* Buffer pixel formats.  ARGB is premultiplied; XRGB and RGB565
+ * buffers are opaque, which lets the compositor skip blending and
+ * whatever is underneath. */
+#define WL_SURFACE_FORMAT_ARGB8888 0
+#define WL_SURFACE_FORMAT_XRGB8888 1
+#define WL_SURFACE_FORMAT_RGB565 2
+
 void wl_surface_destroy(struct wl_surface *surface);
 void wl_surface_attach(struct wl_surface *surface,
-		       uint32_t name, int32_t width, int32_t height, uint32_t stride);
+		       uint32_t name, int32_t width, int32_t height, uint32_t stride,
+		       uint32_t format);
 void wl_surface_map(struct wl_surface *surface,
 		    int32_t x, int32_t y, int32_t width, int32_t height);
 void wl_surface_copy(struct wl_surface *surface, int32_t dst_x, int32_t dst_y,
@@ -77,9 +92,31 @@ void wl_surface_copy(struct wl_surface *surface, int32_t dst_x, int32_t dst_y,
 		     int32_t x, int32_t y, int32_t width, int32_t height);
 void wl_surface_damage(struct wl_surface *surface,
 		       int32_t x, int32_t y, int32_t width, int32_t height);
+void wl_surface_damage_rectangles(struct wl_surface *surface,
+				  const int32_t *rectangles, int count);
+void wl_surface_set_opaque_region(struct wl_surface *surface,
+				  const int32_t *rectangles, int count);
+void wl_surface_raise(struct wl_surface *surface);
+void wl_surface_lower(struct wl_surface *surface);
+void wl_surface_set_input_region(struct wl_surface *surface,
+				 const int32_t *rectangles, int count);
+
+/* Input device functions.  */
+
+/* Pointer events go to the client whose surface is under the pointer,
+ * or that got the last button press while buttons are down.  Motion
+ * carries the position on screen in arg1 and arg2, followed by the
+ * position relative to the surface; enter carries the surface and
+ * the relative position, leave the surface. */
+#define WL_INPUT_DEVICE_MOTION 0
+#define WL_INPUT_DEVICE_BUTTON 1
+#define WL_INPUT_DEVICE_ENTER 2
+#define WL_INPUT_DEVICE_LEAVE 3
+
+void wl_input_device_watch(struct wl_proxy *device);
 
 void wl_surface_attach_buffer(struct wl_surface *surface,
-			      struct wl_buffer *buffer);
+			      struct wl_buffer *buffer, uint32_t format);
 void wl_surface_copy_buffer(struct wl_surface *surface,
 			    int32_t dst_x, int32_t dst_y, struct wl_buffer *src,
 			    int32_t x, int32_t y, int32_t width, int32_t height);
@@ -2,13 +2,41 @@
 #define _WAYLAND_INTERNAL_H
 
 #include "hash.h"
+#include "connection.h"
+#include "io-thread.h"
+#include "capture.h"
+#include "grid.h"
 
 struct wl_client {
 	struct wl_connection *connection;
 	struct wl_event_source *source;
+	/* Set when requests are read on an I/O thread.  The source is
+	 * then only there while we wait for the socket to drain. */
+	struct wl_io_client *io;
+	int fd;
 	struct wl_display *display;
 	struct wl_list object_list;
 	struct wl_list link;
+	/* Connection mask last seen by wl_client_connection_update. */
+	uint32_t mask;
+	struct wl_list flush_link;
+
+	/* Surfaces with requests waiting for the next commit, and the
+	 * cookie of the last commit not yet acknowledged. */
+	struct wl_list pending_list;
+	uint32_t commit_cookie;
+	int commit_pending;
+
+	/* Set when the client asked for all pointer motion, not just
+	 * over its own surfaces. */
+	int pointer_watch;
+
+	/* Requests dispatched and their time, while profiling. */
+	uint64_t requests, request_bytes;
+	struct wl_histogram request_time;
+
+	/* Number of the client in the capture file. */
+	uint32_t capture_id;
 };
 
 struct wl_display {
@@ -21,13 +49,35 @@ struct wl_display {
 	struct wl_compositor_interface *compositor_interface;
 
 	struct wl_list global_objects_list;
+	struct wl_list interface_list;
+	const struct wl_interface_signatures *surface_signatures;
+	/* Surfaces bottom to top, with the stacking order of the
+	 * lowest and highest, an index of their maps and room for
+	 * the results of wl_display_get_surfaces. */
 	struct wl_list surface_list;
+	int64_t stack_bottom, stack_top;
+	struct wl_grid grid;
+	struct wl_surface **found;
+	int found_count, found_alloc;
+	/* The surface pointer events go to, where the pointer is and
+	 * how many buttons are down.  Focus stays put while any are. */
+	struct wl_surface *pointer_focus;
+	int32_t pointer_x, pointer_y;
+	int pointer_buttons;
 	struct wl_list client_list;
+	struct wl_list flush_list;
+	struct wl_io_pool *io_pool;
 	uint32_t client_id_range;
+	uint32_t client_buffer_limit;
+	int run;
+	int profiling;
+	struct wl_event_source *profile_source;
+	struct wl_capture *capture;
 };
 
 struct wl_surface {
 	struct wl_object base;
+	struct wl_client *client;
 
 	/* provided by client */
 	int width, height;
@@ -36,6 +86,23 @@ struct wl_surface {
 	
 	struct wl_map map;
 	struct wl_list link;
+	struct wl_grid_item grid;
+	/* The part of the surface that takes pointer events, in
+	 * surface coordinates; all of it unless input_set. */
+	struct wl_region input;
+	int input_set;
+
+	/* Requests since the last commit.  Only the most recent attach
+	 * and map matter; copies and damage are applied in order. */
+	uint32_t pending;
+	uint32_t pending_name, pending_width, pending_height, pending_stride;
+	uint32_t pending_format;
+	struct wl_map pending_map;
+	struct wl_region pending_opaque;
+	struct wl_region pending_input;
+	struct wl_array pending_copies;
+	struct wl_array pending_damage;
+	struct wl_list pending_link;
 
 	/* how to convert buffer contents to pixels in screen format;
 	 * yuv->rgb, indexed->rgb, svg->rgb, but mostly just rgb->rgb. */
@@ -45,6 +112,17 @@ struct wl_surface {
 	void *compositor_data;
 };
 
+enum {
+	WL_SURFACE_PENDING_ATTACH = 0x01,
+	WL_SURFACE_PENDING_MAP = 0x02,
+	WL_SURFACE_PENDING_COPY = 0x04,
+	WL_SURFACE_PENDING_DAMAGE = 0x08,
+	WL_SURFACE_PENDING_OPAQUE = 0x10,
+	WL_SURFACE_PENDING_RAISE = 0x20,
+	WL_SURFACE_PENDING_LOWER = 0x40,
+	WL_SURFACE_PENDING_INPUT = 0x80
+};
+
 struct wl_object_ref {
 	struct wl_object *object;
 	struct wl_list link;
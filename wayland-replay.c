@@ -0,0 +1,396 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "wayland.h"
+#include "capture.h"
+
+/* Replays a capture file against a running server: every captured
+ * client connects again and sends the same requests, either at the
+ * pace they were recorded or as fast as the server takes them.  The
+ * server's events are read and thrown away, except for timing the
+ * response to each batch of requests that got one in the original
+ * session.
+ *
+ * Object ids are only valid if the clients get the same id ranges
+ * as when they were recorded, so replay against a freshly started
+ * server. */
+
+static const char socket_name[] = "\0wayland";
+
+struct pending {
+	uint64_t target, time;
+};
+
+struct client {
+	int fd;
+	/* Event bytes in the capture so far and received so far. */
+	uint64_t expected, received;
+	/* When the last requests still waiting for a response went
+	 * out, and the responses we're waiting for. */
+	uint64_t sent;
+	struct pending *pending;
+	int pending_head, pending_count, pending_alloc;
+	/* Where the next request header starts in the stream. */
+	uint32_t skip, have;
+	uint32_t header[2];
+};
+
+struct replay {
+	int fast;
+	int epoll_fd;
+	struct client *clients;
+	uint32_t client_count;
+	uint64_t start;
+	uint64_t requests, bytes;
+	struct wl_histogram latency;
+};
+
+static struct client *
+replay_get_client(struct replay *replay, uint32_t id)
+{
+	struct client *clients;
+	uint32_t i, count;
+
+	if (id >= replay->client_count) {
+		count = replay->client_count ? replay->client_count : 16;
+		while (count <= id)
+			count *= 2;
+		clients = realloc(replay->clients, count * sizeof *clients);
+		if (clients == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(clients + replay->client_count, 0,
+		       (count - replay->client_count) * sizeof *clients);
+		for (i = replay->client_count; i < count; i++)
+			clients[i].fd = -1;
+		replay->clients = clients;
+		replay->client_count = count;
+	}
+
+	return &replay->clients[id];
+}
+
+static void
+client_connect(struct replay *replay, uint32_t id)
+{
+	struct client *client = replay_get_client(replay, id);
+	struct sockaddr_un name;
+	struct epoll_event ep;
+	socklen_t size;
+
+	client->fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (client->fd < 0) {
+		fprintf(stderr, "socket failed: %m\n");
+		exit(EXIT_FAILURE);
+	}
+
+	name.sun_family = AF_LOCAL;
+	memcpy(name.sun_path, socket_name, sizeof socket_name);
+	size = offsetof (struct sockaddr_un, sun_path) + sizeof socket_name;
+	if (connect(client->fd, (struct sockaddr *) &name, size) < 0) {
+		fprintf(stderr, "failed to connect to server: %m\n");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(client->fd, F_SETFL, O_NONBLOCK);
+
+	ep.events = EPOLLIN;
+	ep.data.u32 = id;
+	epoll_ctl(replay->epoll_fd, EPOLL_CTL_ADD, client->fd, &ep);
+}
+
+static void
+client_disconnect(struct replay *replay, uint32_t id)
+{
+	struct client *client = replay_get_client(replay, id);
+
+	if (client->fd < 0)
+		return;
+
+	epoll_ctl(replay->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	client->fd = -1;
+	client->pending_count = 0;
+}
+
+/* Time the responses that are complete now. */
+
+static void
+client_received(struct replay *replay, struct client *client, int len)
+{
+	struct pending *pending;
+	uint64_t now;
+
+	client->received += len;
+	now = wl_time_now();
+	while (client->pending_count > 0) {
+		pending = &client->pending[client->pending_head];
+		if (pending->target > client->received)
+			break;
+		wl_histogram_add(&replay->latency, now - pending->time);
+		client->pending_head =
+			(client->pending_head + 1) % client->pending_alloc;
+		client->pending_count--;
+	}
+}
+
+/* A response in the capture: once we have received as many event
+ * bytes as the server had sent by then, the requests sent since the
+ * last response have been answered. */
+
+static void
+client_expect(struct client *client, uint32_t size)
+{
+	struct pending *pending;
+	int i, alloc;
+
+	client->expected += size;
+	if (client->sent == 0)
+		return;
+
+	if (client->pending_count == client->pending_alloc) {
+		alloc = client->pending_alloc ? client->pending_alloc * 2 : 16;
+		pending = malloc(alloc * sizeof *pending);
+		if (pending == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < client->pending_count; i++)
+			pending[i] = client->pending[(client->pending_head + i) %
+						     client->pending_alloc];
+		free(client->pending);
+		client->pending = pending;
+		client->pending_head = 0;
+		client->pending_alloc = alloc;
+	}
+
+	i = (client->pending_head + client->pending_count++) %
+		client->pending_alloc;
+	client->pending[i].target = client->expected;
+	client->pending[i].time = client->sent;
+	client->sent = 0;
+}
+
+/* Read whatever the server has sent, waiting up to timeout
+ * milliseconds for the first of it. */
+
+static void
+replay_drain(struct replay *replay, int timeout)
+{
+	struct epoll_event ep[32];
+	struct client *client;
+	char buffer[65536];
+	int i, count, len;
+
+	count = epoll_wait(replay->epoll_fd, ep, ARRAY_LENGTH(ep), timeout);
+	for (i = 0; i < count; i++) {
+		client = &replay->clients[ep[i].data.u32];
+		while ((len = read(client->fd, buffer, sizeof buffer)) > 0)
+			client_received(replay, client, len);
+		if (len == 0 || (len < 0 && errno != EAGAIN)) {
+			fprintf(stderr, "server closed client %u\n",
+				ep[i].data.u32);
+			client_disconnect(replay, ep[i].data.u32);
+		}
+	}
+}
+
+static void
+count_requests(struct replay *replay, struct client *client,
+	       const char *data, uint32_t size)
+{
+	uint32_t n;
+
+	while (size > 0) {
+		if (client->skip > 0) {
+			n = client->skip < size ? client->skip : size;
+			client->skip -= n;
+		} else {
+			n = sizeof client->header - client->have;
+			if (n > size)
+				n = size;
+			memcpy((char *) client->header + client->have, data, n);
+			client->have += n;
+			if (client->have == sizeof client->header) {
+				replay->requests++;
+				client->have = 0;
+				client->skip = client->header[1] >> 16;
+				if (client->skip >= sizeof client->header)
+					client->skip -= sizeof client->header;
+				else
+					client->skip = 0;
+			}
+		}
+		data += n;
+		size -= n;
+	}
+}
+
+static void
+client_send(struct replay *replay, uint32_t id,
+	    const char *data, uint32_t size)
+{
+	struct client *client = replay_get_client(replay, id);
+	int len;
+
+	if (client->fd < 0)
+		return;
+
+	count_requests(replay, client, data, size);
+	replay->bytes += size;
+
+	while (size > 0) {
+		len = write(client->fd, data, size);
+		if (len < 0 && errno == EAGAIN) {
+			/* Let the server catch up with its output. */
+			replay_drain(replay, 1);
+			continue;
+		} else if (len < 0) {
+			fprintf(stderr, "write to server failed: %m\n");
+			client_disconnect(replay, id);
+			return;
+		}
+		data += len;
+		size -= len;
+	}
+
+	if (client->sent == 0)
+		client->sent = wl_time_now();
+}
+
+/* Give the server up to a second to send a client everything it
+ * sent in the original session, so we don't hang up on it while it
+ * is still writing. */
+
+static void
+client_finish(struct replay *replay, uint32_t id)
+{
+	struct client *client = replay_get_client(replay, id);
+	uint64_t deadline;
+
+	deadline = wl_time_now() + 1000000000;
+	while (client->fd >= 0 && client->received < client->expected &&
+	       wl_time_now() < deadline)
+		replay_drain(replay, 10);
+
+	client_disconnect(replay, id);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: wayland-replay [-f] CAPTURE\n"
+		"  -f  send as fast as the server takes it instead of "
+		"at the recorded pace\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct replay replay;
+	struct wl_capture_record record;
+	char magic[sizeof WL_CAPTURE_MAGIC - 1], summary[160];
+	char *data = NULL;
+	uint32_t size, alloc = 0;
+	uint64_t now, target;
+	double seconds;
+	FILE *file;
+	int i;
+
+	memset(&replay, 0, sizeof replay);
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-f") == 0)
+			replay.fast = 1;
+		else
+			usage();
+	}
+	if (i != argc - 1)
+		usage();
+
+	file = fopen(argv[i], "r");
+	if (file == NULL) {
+		fprintf(stderr, "failed to open %s: %m\n", argv[i]);
+		return EXIT_FAILURE;
+	}
+	if (fread(magic, sizeof magic, 1, file) != 1 ||
+	    memcmp(magic, WL_CAPTURE_MAGIC, sizeof magic) != 0) {
+		fprintf(stderr, "%s is not a capture file\n", argv[i]);
+		return EXIT_FAILURE;
+	}
+
+	replay.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	replay.start = wl_time_now();
+
+	while (fread(&record, sizeof record, 1, file) == 1) {
+		size = WL_CAPTURE_SIZE(&record);
+		if (size > alloc) {
+			alloc = size;
+			data = realloc(data, alloc);
+			if (data == NULL) {
+				fprintf(stderr, "out of memory\n");
+				return EXIT_FAILURE;
+			}
+		}
+		if (size > 0 && fread(data, size, 1, file) != 1) {
+			fprintf(stderr, "capture file truncated\n");
+			break;
+		}
+
+		if (!replay.fast) {
+			target = replay.start + record.time;
+			while ((now = wl_time_now()) < target)
+				replay_drain(&replay,
+					     (target - now + 999999) / 1000000);
+		} else {
+			replay_drain(&replay, 0);
+		}
+
+		switch (WL_CAPTURE_TYPE(&record)) {
+		case WL_CAPTURE_CONNECT:
+			client_connect(&replay, record.client);
+			break;
+		case WL_CAPTURE_DISCONNECT:
+			client_finish(&replay, record.client);
+			break;
+		case WL_CAPTURE_REQUEST:
+			client_send(&replay, record.client, data, size);
+			break;
+		case WL_CAPTURE_EVENT:
+			client_expect(replay_get_client(&replay, record.client),
+				      size);
+			break;
+		}
+	}
+
+	for (i = 0; i < replay.client_count; i++)
+		client_finish(&replay, i);
+	seconds = (wl_time_now() - replay.start) / 1e9;
+
+	wl_histogram_format(&replay.latency, summary, sizeof summary);
+	printf("%llu requests, %llu bytes in %.3f s: "
+	       "%.0f requests/s, %.1f MB/s\n",
+	       (unsigned long long) replay.requests,
+	       (unsigned long long) replay.bytes, seconds,
+	       replay.requests / seconds,
+	       replay.bytes / seconds / (1 << 20));
+	printf("response latency: %s\n", summary);
+
+	for (i = 0; i < replay.client_count; i++)
+		free(replay.clients[i].pending);
+	free(replay.clients);
+	free(data);
+	fclose(file);
+	close(replay.epoll_fd);
+
+	return 0;
+}
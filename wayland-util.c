@@ -0,0 +1,98 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include "wayland.h"
+
+void wl_list_init(struct wl_list *list)
+{
+	list->prev = list;
+	list->next = list;
+}
+
+void
+wl_list_insert(struct wl_list *list, struct wl_list *elm)
+{
+	elm->prev = list;
+	elm->next = list->next;
+	list->next = elm;
+	elm->next->prev = elm;
+}
+
+void
+wl_list_remove(struct wl_list *elm)
+{
+	elm->prev->next = elm->next;
+	elm->next->prev = elm->prev;
+}
+
+/* Monotonic time in nanoseconds. */
+
+WL_EXPORT uint64_t
+wl_time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Bucket i counts values in [2^i, 2^(i+1)), the last one everything
+ * above.  Adding a value is a handful of instructions, so histograms
+ * can stay on in production. */
+
+WL_EXPORT void
+wl_histogram_add(struct wl_histogram *histogram, uint64_t value)
+{
+	int i;
+
+	i = 63 - __builtin_clzll(value | 1);
+	if (i >= WL_HISTOGRAM_BUCKETS)
+		i = WL_HISTOGRAM_BUCKETS - 1;
+
+	histogram->buckets[i]++;
+	histogram->count++;
+	histogram->sum += value;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+/* An upper bound for the given fraction of the values: the top of
+ * the bucket it falls in. */
+
+WL_EXPORT uint64_t
+wl_histogram_percentile(struct wl_histogram *histogram, double fraction)
+{
+	uint64_t n, rank;
+	int i;
+
+	rank = histogram->count * fraction;
+	for (i = 0, n = 0; i < WL_HISTOGRAM_BUCKETS - 1; i++) {
+		n += histogram->buckets[i];
+		if (n > rank)
+			break;
+	}
+
+	if (i == WL_HISTOGRAM_BUCKETS - 1 ||
+	    histogram->max < (2ull << i))
+		return histogram->max;
+
+	return 2ull << i;
+}
+
+/* One line summary of a histogram of nanoseconds, in microseconds. */
+
+WL_EXPORT int
+wl_histogram_format(struct wl_histogram *histogram, char *buffer, int size)
+{
+	if (histogram->count == 0)
+		return snprintf(buffer, size, "0");
+
+	return snprintf(buffer, size,
+			"%llu, mean %.1f, p50 %.1f, p99 %.1f, max %.1f us",
+			(unsigned long long) histogram->count,
+			histogram->sum / 1e3 / histogram->count,
+			wl_histogram_percentile(histogram, 0.5) / 1e3,
+			wl_histogram_percentile(histogram, 0.99) / 1e3,
+			histogram->max / 1e3);
+}
@@ -6,8 +6,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <dlfcn.h>
 #include <stdarg.h>
 #include <ffi.h>
@@ -18,34 +20,46 @@
 #include "hash.h"
 #include "connection.h"
 
-void wl_list_init(struct wl_list *list)
-{
-	list->prev = list;
-	list->next = list;
-}
+#define WL_DISPLAY_INVALID_OBJECT 0
+#define WL_DISPLAY_INVALID_METHOD 1
+#define WL_DISPLAY_NO_MEMORY 2
+#define WL_DISPLAY_COMMIT_DONE 3
+#define WL_DISPLAY_INVALID_ARGUMENT 4
 
 void
-wl_list_insert(struct wl_list *list, struct wl_list *elm)
+wl_client_destroy(struct wl_client *client);
+
+static void
+wl_client_event(struct wl_client *client, struct wl_object *object, uint32_t event)
 {
-	elm->prev = list;
-	elm->next = list->next;
-	list->next = elm;
-	elm->next->prev = elm;
+	uint32_t p[2];
+
+	p[0] = object->id;
+	p[1] = event | (8 << 16);
+	wl_connection_write(client->connection, p, sizeof p);
 }
 
-void
-wl_list_remove(struct wl_list *elm)
+static void *
+wl_array_add(struct wl_array *array, int size)
 {
-	elm->prev->next = elm->next;
-	elm->next->prev = elm->prev;
-}
+	uint32_t alloc;
+	void *data, *p;
+
+	if (array->size + size > array->alloc) {
+		alloc = array->alloc ? array->alloc : 16 * size;
+		while (alloc < array->size + size)
+			alloc *= 2;
+		data = realloc(array->data, alloc);
+		if (data == NULL)
+			return NULL;
+		array->data = data;
+		array->alloc = alloc;
+	}
 
-static volatile sig_atomic_t display_exit;
+	p = (char *) array->data + array->size;
+	array->size += size;
 
-static void
-sigterm_handler (int sig)
-{
-	display_exit = 1;
+	return p;
 }
 
 static void
@@ -54,41 +68,121 @@ wl_surface_destroy(struct wl_client *client,
 {
 	const struct wl_compositor_interface *interface;
 
+	if (surface->pending) {
+		wl_list_remove(&surface->pending_link);
+		surface->pending = 0;
+	}
+	free(surface->pending_copies.data);
+	free(surface->pending_damage.data);
+	surface->pending_copies.data = NULL;
+	surface->pending_damage.data = NULL;
+	wl_region_fini(&surface->pending_opaque);
+	wl_region_init(&surface->pending_opaque);
+	wl_region_fini(&surface->pending_input);
+	wl_region_init(&surface->pending_input);
+	wl_region_fini(&surface->input);
+	wl_region_init(&surface->input);
+
 	interface = client->display->compositor->interface;
 	interface->notify_surface_destroy(client->display->compositor,
 					  surface);
+	wl_grid_remove(&client->display->grid, &surface->grid);
+	if (client->display->pointer_focus == surface)
+		client->display->pointer_focus = NULL;
 	wl_list_remove(&surface->link);
+	wl_hash_delete(&client->display->objects, &surface->base);
+}
+
+/* Surface requests only record what the client asked for; nothing
+ * reaches the compositor until the client commits. */
+
+static void
+wl_surface_set_pending(struct wl_client *client,
+		       struct wl_surface *surface, uint32_t pending)
+{
+	if (surface->pending == 0)
+		wl_list_insert(client->pending_list.prev,
+			       &surface->pending_link);
+	surface->pending |= pending;
 }
 
 static void
 wl_surface_attach(struct wl_client *client,
 		  struct wl_surface *surface, uint32_t name, 
-		  uint32_t width, uint32_t height, uint32_t stride)
+		  uint32_t width, uint32_t height, uint32_t stride,
+		  uint32_t format)
 {
-	const struct wl_compositor_interface *interface;
+	if (format > WL_SURFACE_FORMAT_RGB565) {
+		printf("bad surface format %u\n", format);
+		return;
+	}
 
-	interface = client->display->compositor->interface;
-	interface->notify_surface_attach(client->display->compositor,
-					 surface, name, width, height, stride);
+	surface->pending_name = name;
+	surface->pending_width = width;
+	surface->pending_height = height;
+	surface->pending_stride = stride;
+	surface->pending_format = format;
+	wl_surface_set_pending(client, surface, WL_SURFACE_PENDING_ATTACH);
 }
 
+/* Rectangles are x, y, width, height quadruples.  The compositor
+ * works with box edges, so reject any whose far edge doesn't fit in
+ * an int32_t; empty ones are ignored later anyway. */
+
+static int
+wl_surface_check_rectangles(const int32_t *p, uint32_t size,
+			    const char *name)
+{
+	const int32_t *end;
+
+	if (size % (4 * sizeof *p) != 0) {
+		printf("bad %s size %d\n", name, size);
+		return -1;
+	}
+
+	end = p + size / sizeof *p;
+	for (; p < end; p += 4) {
+		if ((p[2] > 0 && p[0] > INT32_MAX - p[2]) ||
+		    (p[3] > 0 && p[1] > INT32_MAX - p[3])) {
+			printf("bad %s rectangle %d,%d %dx%d\n",
+			       name, p[0], p[1], p[2], p[3]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* The map goes into the grid and every compositor adds its width
+ * and height to its position, so it has to pass the same check. */
+
 static void
 wl_surface_map(struct wl_client *client, struct wl_surface *surface,
 	       int32_t x, int32_t y, int32_t width, int32_t height)
 {
-	const struct wl_compositor_interface *interface;
+	int32_t r[4] = { x, y, width, height };
 
 	/* FIXME: This needs to take a tri-mesh argument... - count
 	 * and a list of tris. 0 tris means unmap. */
 
-	surface->map.x = x;
-	surface->map.y = y;
-	surface->map.width = width;
-	surface->map.height = height;
+	if (width < 0 || height < 0) {
+		printf("bad map size %dx%d\n", width, height);
+		wl_client_event(client, &client->display->base,
+				WL_DISPLAY_INVALID_ARGUMENT);
+		return;
+	}
 
-	interface = client->display->compositor->interface;
-	interface->notify_surface_map(client->display->compositor,
-				      surface, &surface->map);
+	if (wl_surface_check_rectangles(r, sizeof r, "map") < 0) {
+		wl_client_event(client, &client->display->base,
+				WL_DISPLAY_INVALID_ARGUMENT);
+		return;
+	}
+
+	surface->pending_map.x = x;
+	surface->pending_map.y = y;
+	surface->pending_map.width = width;
+	surface->pending_map.height = height;
+	wl_surface_set_pending(client, surface, WL_SURFACE_PENDING_MAP);
 }
 
 static void
@@ -96,31 +190,246 @@ wl_surface_copy(struct wl_client *client, struct wl_surface *surface,
 		int32_t dst_x, int32_t dst_y, uint32_t name, uint32_t stride,
 		int32_t x, int32_t y, int32_t width, int32_t height)
 {
-	const struct wl_compositor_interface *interface;
+	int32_t *p;
 
-	interface = client->display->compositor->interface;
-	interface->notify_surface_copy(client->display->compositor,
-				       surface, dst_x, dst_y,
-				       name, stride, x, y, width, height);
+	p = wl_array_add(&surface->pending_copies, 8 * sizeof *p);
+	if (p == NULL) {
+		wl_client_event(client, &client->display->base,
+				WL_DISPLAY_NO_MEMORY);
+		return;
+	}
+
+	p[0] = dst_x;
+	p[1] = dst_y;
+	p[2] = name;
+	p[3] = stride;
+	p[4] = x;
+	p[5] = y;
+	p[6] = width;
+	p[7] = height;
+	wl_surface_set_pending(client, surface, WL_SURFACE_PENDING_COPY);
+}
+
+static void
+wl_surface_add_damage(struct wl_client *client, struct wl_surface *surface,
+		      const int32_t *rectangles, uint32_t size)
+{
+	void *p;
+
+	p = wl_array_add(&surface->pending_damage, size);
+	if (p == NULL) {
+		wl_client_event(client, &client->display->base,
+				WL_DISPLAY_NO_MEMORY);
+		return;
+	}
+
+	memcpy(p, rectangles, size);
+	wl_surface_set_pending(client, surface, WL_SURFACE_PENDING_DAMAGE);
 }
 
 static void
 wl_surface_damage(struct wl_client *client, struct wl_surface *surface,
 		  int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	int32_t r[4] = { x, y, width, height };
+
+	if (wl_surface_check_rectangles(r, sizeof r, "damage") < 0)
+		return;
+
+	wl_surface_add_damage(client, surface, r, sizeof r);
+}
+
+/* Batched damage: an array of rectangles. */
+
+static void
+wl_surface_damage_rectangles(struct wl_client *client,
+			     struct wl_surface *surface,
+			     struct wl_array *rectangles)
+{
+	if (wl_surface_check_rectangles(rectangles->data, rectangles->size,
+					"damage array") < 0)
+		return;
+
+	wl_surface_add_damage(client, surface,
+			      rectangles->data, rectangles->size);
+}
+
+/* Replace region with the rectangles of a region request, laid out
+ * like damage_rectangles.  Returns -1 if the request is malformed,
+ * leaving region alone, or if we run out of memory, leaving it
+ * empty. */
+
+static int
+wl_surface_read_region(struct wl_client *client, struct wl_region *region,
+		       struct wl_array *rectangles, const char *name)
+{
+	const int32_t *p, *end;
+
+	if (wl_surface_check_rectangles(rectangles->data, rectangles->size,
+					name) < 0)
+		return -1;
+
+	wl_region_clear(region);
+	p = rectangles->data;
+	end = p + rectangles->size / sizeof *p;
+	for (; p < end; p += 4) {
+		if (wl_region_union_rect(region, p[0], p[1], p[2], p[3]) < 0) {
+			wl_region_clear(region);
+			wl_client_event(client, &client->display->base,
+					WL_DISPLAY_NO_MEMORY);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* The opaque region replaces the previous one at the next commit.
+ * An empty array means no part of the surface is known to be
+ * opaque. */
+
+static void
+wl_surface_set_opaque_region(struct wl_client *client,
+			     struct wl_surface *surface,
+			     struct wl_array *rectangles)
+{
+	if (wl_surface_read_region(client, &surface->pending_opaque,
+				   rectangles, "opaque region") < 0)
+		return;
+	wl_surface_set_pending(client, surface, WL_SURFACE_PENDING_OPAQUE);
+}
+
+/* Likewise for the part of the surface that takes pointer events.
+ * An empty array lets them through to whatever is underneath. */
+
+static void
+wl_surface_set_input_region(struct wl_client *client,
+			    struct wl_surface *surface,
+			    struct wl_array *rectangles)
+{
+	if (wl_surface_read_region(client, &surface->pending_input,
+				   rectangles, "input region") < 0)
+		return;
+	wl_surface_set_pending(client, surface, WL_SURFACE_PENDING_INPUT);
+}
+
+/* Only the last of raise and lower before a commit counts. */
+
+static void
+wl_surface_raise(struct wl_client *client, struct wl_surface *surface)
+{
+	surface->pending &= ~WL_SURFACE_PENDING_LOWER;
+	wl_surface_set_pending(client, surface, WL_SURFACE_PENDING_RAISE);
+}
+
+static void
+wl_surface_lower(struct wl_client *client, struct wl_surface *surface)
+{
+	surface->pending &= ~WL_SURFACE_PENDING_RAISE;
+	wl_surface_set_pending(client, surface, WL_SURFACE_PENDING_LOWER);
+}
+
+/* The grid only holds the map while the surface is indexed, so it's
+ * taken out and put back with the new one. */
+
+static void
+wl_surface_set_map(struct wl_client *client, struct wl_surface *surface,
+		   const struct wl_map *map)
+{
+	struct wl_display *display = client->display;
+
+	surface->map = *map;
+	wl_grid_remove(&display->grid, &surface->grid);
+	surface->grid.map = *map;
+	if (wl_grid_insert(&display->grid, &surface->grid) < 0)
+		wl_client_event(client, &display->base, WL_DISPLAY_NO_MEMORY);
+}
+
+/* Hand everything recorded since the last commit to the compositor:
+ * the last attach and opaque region, then the last map and change
+ * in stacking order, then the copies and damage in the order they
+ * were requested. */
+
+static void
+wl_surface_commit(struct wl_client *client, struct wl_surface *surface)
 {
 	const struct wl_compositor_interface *interface;
+	struct wl_compositor *compositor;
+	const int32_t *p, *end;
+
+	compositor = client->display->compositor;
+	interface = compositor->interface;
+
+	if (surface->pending & WL_SURFACE_PENDING_ATTACH)
+		interface->notify_surface_attach(compositor, surface,
+						 surface->pending_name,
+						 surface->pending_width,
+						 surface->pending_height,
+						 surface->pending_stride,
+						 surface->pending_format);
+
+	if ((surface->pending & WL_SURFACE_PENDING_OPAQUE) &&
+	    interface->notify_surface_opaque)
+		interface->notify_surface_opaque(compositor, surface,
+						 &surface->pending_opaque);
+
+	if (surface->pending & WL_SURFACE_PENDING_INPUT) {
+		if (wl_region_copy(&surface->input,
+				   &surface->pending_input) < 0)
+			wl_client_event(client, &client->display->base,
+					WL_DISPLAY_NO_MEMORY);
+		else
+			surface->input_set = 1;
+	}
 
-	interface = client->display->compositor->interface;
-	interface->notify_surface_damage(client->display->compositor,
-					 surface, x, y, width, height);
+	if (surface->pending & WL_SURFACE_PENDING_MAP) {
+		wl_surface_set_map(client, surface, &surface->pending_map);
+		interface->notify_surface_map(compositor,
+					      surface, &surface->map);
+	}
+
+	if (surface->pending &
+	    (WL_SURFACE_PENDING_RAISE | WL_SURFACE_PENDING_LOWER)) {
+		if (surface->pending & WL_SURFACE_PENDING_RAISE)
+			wl_display_raise_surface(client->display, surface);
+		else
+			wl_display_lower_surface(client->display, surface);
+		if (interface->notify_surface_stack)
+			interface->notify_surface_stack(compositor, surface);
+	}
+
+	p = surface->pending_copies.data;
+	end = p + surface->pending_copies.size / sizeof *p;
+	for (; interface->notify_surface_copy && p < end; p += 8)
+		interface->notify_surface_copy(compositor, surface,
+					       p[0], p[1], p[2], p[3],
+					       p[4], p[5], p[6], p[7]);
+
+	p = surface->pending_damage.data;
+	end = p + surface->pending_damage.size / sizeof *p;
+	for (; interface->notify_surface_damage && p < end; p += 4)
+		interface->notify_surface_damage(compositor, surface,
+						 p[0], p[1], p[2], p[3]);
+
+	surface->pending_copies.size = 0;
+	surface->pending_damage.size = 0;
+	wl_region_clear(&surface->pending_opaque);
+	wl_region_clear(&surface->pending_input);
+	surface->pending = 0;
+	wl_list_remove(&surface->pending_link);
 }
 
 static const struct wl_method surface_methods[] = {
 	WL_DEFMETHOD ("destroy", "", wl_surface_destroy)
-	WL_DEFMETHOD ("attach", "iiii", wl_surface_attach)
+	WL_DEFMETHOD ("attach", "iiiii", wl_surface_attach)
 	WL_DEFMETHOD ("map", "iiii", wl_surface_map)
 	WL_DEFMETHOD ("copy", "iiiiiiii", wl_surface_copy)
 	WL_DEFMETHOD ("damage", "iiii", wl_surface_damage)
+	WL_DEFMETHOD ("damage_rectangles", "a", wl_surface_damage_rectangles)
+	WL_DEFMETHOD ("set_opaque_region", "a", wl_surface_set_opaque_region)
+	WL_DEFMETHOD ("raise", "", wl_surface_raise)
+	WL_DEFMETHOD ("lower", "", wl_surface_lower)
+	WL_DEFMETHOD ("set_input_region", "a", wl_surface_set_input_region)
 };
 
 static const struct wl_interface surface_interface = {
@@ -130,7 +439,8 @@ static const struct wl_interface surface_interface = {
 };
 
 static struct wl_surface *
-wl_surface_create(struct wl_display *display, uint32_t id)
+wl_surface_create(struct wl_display *display,
+		  struct wl_client *client, uint32_t id)
 {
 	struct wl_surface *surface;
 	const struct wl_compositor_interface *interface;
@@ -141,8 +451,20 @@ wl_surface_create(struct wl_display *display, uint32_t id)
 
 	surface->base.id = id;
 	surface->base.interface = &surface_interface;
+	surface->base.signatures = display->surface_signatures;
+	surface->client = client;
+	surface->pending = 0;
+	memset(&surface->pending_copies, 0, sizeof surface->pending_copies);
+	memset(&surface->pending_damage, 0, sizeof surface->pending_damage);
+	wl_region_init(&surface->pending_opaque);
+	wl_region_init(&surface->pending_input);
+	memset(&surface->map, 0, sizeof surface->map);
+	memset(&surface->grid, 0, sizeof surface->grid);
+	wl_region_init(&surface->input);
+	surface->input_set = 0;
 
 	wl_list_insert(display->surface_list.prev, &surface->link);
+	surface->grid.order = ++display->stack_top;
 
 	interface = display->compositor->interface;
 	interface->notify_surface_create(display->compositor, surface);
@@ -162,31 +484,234 @@ wl_surface_get_data(struct wl_surface *surface)
 	return surface->compositor_data;
 }
 
-void
-wl_client_destroy(struct wl_client *client);
+/* The stacking order is the surface list plus a number per surface
+ * that only ever grows at the top and shrinks at the bottom, so
+ * picking can compare surfaces without walking the list.  The grid
+ * keeps its cells sorted by that number, so the surface is taken out
+ * while it changes; going back into the same cells can't fail. */
+
+WL_EXPORT void
+wl_display_raise_surface(struct wl_display *display,
+			 struct wl_surface *surface)
+{
+	if (surface->grid.order == display->stack_top)
+		return;
+
+	wl_list_remove(&surface->link);
+	wl_list_insert(display->surface_list.prev, &surface->link);
+	wl_grid_remove(&display->grid, &surface->grid);
+	surface->grid.order = ++display->stack_top;
+	wl_grid_insert(&display->grid, &surface->grid);
+}
+
+WL_EXPORT void
+wl_display_lower_surface(struct wl_display *display,
+			 struct wl_surface *surface)
+{
+	if (surface->grid.order == display->stack_bottom)
+		return;
+
+	wl_list_remove(&surface->link);
+	wl_list_insert(&display->surface_list, &surface->link);
+	wl_grid_remove(&display->grid, &surface->grid);
+	surface->grid.order = --display->stack_bottom;
+	wl_grid_insert(&display->grid, &surface->grid);
+}
+
+static int
+wl_surface_accepts_input(struct wl_grid_item *item,
+			 int32_t x, int32_t y, void *data)
+{
+	struct wl_surface *surface =
+		container_of(item, struct wl_surface, grid);
+
+	if (!surface->input_set)
+		return 1;
+
+	return wl_region_contains_point(&surface->input,
+					x - surface->map.x, y - surface->map.y);
+}
+
+/* The topmost surface that takes pointer events at x, y, or NULL. */
+
+WL_EXPORT struct wl_surface *
+wl_display_pick_surface(struct wl_display *display, int32_t x, int32_t y)
+{
+	struct wl_grid_item *item;
+
+	item = wl_grid_pick(&display->grid, x, y,
+			    wl_surface_accepts_input, NULL);
+	if (item == NULL)
+		return NULL;
+
+	return container_of(item, struct wl_surface, grid);
+}
 
 static void
-wl_client_event(struct wl_client *client, struct wl_object *object, uint32_t event)
+wl_display_add_found(struct wl_grid_item *item, void *data)
 {
-	uint32_t p[2];
+	struct wl_display *display = data;
+	struct wl_surface **found;
+	int alloc;
 
-	p[0] = object->id;
-	p[1] = event | (8 << 16);
-	wl_connection_write(client->connection, p, sizeof p);
+	if (display->found_count < 0)
+		return;
+
+	if (display->found_count == display->found_alloc) {
+		alloc = display->found_alloc ? display->found_alloc * 2 : 16;
+		found = realloc(display->found, alloc * sizeof *found);
+		if (found == NULL) {
+			display->found_count = -1;
+			return;
+		}
+		display->found = found;
+		display->found_alloc = alloc;
+	}
+
+	display->found[display->found_count++] =
+		container_of(item, struct wl_surface, grid);
 }
 
-#define WL_DISPLAY_INVALID_OBJECT 0
-#define WL_DISPLAY_INVALID_METHOD 1
-#define WL_DISPLAY_NO_MEMORY 2
+static int
+wl_display_compare_found(const void *a, const void *b)
+{
+	const struct wl_surface *sa = *(struct wl_surface * const *) a;
+	const struct wl_surface *sb = *(struct wl_surface * const *) b;
+
+	if (sa->grid.order < sb->grid.order)
+		return -1;
+
+	return sa->grid.order > sb->grid.order;
+}
+
+/* Store the topmost max of the surfaces whose maps intersect rect
+ * in surfaces, bottom to top.  Returns how many there are, which may
+ * be more than max, or -1 if we ran out of memory. */
+
+WL_EXPORT int
+wl_display_get_surfaces(struct wl_display *display,
+			const struct wl_map *rect,
+			struct wl_surface **surfaces, int max)
+{
+	int count;
+
+	display->found_count = 0;
+	wl_grid_for_each(&display->grid, rect, wl_display_add_found, display);
+	count = display->found_count;
+	if (count <= 0)
+		return count;
+
+	qsort(display->found, count, sizeof *display->found,
+	      wl_display_compare_found);
+	if (max > count)
+		max = count;
+	if (max > 0)
+		memcpy(surfaces, display->found + count - max,
+		       max * sizeof *surfaces);
+
+	return count;
+}
+
+/* Method and event signatures of an interface, compiled once when
+ * the interface is registered with the display.  Objects point at
+ * the signatures of their interface from when they're added, so
+ * dispatch and events don't have to look them up. */
+struct wl_interface_signatures {
+	const struct wl_interface *interface;
+	struct wl_signature **methods;
+	struct wl_signature **events;
+	struct wl_list link;
+};
 
 static void
-wl_client_connection_data(int fd, uint32_t mask, void *data)
+wl_client_dispatch(struct wl_client *client, const uint32_t *p)
 {
-	struct wl_client *client = data;
-	struct wl_connection *connection = client->connection;
+	struct wl_display *display = client->display;
 	const struct wl_method *method;
 	struct wl_object *object;
-	uint32_t p[2], opcode, size;
+	uint32_t opcode;
+	uint64_t start = 0;
+
+	if (display->profiling) {
+		client->requests++;
+		client->request_bytes += p[1] >> 16;
+		start = wl_time_now();
+	}
+
+	object = wl_hash_lookup(&display->objects, p[0]);
+	if (object == NULL) {
+		wl_client_event(client, &display->base,
+				WL_DISPLAY_INVALID_OBJECT);
+		return;
+	}
+
+	opcode = p[1] & 0xffff;
+	if (opcode >= object->interface->method_count) {
+		wl_client_event(client, &display->base,
+				WL_DISPLAY_INVALID_METHOD);
+		return;
+	}
+
+	method = &object->interface->methods[opcode];
+	wl_signature_demarshal(object->signatures->methods[opcode],
+			       &display->objects,
+			       FFI_FN(method->func), p, client, object);
+
+	if (start)
+		wl_histogram_add(&client->request_time, wl_time_now() - start);
+}
+
+/* How many requests a client gets to run per event loop iteration.
+ * A client with more requests waiting is put on the loop's check list
+ * and continues after everybody else has had a turn. */
+#define WL_CLIENT_DISPATCH_BUDGET 64
+
+/* Dispatch the complete requests among the len bytes the connection
+ * has buffered, within the client's budget. */
+
+static void
+wl_client_process(struct wl_client *client, int len)
+{
+	struct wl_connection *connection = client->connection;
+	const uint32_t *p;
+	uint32_t size;
+	int budget;
+
+	budget = WL_CLIENT_DISPATCH_BUDGET;
+	while (len >= 2 * sizeof p[0]) {
+		p = wl_connection_view(connection, 2 * sizeof p[0]);
+		size = p[1] >> 16;
+		if (size < 2 * sizeof p[0] || size & 3) {
+			/* We can't find the next message after this. */
+			fprintf(stderr, "bad message size %d from client %p\n",
+				size, client);
+			wl_client_destroy(client);
+			return;
+		}
+		if (len < size)
+			break;
+
+		if (budget-- == 0) {
+			wl_event_source_check(client->source);
+			break;
+		}
+
+		p = wl_connection_view(connection, size);
+		if (p == NULL)
+			wl_client_event(client, &client->display->base,
+					WL_DISPLAY_NO_MEMORY);
+		else
+			wl_client_dispatch(client, p);
+
+		wl_connection_consume(connection, size);
+		len -= size;
+	}
+}
+
+static void
+wl_client_connection_data(int fd, uint32_t mask, void *data)
+{
+	struct wl_client *client = data;
 	uint32_t cmask = 0;
 	int len;
 
@@ -195,53 +720,142 @@ wl_client_connection_data(int fd, uint32_t mask, void *data)
 	if (mask & WL_EVENT_WRITEABLE)
 		cmask |= WL_CONNECTION_WRITABLE;
 
-	len = wl_connection_data(connection, cmask);
+	len = wl_connection_data(client->connection, cmask);
 	if (len < 0) {
 		wl_client_destroy(client);
 		return;
 	}
 
-	while (len >= sizeof p) {
-		wl_connection_copy(connection, p, sizeof p);
-		opcode = p[1] & 0xffff;
-		size = p[1] >> 16;
-		if (len < size)
-			break;
+	wl_client_process(client, len);
+}
 
-		object = wl_hash_lookup(&client->display->objects,
-					p[0]);
-		if (object == NULL) {
-			wl_client_event(client, &client->display->base,
-					WL_DISPLAY_INVALID_OBJECT);
-			wl_connection_consume(connection, size);
-			len -= size;
-			continue;
-		}
-				
-		if (opcode >= object->interface->method_count) {
-			wl_client_event(client, &client->display->base,
-					WL_DISPLAY_INVALID_METHOD);
-			wl_connection_consume(connection, size);
-			len -= size;
-			continue;
+/* On io_uring loops the loop receives for the client and passes the
+ * data along with the completion, which saves the read. */
+
+static void
+wl_client_connection_recv(int fd, uint32_t mask,
+			  const void *buffer, int size, void *data)
+{
+	struct wl_client *client = data;
+	int len;
+
+	if (mask & WL_EVENT_READABLE) {
+		if (size <= 0) {
+			wl_client_destroy(client);
+			return;
 		}
-				
-		method = &object->interface->methods[opcode];
-		wl_connection_demarshal_ffi(client->connection,
-					    &client->display->objects,
-					    FFI_FN(method->func),
-					    method->arguments, client, object);
+		len = wl_connection_receive(client->connection, buffer, size);
+	} else if (mask & WL_EVENT_WRITEABLE) {
+		len = wl_connection_data(client->connection,
+					 WL_CONNECTION_WRITABLE);
+	} else {
+		len = wl_connection_data(client->connection, 0);
+	}
 
-		len -= size;
+	if (len < 0) {
+		wl_client_destroy(client);
+		return;
+	}
+
+	wl_client_process(client, len);
+}
+
+/* Requests read on an I/O thread arrive here, on the compositor
+ * thread, in the order the client sent them. */
+
+static void
+wl_client_io_dispatch(void *data, const uint32_t *message)
+{
+	struct wl_client *client = data;
+	struct iovec iov;
+
+	/* The socket is read on the I/O thread, so record the requests
+	 * here, where they arrive in order. */
+	if (client->display->capture) {
+		iov.iov_base = (void *) message;
+		iov.iov_len = message[1] >> 16;
+		wl_capture_record(client->display->capture,
+				  client->capture_id, WL_CAPTURE_REQUEST,
+				  &iov, 1);
+	}
+
+	wl_client_dispatch(client, message);
+}
+
+static void
+wl_client_io_error(void *data)
+{
+	wl_client_destroy(data);
+}
+
+static const struct wl_io_interface client_io_interface = {
+	wl_client_io_dispatch,
+	wl_client_io_error
+};
+
+/* With I/O threads, reading is paused and resumed on the client's
+ * I/O thread, and the socket is only polled for writability on the
+ * compositor thread while output is backed up. */
+
+static int
+wl_client_io_update(struct wl_client *client, uint32_t mask, uint32_t changed)
+{
+	struct wl_event_loop *loop = client->display->loop;
+
+	if (changed & WL_CONNECTION_READABLE) {
+		if (mask & WL_CONNECTION_READABLE)
+			wl_io_client_resume(client->io);
+		else
+			wl_io_client_pause(client->io);
+	}
+
+	if (changed & WL_CONNECTION_WRITABLE) {
+		if (mask & WL_CONNECTION_WRITABLE) {
+			client->source =
+				wl_event_loop_add_fd(loop, client->fd,
+						     WL_EVENT_WRITEABLE,
+						     wl_client_connection_data,
+						     client);
+			if (client->source == NULL)
+				return -1;
+		} else if (client->source != NULL) {
+			wl_event_loop_remove_source(loop, client->source);
+			client->source = NULL;
+		}
 	}
+
+	return 0;
 }
 
+/* Client connections are corked: instead of polling for writability
+ * as soon as there is output, a connection with pending output joins
+ * the flush list, and the whole list is written out once per event
+ * loop iteration.  Only a socket that fills up gets polled for
+ * writability. */
+
 static int
 wl_client_connection_update(struct wl_connection *connection,
 			    uint32_t mask, void *data)
 {
 	struct wl_client *client = data;
-	uint32_t emask = 0;
+	uint32_t emask = 0, changed;
+
+	changed = mask ^ client->mask;
+	client->mask = mask;
+
+	if (changed & WL_CONNECTION_FLUSH) {
+		if (mask & WL_CONNECTION_FLUSH)
+			wl_list_insert(client->display->flush_list.prev,
+				       &client->flush_link);
+		else
+			wl_list_remove(&client->flush_link);
+	}
+
+	if (!(changed & (WL_CONNECTION_READABLE | WL_CONNECTION_WRITABLE)))
+		return 0;
+
+	if (client->io != NULL)
+		return wl_client_io_update(client, mask, changed);
 
 	if (mask & WL_CONNECTION_READABLE)
 		emask |= WL_EVENT_READABLE;
@@ -249,7 +863,80 @@ wl_client_connection_update(struct wl_connection *connection,
 		emask |= WL_EVENT_WRITEABLE;
 
 	return wl_event_loop_update_source(client->display->loop,
-					   client->source, mask);
+					   client->source, emask);
+}
+
+/* On io_uring loops the flush list goes out in batches, each with a
+ * single system call. */
+#define WL_DISPLAY_FLUSH_BATCH 64
+
+static void
+wl_display_flush_batched(struct wl_display *display)
+{
+	struct wl_event_loop_write writes[WL_DISPLAY_FLUSH_BATCH];
+	struct wl_client *clients[WL_DISPLAY_FLUSH_BATCH];
+	struct iovec iov[WL_DISPLAY_FLUSH_BATCH][2];
+	struct wl_client *client;
+	struct wl_list *node;
+	int i, count;
+
+	node = display->flush_list.next;
+	while (node != &display->flush_list) {
+		count = 0;
+		while (node != &display->flush_list &&
+		       count < WL_DISPLAY_FLUSH_BATCH) {
+			client = container_of(node, struct wl_client,
+					      flush_link);
+			node = node->next;
+			writes[count].count =
+				wl_connection_get_output(client->connection,
+							 iov[count]);
+			if (writes[count].count < 0) {
+				wl_client_destroy(client);
+				continue;
+			}
+			if (writes[count].count == 0) {
+				wl_connection_written(client->connection, 0);
+				continue;
+			}
+			writes[count].fd = client->fd;
+			writes[count].iov = iov[count];
+			clients[count++] = client;
+		}
+
+		if (wl_event_loop_writev(display->loop, writes, count) < 0) {
+			for (i = 0; i < count; i++)
+				writes[i].result = -EIO;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (wl_connection_written(clients[i]->connection,
+						  writes[i].result) < 0)
+				wl_client_destroy(clients[i]);
+		}
+	}
+}
+
+static void
+wl_display_flush_clients(void *data)
+{
+	struct wl_display *display = data;
+	struct wl_client *client;
+	struct wl_list *node, *next;
+
+	if (wl_event_loop_get_backend(display->loop) ==
+	    WL_EVENT_LOOP_IO_URING) {
+		wl_display_flush_batched(display);
+		return;
+	}
+
+	for (node = display->flush_list.next;
+	     node != &display->flush_list; node = next) {
+		next = node->next;
+		client = container_of(node, struct wl_client, flush_link);
+		if (wl_connection_flush(client->connection) < 0)
+			wl_client_destroy(client);
+	}
 }
 
 static void
@@ -281,8 +968,17 @@ advertise_objects(struct wl_client *client, struct wl_display *display)
 		advertise_object(client, ref->object);
 		node = ref->link.next;
 	}
+}
 
-	wl_connection_data(client->connection, WL_CONNECTION_WRITABLE);
+static void
+wl_client_capture(void *data, uint32_t direction,
+		  const struct iovec *iov, int count)
+{
+	struct wl_client *client = data;
+
+	wl_capture_record(client->display->capture, client->capture_id,
+			  direction == WL_CONNECTION_CAPTURE_IN ?
+			  WL_CAPTURE_REQUEST : WL_CAPTURE_EVENT, iov, count);
 }
 
 static struct wl_client *
@@ -296,13 +992,41 @@ wl_client_create(struct wl_display *display, int fd)
 
 	memset(client, 0, sizeof *client);
 	client->display = display;
-	client->source = wl_event_loop_add_fd(display->loop, fd,
-					      WL_EVENT_READABLE,
-					      wl_client_connection_data, client);
+	client->fd = fd;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (display->io_pool != NULL) {
+		client->io = wl_io_client_create(display->io_pool, fd, client);
+		if (client->io == NULL) {
+			free(client);
+			return NULL;
+		}
+	} else {
+		client->source =
+			wl_event_loop_add_recv(display->loop, fd,
+					       WL_EVENT_READABLE,
+					       wl_client_connection_recv,
+					       client);
+		if (client->source == NULL)
+			client->source =
+				wl_event_loop_add_fd(display->loop, fd,
+						     WL_EVENT_READABLE,
+						     wl_client_connection_data,
+						     client);
+	}
+	client->mask = WL_CONNECTION_READABLE;
 	client->connection = wl_connection_create(fd,
 						  wl_client_connection_update, 
 						  client);
+	wl_connection_cork(client->connection);
+	wl_connection_set_limit(client->connection,
+				display->client_buffer_limit);
+	if (display->capture) {
+		client->capture_id = wl_capture_add_client(display->capture);
+		wl_connection_set_capture(client->connection,
+					  wl_client_capture, client);
+	}
 	wl_list_init(&client->object_list);
+	wl_list_init(&client->pending_list);
 
 	wl_connection_write(client->connection,
 			    &display->client_id_range,
@@ -323,7 +1047,13 @@ wl_client_destroy(struct wl_client *client)
 
 	printf("disconnect from client %p\n", client);
 
+	if (client->display->capture)
+		wl_capture_record(client->display->capture, client->capture_id,
+				  WL_CAPTURE_DISCONNECT, NULL, 0);
+
 	wl_list_remove(&client->link);
+	if (client->mask & WL_CONNECTION_FLUSH)
+		wl_list_remove(&client->flush_link);
 
 	while (client->object_list.next != &client->object_list) {
 		ref = container_of(client->object_list.next,
@@ -333,7 +1063,11 @@ wl_client_destroy(struct wl_client *client)
 		free(ref);
 	}
 
-	wl_event_loop_remove_source(client->display->loop, client->source);
+	if (client->source != NULL)
+		wl_event_loop_remove_source(client->display->loop,
+					    client->source);
+	if (client->io != NULL)
+		wl_io_client_destroy(client->io);
 	wl_connection_destroy(client->connection);
 	free(client);
 }
@@ -345,7 +1079,7 @@ wl_display_create_surface(struct wl_client *client,
 	struct wl_surface *surface;
 	struct wl_object_ref *ref;
 
-	surface = wl_surface_create(display, id);
+	surface = wl_surface_create(display, client, id);
 
 	ref = malloc(sizeof *ref);
 	if (ref == NULL) {
@@ -361,14 +1095,44 @@ wl_display_create_surface(struct wl_client *client,
 	return 0;
 }
 
+/* Apply the pending state of all the client's surfaces at once.  The
+ * cookie comes back in a commit_done event once the result is on
+ * screen. */
+
+static int
+wl_display_commit(struct wl_client *client,
+		  struct wl_display *display, uint32_t cookie)
+{
+	const struct wl_compositor_interface *interface;
+	struct wl_surface *surface;
+
+	while (client->pending_list.next != &client->pending_list) {
+		surface = container_of(client->pending_list.next,
+				       struct wl_surface, pending_link);
+		wl_surface_commit(client, surface);
+	}
+
+	client->commit_cookie = cookie;
+	client->commit_pending = 1;
+
+	interface = display->compositor->interface;
+	if (interface->notify_commit)
+		interface->notify_commit(display->compositor);
+
+	return 0;
+}
+
 static const struct wl_method display_methods[] = {
 	WL_DEFMETHOD ("create_surface", "O", wl_display_create_surface)
+	WL_DEFMETHOD ("commit", "i", wl_display_commit)
 };
 
 static const struct wl_event display_events[] = {
 	WL_DEFEVENT ("invalid_object", "")
 	WL_DEFEVENT ("invalid_method", "")
 	WL_DEFEVENT ("no_memory", "")
+	WL_DEFEVENT ("commit_done", "i")
+	WL_DEFEVENT ("invalid_argument", "")
 };
 
 static const struct wl_interface display_interface = {
@@ -377,12 +1141,85 @@ static const struct wl_interface display_interface = {
 	ARRAY_LENGTH(display_events), display_events,
 };
 
+static struct wl_interface_signatures *
+wl_display_add_interface(struct wl_display *display,
+			 const struct wl_interface *interface)
+{
+	struct wl_interface_signatures *signatures;
+	struct wl_list *node;
+	int i;
+
+	for (node = display->interface_list.next;
+	     node != &display->interface_list; node = node->next) {
+		signatures = container_of(node,
+					  struct wl_interface_signatures, link);
+		if (signatures->interface == interface)
+			return signatures;
+	}
+
+	signatures = malloc(sizeof *signatures);
+	if (signatures == NULL)
+		return NULL;
+
+	signatures->interface = interface;
+	signatures->methods =
+		calloc(interface->method_count, sizeof signatures->methods[0]);
+	signatures->events =
+		calloc(interface->event_count, sizeof signatures->events[0]);
+	if ((interface->method_count > 0 && signatures->methods == NULL) ||
+	    (interface->event_count > 0 && signatures->events == NULL))
+		goto fail;
+
+	for (i = 0; i < interface->method_count; i++) {
+		signatures->methods[i] =
+			wl_signature_create(interface->methods[i].arguments);
+		if (signatures->methods[i] == NULL)
+			goto fail;
+	}
+
+	for (i = 0; i < interface->event_count; i++) {
+		signatures->events[i] =
+			wl_signature_create(interface->events[i].arguments);
+		if (signatures->events[i] == NULL)
+			goto fail;
+	}
+
+	wl_list_insert(display->interface_list.prev, &signatures->link);
+
+	return signatures;
+
+fail:
+	for (i = 0; signatures->methods && i < interface->method_count; i++)
+		if (signatures->methods[i])
+			wl_signature_destroy(signatures->methods[i]);
+	for (i = 0; signatures->events && i < interface->event_count; i++)
+		if (signatures->events[i])
+			wl_signature_destroy(signatures->events[i]);
+	free(signatures->methods);
+	free(signatures->events);
+	free(signatures);
+
+	return NULL;
+}
+
+WL_EXPORT int
+wl_display_register_interface(struct wl_display *display,
+			      const struct wl_interface *interface)
+{
+	return wl_display_add_interface(display, interface) ? 0 : -1;
+}
+
 WL_EXPORT int
 wl_display_register_global_object(struct wl_display *display,
 				  struct wl_object *object)
 {
 	struct wl_object_ref *ref;
 
+	object->signatures = wl_display_add_interface(display,
+						      object->interface);
+	if (object->signatures == NULL)
+		return -1;
+
 	ref = malloc(sizeof *ref);
 	if (ref == NULL)
 		return -1;
@@ -403,6 +1240,16 @@ wl_display_create_backend_advertisement(struct wl_display *display)
 	wl_display_register_global_object (display, backend_adv);
 }
 
+static void
+wl_display_create_debug_object(struct wl_display *display)
+{
+	struct wl_object *debug;
+
+	debug = wl_debug_object_create(display, 3);
+	if (debug != NULL)
+		wl_display_register_global_object(display, debug);
+}
+
 
 WL_EXPORT struct wl_display *
 wl_display_create(struct wl_backend *backend, struct wl_compositor *compositor)
@@ -427,6 +1274,8 @@ wl_display_create(struct wl_backend *backend, struct wl_compositor *compositor)
 	display->loop = wl_event_loop_create();
 	if (display->loop == NULL)
 		goto fail;
+	wl_event_loop_set_flush_func(display->loop,
+				     wl_display_flush_clients, display);
 
 	display->backend = backend;
 	display->compositor = compositor;
@@ -435,11 +1284,23 @@ wl_display_create(struct wl_backend *backend, struct wl_compositor *compositor)
 	wl_hash_insert(&display->objects, &display->base);
 	wl_list_init(&display->surface_list);
 	wl_list_init(&display->client_list);
+	wl_list_init(&display->flush_list);
 	wl_list_init(&display->global_objects_list);
+	wl_list_init(&display->interface_list);
+
+	display->base.signatures =
+		wl_display_add_interface(display, &display_interface);
+	display->surface_signatures =
+		wl_display_add_interface(display, &surface_interface);
+	if (display->base.signatures == NULL ||
+	    display->surface_signatures == NULL)
+		goto fail;
 
 	wl_display_create_backend_advertisement(display);
+	wl_display_create_debug_object(display);
 
 	display->client_id_range = 256; /* Gah, arbitrary... */
+	display->client_buffer_limit = 256 * 1024;
 
 	return display;		
 
@@ -448,27 +1309,69 @@ fail:
 	return NULL;
 }
 
-/* TODO: this is inefficient, it marshals data repeatedly!  */
+/* Events are broadcast by marshalling them once and appending the
+ * same bytes to every client's out buffer, or just to target's if
+ * there is one.  Coalescible events may replace a queued copy
+ * instead. */
 
-WL_EXPORT void
-wl_display_vsend_event(struct wl_display *display, struct wl_object *sender,
-		       uint32_t opcode, va_list va)
+static void
+wl_display_vsend_event_to(struct wl_display *display,
+			  struct wl_client *target, struct wl_object *sender,
+			  uint32_t opcode, va_list va)
 {
+	const struct wl_interface_signatures *signatures = sender->signatures;
 	struct wl_client *client;
+	uint32_t stack[64], *data;
+	int (*write_event)(struct wl_connection *connection,
+			   const void *data, size_t count);
+	va_list va2;
+	int size;
+
+	va_copy (va2, va);
+	data = stack;
+	size = wl_signature_vmarshal(signatures->events[opcode],
+				     &display->objects, sender->id, opcode,
+				     data, sizeof stack, va);
+	if (size > sizeof stack) {
+		data = malloc(size);
+		if (data != NULL)
+			wl_signature_vmarshal(signatures->events[opcode],
+					      &display->objects, sender->id,
+					      opcode, data, size, va2);
+	}
+	va_end (va2);
 
-	client = container_of(display->client_list.next,
-			      struct wl_client, link);
-	while (&client->link != &display->client_list) {
-		va_list va2;
-		va_copy (va2, va);
-		wl_connection_vmarshal(client->connection, &display->objects,
-				       sender->id, opcode,
-				       sender->interface->events[opcode].arguments,
-				       va2);
+	if (size < 0 || data == NULL) {
+		fprintf(stderr, "failed to marshal event %d of %s\n",
+			opcode, sender->interface->name);
+		return;
+	}
 
-		client = container_of(client->link.next,
-				   struct wl_client, link);
+	write_event = wl_connection_write;
+	if (sender->interface->events[opcode].flags & WL_EVENT_COALESCE)
+		write_event = wl_connection_write_coalesced;
+
+	if (target != NULL) {
+		write_event(target->connection, data, size);
+	} else {
+		client = container_of(display->client_list.next,
+				      struct wl_client, link);
+		while (&client->link != &display->client_list) {
+			write_event(client->connection, data, size);
+			client = container_of(client->link.next,
+					      struct wl_client, link);
+		}
 	}
+
+	if (data != stack)
+		free(data);
+}
+
+WL_EXPORT void
+wl_display_vsend_event(struct wl_display *display, struct wl_object *sender,
+		       uint32_t opcode, va_list va)
+{
+	wl_display_vsend_event_to(display, NULL, sender, opcode, va);
 }
 
 WL_EXPORT void
@@ -480,7 +1383,134 @@ wl_display_send_event(struct wl_display *display, struct wl_object *sender,
 	wl_display_vsend_event (display, sender, opcode, va);
 }
 
+WL_EXPORT void
+wl_client_send_event(struct wl_client *client, struct wl_object *sender,
+		     uint32_t opcode, ...)
+{
+	va_list va;
+
+	va_start (va, opcode);
+	wl_display_vsend_event_to(client->display, client, sender, opcode, va);
+	va_end (va);
+}
+
+/* Pointer events only go to the client owning the surface under the
+ * pointer, so the others can sleep while it moves.  The focus follows
+ * the pointer with leave and enter events, except while a button is
+ * down: then the surface that got the press keeps getting motion
+ * until the last release, even outside its map.  A press over no
+ * surface, or one whose surface goes away, doesn't hold the focus.
+ * Clients watching the pointer get all motion besides. */
+
 static void
+wl_display_set_pointer_focus(struct wl_display *display,
+			     struct wl_object *device,
+			     struct wl_surface *surface)
+{
+	struct wl_surface *focus = display->pointer_focus;
+
+	if (surface == focus)
+		return;
+
+	if (focus != NULL)
+		wl_client_send_event(focus->client, device,
+				     WL_INPUT_DEVICE_LEAVE, focus->base.id);
+	display->pointer_focus = surface;
+	if (surface != NULL)
+		wl_client_send_event(surface->client, device,
+				     WL_INPUT_DEVICE_ENTER, surface->base.id,
+				     display->pointer_x - surface->map.x,
+				     display->pointer_y - surface->map.y);
+}
+
+WL_EXPORT void
+wl_display_post_pointer_motion(struct wl_display *display,
+			       struct wl_object *device,
+			       int32_t x, int32_t y)
+{
+	struct wl_surface *focus;
+	struct wl_client *client, *target = NULL;
+
+	display->pointer_x = x;
+	display->pointer_y = y;
+	if (display->pointer_buttons == 0 || display->pointer_focus == NULL)
+		wl_display_set_pointer_focus(display, device,
+					     wl_display_pick_surface(display,
+								     x, y));
+
+	focus = display->pointer_focus;
+	if (focus != NULL) {
+		target = focus->client;
+		wl_client_send_event(target, device, WL_INPUT_DEVICE_MOTION,
+				     x, y, x - focus->map.x, y - focus->map.y);
+	}
+
+	client = container_of(display->client_list.next,
+			      struct wl_client, link);
+	while (&client->link != &display->client_list) {
+		if (client->pointer_watch && client != target)
+			wl_client_send_event(client, device,
+					     WL_INPUT_DEVICE_MOTION,
+					     x, y, x, y);
+		client = container_of(client->link.next,
+				      struct wl_client, link);
+	}
+}
+
+WL_EXPORT void
+wl_display_post_pointer_button(struct wl_display *display,
+			       struct wl_object *device,
+			       uint32_t button, uint32_t state)
+{
+	if (state)
+		display->pointer_buttons++;
+	else if (display->pointer_buttons > 0)
+		display->pointer_buttons--;
+
+	if (display->pointer_focus != NULL)
+		wl_client_send_event(display->pointer_focus->client, device,
+				     WL_INPUT_DEVICE_BUTTON, button, state);
+
+	/* A drag may end over another surface. */
+	if (display->pointer_buttons == 0)
+		wl_display_set_pointer_focus(display, device,
+					     wl_display_pick_surface(display,
+								     display->pointer_x,
+								     display->pointer_y));
+}
+
+WL_EXPORT void
+wl_client_watch_pointer(struct wl_client *client)
+{
+	client->pointer_watch = 1;
+}
+
+/* Called by the compositor once a frame is on screen.  Every client
+ * that committed since the previous frame gets its last cookie
+ * back. */
+
+WL_EXPORT void
+wl_display_post_frame(struct wl_display *display)
+{
+	struct wl_client *client;
+	uint32_t p[3];
+
+	client = container_of(display->client_list.next,
+			      struct wl_client, link);
+	while (&client->link != &display->client_list) {
+		if (client->commit_pending) {
+			p[0] = display->base.id;
+			p[1] = WL_DISPLAY_COMMIT_DONE | (sizeof p << 16);
+			p[2] = client->commit_cookie;
+			wl_connection_write(client->connection, p, sizeof p);
+			client->commit_pending = 0;
+		}
+		client = container_of(client->link.next,
+				      struct wl_client, link);
+	}
+}
+
+WL_EXPORT void
 wl_display_destroy(struct wl_display *display)
 {
 	const struct wl_compositor_interface *interface;
@@ -488,6 +1518,147 @@ wl_display_destroy(struct wl_display *display)
 	interface = display->compositor->interface;
 	if (interface->notify_display_destroy)
 		interface->notify_display_destroy(display->compositor, display);
+
+	if (display->io_pool != NULL)
+		wl_io_pool_destroy(display->io_pool);
+	if (display->capture != NULL)
+		wl_capture_destroy(display->capture);
+	wl_grid_release(&display->grid);
+	free(display->found);
+}
+
+/* Set how many bytes of unsent events a client may have queued.
+ * Past half of that the client's requests are no longer read until
+ * it catches up, and past the limit it is disconnected. */
+
+WL_EXPORT void
+wl_display_set_client_buffer_limit(struct wl_display *display,
+				   uint32_t limit)
+{
+	struct wl_client *client;
+
+	display->client_buffer_limit = limit;
+
+	client = container_of(display->client_list.next,
+			      struct wl_client, link);
+	while (&client->link != &display->client_list) {
+		wl_connection_set_limit(client->connection, limit);
+		client = container_of(client->link.next,
+				      struct wl_client, link);
+	}
+}
+
+/* Read client requests on COUNT threads of their own instead of on
+ * the compositor thread.  Only clients that connect afterwards are
+ * affected, so this is best done right after creating the display. */
+
+WL_EXPORT int
+wl_display_set_io_threads(struct wl_display *display, int count)
+{
+	if (display->io_pool != NULL || count <= 0)
+		return -1;
+
+	display->io_pool = wl_io_pool_create(display->loop, count,
+					     &client_io_interface);
+	if (display->io_pool == NULL)
+		return -1;
+
+	return 0;
+}
+
+static void
+wl_display_print_line(const char *line, void *data)
+{
+	printf("%s\n", line);
+}
+
+static void
+wl_display_dump_signal(int signal_number, void *data)
+{
+	wl_display_dump_profile(data, wl_display_print_line, NULL);
+}
+
+/* Profile where the compositor thread spends its time: dispatch time
+ * per event source and per client request, idle callback latency and
+ * repaint time.  While profiling, SIGUSR2 prints the profile to
+ * stdout, and clients can ask for it through the debug global. */
+
+WL_EXPORT int
+wl_display_set_profiling(struct wl_display *display, int enable)
+{
+	struct wl_client *client;
+	struct wl_list *node;
+
+	if (enable && !display->profiling) {
+		display->profile_source =
+			wl_event_loop_add_signal(display->loop, SIGUSR2,
+						 wl_display_dump_signal,
+						 display);
+		if (display->profile_source == NULL)
+			return -1;
+
+		for (node = display->client_list.next;
+		     node != &display->client_list; node = node->next) {
+			client = container_of(node, struct wl_client, link);
+			client->requests = 0;
+			client->request_bytes = 0;
+			memset(&client->request_time, 0,
+			       sizeof client->request_time);
+		}
+	} else if (!enable && display->profiling) {
+		wl_event_loop_remove_source(display->loop,
+					    display->profile_source);
+		display->profile_source = NULL;
+	}
+
+	display->profiling = enable;
+	wl_event_loop_set_profiling(display->loop, enable);
+
+	return 0;
+}
+
+WL_EXPORT void
+wl_display_dump_profile(struct wl_display *display,
+			wl_event_loop_profile_func_t func, void *data)
+{
+	struct wl_client *client;
+	struct wl_list *node;
+	char line[256], summary[160];
+
+	if (!display->profiling) {
+		func("profiling is off", data);
+		return;
+	}
+
+	wl_event_loop_dump_profile(display->loop, func, data);
+
+	for (node = display->client_list.next;
+	     node != &display->client_list; node = node->next) {
+		client = container_of(node, struct wl_client, link);
+		wl_histogram_format(&client->request_time,
+				    summary, sizeof summary);
+		snprintf(line, sizeof line,
+			 "client %p: %llu requests, %llu bytes, time %s",
+			 client, (unsigned long long) client->requests,
+			 (unsigned long long) client->request_bytes, summary);
+		func(line, data);
+	}
+}
+
+/* Record the traffic of all clients that connect from now on to a
+ * capture file, for replaying with wayland-replay. */
+
+WL_EXPORT int
+wl_display_set_capture(struct wl_display *display, const char *path)
+{
+	if (display->capture != NULL)
+		return -1;
+
+	display->capture = wl_capture_create(path);
+	if (display->capture == NULL)
+		return -1;
+
+	return 0;
 }
 
 WL_EXPORT struct wl_event_loop *
@@ -502,14 +1673,40 @@ wl_display_get_backend(struct wl_display *display)
 	return display->backend;
 }
 
+static void
+wl_display_terminate(int signal_number, void *data)
+{
+	struct wl_display *display = data;
+
+	display->run = 0;
+}
+
 static void
 wl_display_run(struct wl_display *display)
 {
-	signal (SIGTERM, sigterm_handler);
-	signal (SIGINT, sigterm_handler);
-	display_exit = 0;
-	while (!display_exit)
+	struct wl_event_loop_stats loop_stats;
+	struct wl_connection_stats connection_stats;
+	struct wl_event_source *term, *intr;
+
+	term = wl_event_loop_add_signal(display->loop, SIGTERM,
+					wl_display_terminate, display);
+	intr = wl_event_loop_add_signal(display->loop, SIGINT,
+					wl_display_terminate, display);
+	display->run = 1;
+	while (display->run)
 		wl_event_loop_wait(display->loop);
+	wl_event_loop_remove_source(display->loop, term);
+	wl_event_loop_remove_source(display->loop, intr);
+
+	wl_event_loop_get_stats(display->loop, &loop_stats);
+	wl_connection_get_stats(&connection_stats);
+	printf("syscalls: %llu waits, %llu epoll_ctl, %llu submits, "
+	       "%llu readv, %llu writev\n",
+	       (unsigned long long) loop_stats.waits,
+	       (unsigned long long) loop_stats.updates,
+	       (unsigned long long) loop_stats.submits,
+	       (unsigned long long) connection_stats.reads,
+	       (unsigned long long) connection_stats.writes);
 }
 
 /* The plan here is to generate a random anonymous socket name and
@@ -572,14 +1769,18 @@ WL_EXPORT struct wl_surface_iterator *
 wl_surface_iterator_create(struct wl_display *display, uint32_t mask)
 {
 	struct wl_surface_iterator *iterator;
+	struct wl_list *first;
 
 	iterator = malloc(sizeof *iterator);
 	if (iterator == NULL)
 		return NULL;
 
+	if (mask & WL_SURFACE_ITERATOR_TOP_DOWN)
+		first = display->surface_list.prev;
+	else
+		first = display->surface_list.next;
 	iterator->head = &display->surface_list;
-	iterator->surface = container_of(display->surface_list.next,
-					 struct wl_surface, link);
+	iterator->surface = container_of(first, struct wl_surface, link);
 	iterator->mask = mask;
 
 	return iterator;
@@ -589,12 +1790,17 @@ WL_EXPORT int
 wl_surface_iterator_next(struct wl_surface_iterator *iterator,
 			 struct wl_surface **surface)
 {
+	struct wl_list *next;
+
 	if (&iterator->surface->link == iterator->head)
 		return 0;
 
 	*surface = iterator->surface;
-	iterator->surface = container_of(iterator->surface->link.next,
-					 struct wl_surface, link);
+	if (iterator->mask & WL_SURFACE_ITERATOR_TOP_DOWN)
+		next = iterator->surface->link.prev;
+	else
+		next = iterator->surface->link.next;
+	iterator->surface = container_of(next, struct wl_surface, link);
 
 	return 1;
 }
@@ -645,6 +1851,7 @@ int main(int argc, char *argv[])
 {
 	struct wl_display *display;
 	const char *compositor = "./egl-compositor.so";
+	const char *io_threads, *capture;
 
 	if (argc >= 2)
 		compositor = argv[1];
@@ -652,6 +1859,22 @@ int main(int argc, char *argv[])
 		argv[1] = strdup (compositor);
 
 	display = load_compositor(argc - 1, argv + 1);
+
+	if (getenv("WAYLAND_PROFILE") != NULL &&
+	    wl_display_set_profiling(display, 1) < 0)
+		fprintf(stderr, "failed to turn on profiling\n");
+
+	capture = getenv("WAYLAND_CAPTURE");
+	if (capture != NULL && wl_display_set_capture(display, capture) < 0)
+		fprintf(stderr, "failed to open capture file %s: %m\n",
+			capture);
+
+	io_threads = getenv("WAYLAND_IO_THREADS");
+	if (io_threads != NULL &&
+	    wl_display_set_io_threads(display, atoi(io_threads)) < 0)
+		fprintf(stderr, "failed to start %s I/O threads, "
+			"reading clients on the main thread\n", io_threads);
+
 	if (wl_display_add_socket(display)) {
 		fprintf(stderr, "failed to add socket: %m\n");
 		exit(EXIT_FAILURE);
@@ -26,6 +26,21 @@ void wl_list_init(struct wl_list *list);
 void wl_list_insert(struct wl_list *list, struct wl_list *elm);
 void wl_list_remove(struct wl_list *elm);
 
+/* Log-bucketed histograms, for durations in nanoseconds. */
+#define WL_HISTOGRAM_BUCKETS 32
+
+struct wl_histogram {
+	uint64_t count, sum, max;
+	uint64_t buckets[WL_HISTOGRAM_BUCKETS];
+};
+
+uint64_t wl_time_now(void);
+void wl_histogram_add(struct wl_histogram *histogram, uint64_t value);
+uint64_t wl_histogram_percentile(struct wl_histogram *histogram,
+				 double fraction);
+int wl_histogram_format(struct wl_histogram *histogram,
+			char *buffer, int size);
+
 enum {
 	WL_EVENT_READABLE = 0x01,
 	WL_EVENT_WRITEABLE = 0x02
@@ -33,15 +48,49 @@ enum {
 
 struct wl_event_loop;
 struct wl_event_source;
+struct iovec;
 typedef void (*wl_event_loop_fd_func_t)(int fd, uint32_t mask, void *data);
 typedef void (*wl_event_loop_idle_func_t)(void *data);
+typedef void (*wl_event_loop_timer_func_t)(void *data);
+typedef void (*wl_event_loop_signal_func_t)(int signal_number, void *data);
+typedef void (*wl_event_loop_flush_func_t)(void *data);
+typedef void (*wl_event_loop_profile_func_t)(const char *line, void *data);
+typedef void (*wl_event_loop_recv_func_t)(int fd, uint32_t mask,
+					  const void *buffer, int size,
+					  void *data);
+
+enum {
+	WL_EVENT_LOOP_EPOLL,
+	WL_EVENT_LOOP_IO_URING
+};
+
+/* System calls made by an event loop: waits, epoll_ctl() calls and
+ * io_uring submissions that don't wait for events. */
+struct wl_event_loop_stats {
+	uint64_t waits, updates, submits;
+};
+
+struct wl_event_loop_write {
+	int fd;
+	const struct iovec *iov;
+	int count;
+	int result;
+};
 
 struct wl_event_loop *wl_event_loop_create(void);
+struct wl_event_loop *wl_event_loop_create_backend(uint32_t backend);
+uint32_t wl_event_loop_get_backend(struct wl_event_loop *loop);
 void wl_event_loop_destroy(struct wl_event_loop *loop);
 struct wl_event_source *wl_event_loop_add_fd(struct wl_event_loop *loop,
 					     int fd, uint32_t mask,
 					     wl_event_loop_fd_func_t func,
 					     void *data);
+struct wl_event_source *wl_event_loop_add_recv(struct wl_event_loop *loop,
+					       int fd, uint32_t mask,
+					       wl_event_loop_recv_func_t func,
+					       void *data);
+int wl_event_loop_writev(struct wl_event_loop *loop,
+			 struct wl_event_loop_write *writes, int count);
 int wl_event_loop_update_source(struct wl_event_loop *loop,
 				struct wl_event_source *source,
 				uint32_t mask);
@@ -52,13 +101,234 @@ int wl_event_loop_wait(struct wl_event_loop *loop);
 struct wl_event_source *wl_event_loop_add_idle(struct wl_event_loop *loop,
 					       wl_event_loop_idle_func_t func,
 					       void *data);
+struct wl_event_source *wl_event_loop_add_timer(struct wl_event_loop *loop,
+						wl_event_loop_timer_func_t func,
+						void *data);
+int wl_event_source_timer_update(struct wl_event_source *source, int delay);
+void wl_event_source_check(struct wl_event_source *source);
+void wl_event_source_set_priority(struct wl_event_source *source, int priority);
+struct wl_event_source *wl_event_loop_add_signal(struct wl_event_loop *loop,
+						 int signal_number,
+						 wl_event_loop_signal_func_t func,
+						 void *data);
+void wl_event_loop_set_flush_func(struct wl_event_loop *loop,
+				  wl_event_loop_flush_func_t func,
+				  void *data);
+void wl_event_loop_get_stats(struct wl_event_loop *loop,
+			     struct wl_event_loop_stats *stats);
+void wl_event_loop_set_profiling(struct wl_event_loop *loop, int enable);
+void wl_event_loop_dump_profile(struct wl_event_loop *loop,
+				wl_event_loop_profile_func_t func,
+				void *data);
+
+struct wl_frame_clock;
+typedef void (*wl_frame_clock_func_t)(void *data);
+
+struct wl_frame_clock_stats {
+	uint64_t frames, missed;
+};
+
+struct wl_frame_clock *wl_frame_clock_create(struct wl_event_loop *loop,
+					     uint32_t refresh, uint32_t lead,
+					     wl_frame_clock_func_t func,
+					     void *data);
+void wl_frame_clock_destroy(struct wl_frame_clock *clock);
+void wl_frame_clock_set_refresh(struct wl_frame_clock *clock,
+				uint32_t refresh, uint32_t lead);
+void wl_frame_clock_schedule(struct wl_frame_clock *clock);
+void wl_frame_clock_get_stats(struct wl_frame_clock *clock,
+			      struct wl_frame_clock_stats *stats);
+
+/* Software composition into 32 bit XRGB/premultiplied ARGB images. */
+enum {
+	WL_COMPOSITE_SRC,
+	WL_COMPOSITE_OVER
+};
+
+struct wl_image {
+	uint32_t *data;
+	int32_t width, height, stride;
+};
+
+struct wl_map {
+	int32_t x, y, width, height;
+};
+
+void wl_composite_fill(struct wl_image *dst, const struct wl_map *clip,
+		       int32_t x, int32_t y, int32_t width, int32_t height,
+		       uint32_t color);
+void wl_composite_image(struct wl_image *dst, const struct wl_map *clip,
+			int32_t x, int32_t y, const struct wl_image *src,
+			uint32_t op);
+void wl_composite_convert_rgb565(struct wl_image *dst,
+				 const void *src, int32_t stride);
+int wl_composite_set_kernel(const char *name);
+const char *wl_composite_get_kernel(void);
+
+/* Sets of pixels as y-x banded lists of disjoint boxes. */
+struct wl_box {
+	int32_t x1, y1, x2, y2;
+};
+
+struct wl_region {
+	struct wl_box extents;
+	struct wl_box *boxes;
+	int count, alloc;
+};
+
+void wl_region_init(struct wl_region *region);
+int wl_region_init_rect(struct wl_region *region,
+			int32_t x, int32_t y, int32_t width, int32_t height);
+void wl_region_fini(struct wl_region *region);
+void wl_region_clear(struct wl_region *region);
+int wl_region_copy(struct wl_region *dst, const struct wl_region *src);
+int wl_region_is_empty(const struct wl_region *region);
+int wl_region_contains_point(const struct wl_region *region,
+			     int32_t x, int32_t y);
+void wl_region_translate(struct wl_region *region, int32_t dx, int32_t dy);
+int wl_region_union(struct wl_region *dst,
+		    const struct wl_region *a, const struct wl_region *b);
+int wl_region_intersect(struct wl_region *dst,
+			const struct wl_region *a, const struct wl_region *b);
+int wl_region_subtract(struct wl_region *dst,
+		       const struct wl_region *a, const struct wl_region *b);
+int wl_region_union_rect(struct wl_region *region,
+			 int32_t x, int32_t y, int32_t width, int32_t height);
+int wl_region_intersect_rect(struct wl_region *region,
+			     int32_t x, int32_t y, int32_t width, int32_t height);
+
+/* Damage to an output of width by height, which falls back to the
+ * whole output when there's no memory to track it more closely. */
+struct wl_damage {
+	struct wl_region region;
+	int32_t width, height;
+};
+
+int wl_damage_init(struct wl_damage *damage, int32_t width, int32_t height);
+void wl_damage_fini(struct wl_damage *damage);
+void wl_damage_all(struct wl_damage *damage);
+void wl_damage_add(struct wl_damage *damage,
+		   int32_t x, int32_t y, int32_t width, int32_t height);
+void wl_damage_add_region(struct wl_damage *damage,
+			  const struct wl_region *region);
+void wl_damage_clip(struct wl_damage *damage);
+
+/* Tiled, multi-threaded repaint of a stack of images. */
+struct wl_renderer;
+
+struct wl_renderer_layer {
+	struct wl_image image;
+	int32_t x, y;
+	struct wl_map clip;
+	uint32_t op;
+	/* Fully opaque part of the image, relative to x, y, or NULL. */
+	const struct wl_region *opaque;
+};
+
+struct wl_renderer *wl_renderer_create(struct wl_image *target,
+				       struct wl_image *front,
+				       int thread_count);
+void wl_renderer_destroy(struct wl_renderer *renderer);
+void wl_renderer_damage(struct wl_renderer *renderer,
+			int32_t x, int32_t y, int32_t width, int32_t height);
+void wl_renderer_damage_region(struct wl_renderer *renderer,
+			       const struct wl_region *region);
+int wl_renderer_render(struct wl_renderer *renderer,
+		       const struct wl_renderer_layer *layers, int count,
+		       uint32_t background);
+struct wl_damage *wl_renderer_get_damage(struct wl_renderer *renderer);
+
+/* What of each of a stack of surfaces is visible within some damage,
+ * worked out top down: the damage a surface covers within its opaque
+ * region can be copied, the rest of what it covers is blended, and
+ * whatever no surface covers is left for the background. */
+struct wl_cull_item {
+	/* Where it draws on the output, and its opaque region
+	 * relative to x, y, or NULL. */
+	struct wl_map rect;
+	int32_t x, y;
+	const struct wl_region *opaque;
+	struct wl_region copy, blend;
+	void *data;
+};
+
+struct wl_cull {
+	struct wl_cull_item *items;
+	int count, alloc;
+	struct wl_region uncovered;
+};
+
+typedef void (*wl_cull_box_func_t)(struct wl_cull_item *item, int blend,
+				   const struct wl_box *box, void *data);
+
+void wl_cull_init(struct wl_cull *cull);
+void wl_cull_fini(struct wl_cull *cull);
+void wl_cull_clear(struct wl_cull *cull);
+int wl_cull_add(struct wl_cull *cull, const struct wl_map *rect,
+		int32_t x, int32_t y, const struct wl_region *opaque,
+		void *data);
+int wl_cull_run(struct wl_cull *cull, const struct wl_region *damage);
+void wl_cull_for_each_box(struct wl_cull *cull,
+			  wl_cull_box_func_t func, void *data);
+
+/* What a compositor keeps per surface to work out its damage and
+ * what it may skip drawing: where it's mapped, the size and format
+ * of its buffer, content damage in surface coordinates, which is
+ * clipped to the map and added to the output's damage at repaint,
+ * and the client's opaque region and the fully opaque part we draw
+ * with, both in surface coordinates. */
+struct wl_renderer_surface {
+	struct wl_map map;
+	int32_t width, height;
+	uint32_t format;
+	struct wl_region damage;
+	struct wl_region opaque_hint, opaque;
+	/* RGB565 contents expanded to XRGB for the software renderer,
+	 * and whether that's out of date. */
+	struct wl_image rgb;
+	int stale;
+};
+
+void wl_renderer_surface_init(struct wl_renderer_surface *rs);
+void wl_renderer_surface_fini(struct wl_renderer_surface *rs);
+void wl_renderer_surface_attach(struct wl_renderer_surface *rs,
+				struct wl_damage *output,
+				int32_t width, int32_t height, uint32_t format);
+void wl_renderer_surface_set_opaque(struct wl_renderer_surface *rs,
+				    struct wl_damage *output,
+				    const struct wl_region *opaque);
+void wl_renderer_surface_map(struct wl_renderer_surface *rs,
+			     struct wl_damage *output,
+			     const struct wl_map *map);
+void wl_renderer_surface_damage_map(struct wl_renderer_surface *rs,
+				    struct wl_damage *output);
+void wl_renderer_surface_damage(struct wl_renderer_surface *rs,
+				struct wl_damage *output,
+				int32_t x, int32_t y,
+				int32_t width, int32_t height);
+void wl_renderer_surface_flush_damage(struct wl_renderer_surface *rs,
+				      struct wl_damage *output);
+int wl_renderer_surface_add_layer(struct wl_renderer_surface *rs,
+				  void *data, int32_t stride,
+				  struct wl_renderer_layer **layers,
+				  int *alloc, int count);
 
 struct wl_client;
 struct wl_compositor;
 
+/* Pixel formats of attached buffers.  ARGB is premultiplied; the top
+ * byte of XRGB pixels is ignored, so XRGB and RGB565 surfaces are
+ * opaque. */
+enum {
+	WL_SURFACE_FORMAT_ARGB8888,
+	WL_SURFACE_FORMAT_XRGB8888,
+	WL_SURFACE_FORMAT_RGB565
+};
+
 enum {
 	WL_ARGUMENT_UINT32 = 'i',
 	WL_ARGUMENT_STRING = 's',
+	WL_ARGUMENT_ARRAY = 'a',
 	WL_ARGUMENT_POINTER = 'p',
 	WL_ARGUMENT_OBJECT = 'o',
 	WL_ARGUMENT_INTERFACE = '{',
@@ -71,13 +341,19 @@ struct wl_method {
 	const char *arguments;
 };
 
+/* An event that only carries the latest state, so one still waiting
+ * to be sent is replaced by the next rather than followed by it. */
+#define WL_EVENT_COALESCE 0x01
+
 struct wl_event {
 	const char *name;
 	const char *arguments;
+	uint32_t flags;
 };
 
 #define WL_DEFMETHOD(name, args, func) {name, func, "pp|" args },
-#define WL_DEFEVENT(name, args) {name, args},
+#define WL_DEFEVENT(name, args) {name, args, 0},
+#define WL_DEFEVENT_COALESCE(name, args) {name, args, WL_EVENT_COALESCE},
 
 struct wl_interface {
 	const char *name;
@@ -88,18 +364,18 @@ struct wl_interface {
 	const struct wl_event *events;
 };
 
+struct wl_interface_signatures;
+
 struct wl_object {
 	const struct wl_interface *interface;
 	uint32_t id;
+	/* Compiled when the object is added to the display. */
+	const struct wl_interface_signatures *signatures;
 };
 
 struct wl_surface;
 struct wl_display;
 
-struct wl_map {
-	int32_t x, y, width, height;
-};
-
 struct wl_backend *wl_backend_create(const char *name, const char *args);
 
 struct wl_event_loop *wl_display_get_event_loop(struct wl_display *display);
@@ -107,13 +383,60 @@ void wl_display_vsend_event(struct wl_display *display, struct wl_object *sender
 			    uint32_t event, va_list va);
 void wl_display_send_event(struct wl_display *display, struct wl_object *sender,
 			   uint32_t event, ...);
+void wl_client_send_event(struct wl_client *client, struct wl_object *sender,
+			  uint32_t event, ...);
 struct wl_backend *wl_display_get_backend(struct wl_display *display);
+void wl_display_set_client_buffer_limit(struct wl_display *display,
+					uint32_t limit);
+int wl_display_set_io_threads(struct wl_display *display, int count);
+int wl_display_set_profiling(struct wl_display *display, int enable);
+int wl_display_set_capture(struct wl_display *display, const char *path);
+void wl_display_dump_profile(struct wl_display *display,
+			     wl_event_loop_profile_func_t func, void *data);
+void wl_display_post_frame(struct wl_display *display);
+int wl_display_register_interface(struct wl_display *display,
+				  const struct wl_interface *interface);
 int wl_display_register_global_object(struct wl_display *display,
 				      struct wl_object *object);
 
 void wl_surface_set_data(struct wl_surface *surface, void *data);
 void *wl_surface_get_data(struct wl_surface *surface);
 
+/* Stacking order and picking.  Surfaces start out on top. */
+void wl_display_raise_surface(struct wl_display *display,
+			      struct wl_surface *surface);
+void wl_display_lower_surface(struct wl_display *display,
+			      struct wl_surface *surface);
+struct wl_surface *wl_display_pick_surface(struct wl_display *display,
+					   int32_t x, int32_t y);
+int wl_display_get_surfaces(struct wl_display *display,
+			    const struct wl_map *rect,
+			    struct wl_surface **surfaces, int max);
+
+/* Events of input devices.  Input devices hand pointer events to the
+ * display, which sends them to the client whose surface has the
+ * pointer focus.  Motion carries the screen position and the position
+ * relative to the surface; enter carries the latter. */
+enum {
+	WL_INPUT_DEVICE_MOTION,
+	WL_INPUT_DEVICE_BUTTON,
+	WL_INPUT_DEVICE_ENTER,
+	WL_INPUT_DEVICE_LEAVE
+};
+
+void wl_display_post_pointer_motion(struct wl_display *display,
+				    struct wl_object *device,
+				    int32_t x, int32_t y);
+void wl_display_post_pointer_button(struct wl_display *display,
+				    struct wl_object *device,
+				    uint32_t button, uint32_t state);
+void wl_client_watch_pointer(struct wl_client *client);
+
+/* Iterators go bottom to top unless asked otherwise. */
+enum {
+	WL_SURFACE_ITERATOR_TOP_DOWN = 0x01
+};
+
 struct wl_surface_iterator;
 struct wl_surface_iterator *
 wl_surface_iterator_create(struct wl_display *display, uint32_t mask);
@@ -123,9 +446,12 @@ void wl_surface_iterator_destroy(struct wl_surface_iterator *iterator);
 
 struct wl_display *
 wl_display_create(struct wl_backend *backend, struct wl_compositor *compositor);
+void wl_display_destroy(struct wl_display *display);
 
 struct wl_object *
 wl_backend_advertisement_create(struct wl_display *display, uint32_t id);
+struct wl_object *
+wl_debug_object_create(struct wl_display *display, uint32_t id);
 
 struct wl_compositor {
 	const struct wl_compositor_interface *interface;
@@ -140,7 +466,7 @@ struct wl_compositor_interface {
 				      struct wl_surface *surface,
 				      uint32_t name, 
 				      uint32_t width, uint32_t height,
-				      uint32_t stride);
+				      uint32_t stride, uint32_t format);
 	void (*notify_surface_map)(struct wl_compositor *compositor,
 				   struct wl_surface *surface,
 				   struct wl_map *map);
@@ -157,6 +483,19 @@ struct wl_compositor_interface {
 
 	void (*notify_display_destroy)(struct wl_compositor *compositor,
 				       struct wl_display *display);
+	/* A client committed; the changes should make it into the
+	 * next frame. */
+	void (*notify_commit)(struct wl_compositor *compositor);
+	/* The part of the surface the client promises is opaque, in
+	 * surface coordinates.  Called after attach on commit, only
+	 * when the client set a new region. */
+	void (*notify_surface_opaque)(struct wl_compositor *compositor,
+				      struct wl_surface *surface,
+				      const struct wl_region *opaque);
+	/* The client raised or lowered the surface.  Called after
+	 * map on commit. */
+	void (*notify_surface_stack)(struct wl_compositor *compositor,
+				     struct wl_surface *surface);
 };
 
 struct wl_display *wl_compositor_init(int argc, char **argv);
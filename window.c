@@ -159,11 +159,13 @@ draw_window(void *data)
 
 	cairo_surface_destroy(surface);
 
-	wl_surface_attach_buffer(window->surface, buffer);
+	wl_surface_attach_buffer(window->surface, buffer,
+				 WL_SURFACE_FORMAT_ARGB8888);
 
 	wl_surface_map(window->surface, 
 		       window->x, window->y,
 		       buffer->width, buffer->height);
+	wl_display_commit(window->display, 0);
 
 	/* FIXME: Free window->buffer when we receive the ack event. */
 #if 0
@@ -221,6 +223,7 @@ event_handler(struct wl_display *display, uint32_t id,
 			window->y = window->drag_y + arg2;
 			wl_surface_map(window->surface, window->x, window->y,
 				       window->buffer->width, window->buffer->height);
+			wl_display_commit(window->display, 0);
 			break;
 		case WINDOW_RESIZING_LOWER_RIGHT:
 			window->width = window->drag_x + arg1;
@@ -352,6 +355,7 @@ draw(gpointer data)
 				       50 + (window->height - 50 - 300) / 2,
 				       buffer,
 				       0, 0, buffer->width, buffer->height);
+		wl_display_commit(window->display, 0);
 	}
 
 	window->gears_angle += 1;